@@ -76,6 +76,11 @@ void Error_Handler(void);
 
 /* USER CODE BEGIN Private defines */
 #define SD_SPI_HANDLE (hspi3)
+#define SD_SPI_USE_DMA 1
+/* Disk layers stacked by MX_FATFS_Init, see there for their RAM budget */
+#define USER_CACHE_ENABLE 1
+#define USER_PREFETCH_ENABLE 1
+#define USER_QUEUE_ENABLE 1
 /* USER CODE END Private defines */
 
 #ifdef __cplusplus
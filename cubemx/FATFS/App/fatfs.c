@@ -33,7 +33,25 @@ void MX_FATFS_Init(void)
   retUSER = FATFS_LinkDriver(&USER_Driver, USERPath);
 
   /* USER CODE BEGIN Init */
-  /* additional user code for init */
+  /* Stack the layers enabled in main.h between FatFs and the SPI driver.
+     FatFs takes about 22 KiB of static RAM as set in ffconf.h, and the
+     layers are sized to add no more than 10 KiB together, so that the card
+     stack stays within a quarter of the 128 KiB SRAM */
+  const Diskio_drvTypeDef *lower = &USER_SPI_Driver;
+
+#if USER_QUEUE_ENABLE
+  USER_QUEUE_link(lower); /* Write queue, 2 KiB */
+  lower = &USER_QUEUE_Driver;
+#endif
+#if USER_PREFETCH_ENABLE
+  USER_PREFETCH_link(lower); /* Read-ahead, 4 KiB */
+  lower = &USER_PREFETCH_Driver;
+#endif
+#if USER_CACHE_ENABLE
+  USER_CACHE_link(lower); /* Sector cache, 4 KiB */
+  lower = &USER_CACHE_Driver;
+#endif
+  USER_link(lower);
   /* USER CODE END Init */
 }
 
@@ -28,6 +28,10 @@
 #include "user_diskio.h" /* defines USER_Driver as external */
 
 /* USER CODE BEGIN Includes */
+#include "user_diskio_spi.h"
+#include "user_diskio_cache.h"
+#include "user_diskio_prefetch.h"
+#include "user_diskio_queue.h"
 
 /* USER CODE END Includes */
 
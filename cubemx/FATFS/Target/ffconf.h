@@ -45,8 +45,8 @@
 /   3: f_lseek() function is removed in addition to 2. */
 
 #define _USE_STRFUNC         2      /* 0:Disable or 1-2:Enable */
-/* This option switches string functions, f_gets(), f_putc(), f_puts() and
-/  f_printf().
+/* This option switches string functions, f_gets(), f_putc(), f_puts(),
+/  f_printf() and the line reader, f_lineopen() and f_getline().
 /
 /  0: Disable string functions.
 /  1: Enable without LF-CRLF conversion.
@@ -56,14 +56,79 @@
 /* This option switches filtered directory read functions, f_findfirst() and
 /  f_findnext(). (0:Disable, 1:Enable 2:Enable with matching altname[] too) */
 
+#define _USE_READDIRN        1
+/* This option switches batched directory read function, f_readdirn(). It fills
+/  an array of compact items (FILEENT) in a call, with or without their names,
+/  to list a large directory with fewer calls and less copying than f_readdir().
+/  (0:Disable or 1:Enable) */
+
 #define _USE_MKFS            1
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 #define _USE_FASTSEEK        1
 /* This option switches fast seek feature. (0:Disable or 1:Enable) */
 
-#define	_USE_EXPAND		0
-/* This option switches f_expand function. (0:Disable or 1:Enable) */
+#define _USE_LINKMAP         1
+#define _LINKMAP_FRAGS       32
+/* When _USE_LINKMAP is 1, each open file records the fragments of its cluster chain
+/  while FatFs follows it, so that going back to a mapped cluster in f_lseek(), f_read()
+/  or f_write() needs no FAT access. The fragments are taken from a pool of
+/  _LINKMAP_FRAGS items (12 bytes each) in the file system object, shared by all files
+/  open on the volume. A file that cannot get more of them follows the rest of its
+/  chain on the FAT. A link map table given by the application (_USE_FASTSEEK) takes
+/  precedence. (0:Disable or 1:Enable) */
+
+#define _USE_FREEMAP         0
+#define _FREEMAP_CLST        65536
+#define _FREEMAP_SCAN        4
+/* When _USE_FREEMAP is 1, a bitmap with one bit per cluster tells which clusters
+/  of a FAT16/32 volume are free. It is built at mount time by reading the FAT
+/  _FREEMAP_SCAN sectors at a time and then kept in sync with the FAT, so that
+/  allocating a cluster and f_getfree() need no FAT scan. The bitmaps take
+/  _FREEMAP_CLST / 8 bytes per volume and the scan buffer _FREEMAP_SCAN * _MAX_SS
+/  bytes, 18 KiB as set here. A volume with more than _FREEMAP_CLST clusters is used
+/  without bitmap, which is the case for most SDHC cards as formatted (a 4 GB card
+/  with 32 KiB clusters already has about 120000), so enable it only for volumes
+/  known to fit. This option has no effect at _FS_READONLY == 1. (0:Disable or
+/  1:Enable) */
+
+#define _USE_FILEBUF         1
+#define _FILEBUF_SECT        4
+#define _FILEBUF_NUM         2
+/* When _USE_FILEBUF is 1, an open file buffers up to _FILEBUF_SECT consecutive sectors
+/  instead of one, in a buffer taken from a pool of _FILEBUF_NUM buffers per volume, so
+/  that small sequential f_read() and f_write() calls reach the device as multiple
+/  sector transfers. A read loads the sectors ahead up to the end of the cluster or the
+/  file, and written sectors are held until the file leaves the buffered run or is
+/  synchronized. A file takes a buffer at its first transfer and holds it for as long
+/  as it is open, up to f_close() (or a failed f_open()), so only the first
+/  _FILEBUF_NUM files opened at a time get one and the others work on their own
+/  single sector buffer. The pool takes _FILEBUF_NUM * _FILEBUF_SECT * _MAX_SS bytes
+/  per volume (4 KiB as set here), on top of the _MAX_SS bytes each file object holds
+/  unless _FILEBUF_SHARE is 1. This option cannot be used with _FS_TINY.
+/  (0:Disable or 1:Enable) */
+
+#define _FILEBUF_SHARE       1
+/* When _FILEBUF_SHARE is 1, the file object has no sector buffer of its own and the
+/  files of a volume share the buffers of the pool. A file that finds the pool empty
+/  takes the least recently used buffer from another file, preferring one without
+/  unwritten data, after writing back the data held in it. The file that lost its
+/  buffer reloads the current sector at its next access, and the buffer of a file
+/  object dropped without f_close() is taken the same way. This saves _MAX_SS bytes per
+/  file object, at the cost of extra transfers while more files than _FILEBUF_NUM are
+/  in use by turns. This option has no effect at _USE_FILEBUF == 0. (0:Disable or
+/  1:Enable) */
+
+#define	_USE_EXPAND		1
+#define _EXPAND_SYNC         2048
+/* This option switches f_expand function. (0:Disable or 1:Enable)
+/  f_expand() with opt 2 reserves the contiguous block for a stream: the file grows
+/  into it from size 0 with no FAT access, and the part of the block not written is
+/  released at f_close(), also after a disk error on the file. While the stream grows,
+/  its directory entry is updated each time the file size passes a multiple of
+/  _EXPAND_SYNC sectors (0:only at f_sync() and f_close()). Until f_close() succeeds,
+/  a power loss or a FAT that cannot be written leaves the whole block allocated to
+/  the file as lost clusters past its size. */
 
 #define _USE_CHMOD		0
 /* This option switches attribute manipulation functions, f_chmod() and f_utime().
@@ -125,6 +190,48 @@
 /  memory for the working buffer, memory management functions, ff_memalloc() and
 /  ff_memfree(), must be added to the project. */
 
+
+#define _USE_ALIASMAP   1
+#define _ALIASMAP_SIZE  1024
+/* When _USE_ALIASMAP is 1, the short names of the directory where a numbered short
+/  name was last generated are kept in a bit set (a Bloom filter with two bits per
+/  name) of _ALIASMAP_SIZE bytes per volume. It is built with a single scan of the
+/  directory and updated as objects are created in it, so that a free numbered name
+/  is picked without searching the directory for each candidate. The directory is
+/  searched only when the set cannot rule out any of the candidates. This option
+/  has no effect at _USE_LFN == 0 or _FS_READONLY == 1. (0:Disable or 1:Enable) */
+
+
+#define _USE_DIRINDEX   1
+#define _DIRINDEX_SIZE  8192
+#define _DIRINDEX_MIN   256
+/* When _USE_DIRINDEX is 1, an index of _DIRINDEX_SIZE bytes per volume (256 to 65536)
+/  keeps a filter of the names in each sector of one directory, so that finding an
+/  object there (f_open, f_stat and every function that follows a path) reads only
+/  the sectors whose filter has the name instead of scanning the directory, and new
+/  entries are looked for from the first free one on. The index is built for a
+/  directory when a search in it went through _DIRINDEX_MIN entries or more,
+/  replacing the index of the previous one, and is kept up to date as objects are
+/  created and removed. A filter takes 16 bytes per sector and is halved each time
+/  the directory outgrows the index, down to 1 byte, so that a larger directory only
+/  has more false hits: at 8192 bytes, a directory of 5000 files with long names
+/  (938 sectors) has 8 bytes per sector, and a name that is not there passes the
+/  filters of about 5 of them. Sectors the index cannot cover at 1 byte
+/  are searched without it. This option has no effect at _USE_LFN == 0 and on the
+/  exFAT volume. (0:Disable or 1:Enable) */
+
+
+#define _USE_DENTCACHE  1
+#define _DENTCACHE_SIZE 16
+/* When _USE_DENTCACHE is 1, the location of the last _DENTCACHE_SIZE objects found
+/  while following a path is kept per volume, keyed by the directory and a hash of
+/  the segment name, and the least recently used one is replaced by a new one. A
+/  segment found in the cache is checked by reading the entry of the object only,
+/  so that a path that was followed before (f_open, f_stat, f_opendir, f_unlink and
+/  so on) costs no directory search. Entries are dropped as objects are removed or
+/  renamed. The cache takes _DENTCACHE_SIZE * 12 bytes per volume. This option has
+/  no effect on the exFAT volume. (0:Disable or 1:Enable) */
+
 #define _LFN_UNICODE    0 /* 0:ANSI/OEM or 1:Unicode */
 /* This option switches character encoding on the API. (0:ANSI/OEM or 1:UTF-16)
 /  To use Unicode string for the path name, enable LFN and set _LFN_UNICODE = 1.
@@ -199,6 +306,47 @@ characters for /  the drive ID strings are: A-Z and 0-9. */
 /  bit1=1: Do not trust last allocated cluster number in the FSINFO.
 */
 
+#define _FS_LAZYMIRROR      1
+#define _LAZYMIRROR_RANGES  8
+#define _LAZYMIRROR_XFER    4
+/* When _FS_LAZYMIRROR is 1, a changed FAT sector is written to the first FAT only
+/  and recorded in a table of up to _LAZYMIRROR_RANGES sector ranges. The other FAT
+/  copies are brought up to date from the first one in a single pass, sorted and
+/  with up to _LAZYMIRROR_XFER sectors per transfer, when the volume is synchronized
+/  (f_sync, f_close and the other functions that change the volume) or unmounted
+/  with f_mount(). When the table is full, the nearest range is widened. The first
+/  FAT is always up to date. The transfer buffer takes _LAZYMIRROR_XFER * _MAX_SS
+/  bytes. This option has no effect at _FS_READONLY == 1. (0:Disable or 1:Enable) */
+
+
+#define _FS_ZEROFILL        1
+#define _ZEROFILL_XFER      8
+/* When _FS_ZEROFILL is 1, a cluster allocated to a directory (f_mkdir and a growing
+/  directory) is cleared with disk_ioctl(CTRL_ZERO) when the device can fill sectors
+/  with zeros by itself, and otherwise with multiple sector writes of a constant zero
+/  block of _ZEROFILL_XFER sectors instead of a single sector write per sector. The
+/  zero block takes _ZEROFILL_XFER * _MAX_SS bytes of ROM. This option has no effect
+/  at _FS_READONLY == 1. (0:Disable or 1:Enable) */
+
+
+#define _FS_LAZYSYNC        1
+#define _LAZYSYNC_SECT      128
+#define _LAZYSYNC_MS        5000
+#define _LAZYSYNC_TICK()    HAL_GetTick()
+/* When _FS_LAZYSYNC is 1, f_sync() on a file that has only grown since its directory
+/  entry was last updated writes the data and FAT sectors to the device but leaves
+/  the directory entry and the FSINFO for later, until the file has grown by
+/  _LAZYSYNC_SECT sectors or _LAZYSYNC_MS milliseconds of _LAZYSYNC_TICK() have
+/  passed. f_close() always updates them. The directory entry is marked while its
+/  size may be behind. A file left open by a reset keeps the size of its last
+/  directory update, so it loses the data synced after that, at most _LAZYSYNC_SECT
+/  sectors written within _LAZYSYNC_MS milliseconds, and never shows data beyond it.
+/  f_open() of a marked file for writing releases the clusters appended since that
+/  update and clears the mark, and f_open() for reading only leaves it to a later
+/  write open. Files on exFAT volumes and streams made by f_expand() are always
+/  synced at once. This option has no effect at _FS_READONLY == 1. (0:Disable or
+/  1:Enable) */
+
 /*---------------------------------------------------------------------------/
 / System Configurations
 /----------------------------------------------------------------------------*/
@@ -209,6 +357,21 @@ characters for /  the drive ID strings are: A-Z and 0-9. */
 /  Instead of private sector buffer eliminated from the file object, common sector
 /  buffer in the file system object (FATFS) is used for the file data transfer. */
 
+#define _USE_WINCACHE    1
+#define _WINCACHE_FAT    4
+#define _WINCACHE_DIR    4
+#define _WINCACHE_WAYS   2
+/* When _USE_WINCACHE is 1, the disk access window of the file system object is a
+/  set-associative cache of sectors instead of a single sector, so that FAT and
+/  directory sectors used in turn stay in memory. _WINCACHE_FAT sectors are kept for
+/  the FAT area and _WINCACHE_DIR sectors for all other sectors (directories, boot
+/  and FSINFO), _WINCACHE_WAYS of them per set. Both sizes need to be a multiple of
+/  _WINCACHE_WAYS. Each sector takes _MAX_SS bytes in the file system object and
+/  the hits and misses of the pools are counted in whit[] and wmiss[] (0:FAT,
+/  1:others) to size them. Dirty sectors are written back on eviction and on any
+/  flush of the window. This option cannot be used with _FS_TINY.
+/  (0:Disable or 1:Enable) */
+
 #define _FS_EXFAT	0
 /* This option switches support of exFAT file system. (0:Disable or 1:Enable)
 /  When enable exFAT, also LFN needs to be enabled. (_USE_LFN >= 1)
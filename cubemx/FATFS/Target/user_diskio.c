@@ -45,6 +45,15 @@
 static volatile DSTATUS Stat = STA_NOINIT;
 
 #include "user_diskio_spi.h"
+
+/* Disk layer the requests are forwarded to, the SPI driver unless USER_link
+   stacks other layers (e.g. the sector cache) on top of it */
+static const Diskio_drvTypeDef *Lower = &USER_SPI_Driver;
+
+void USER_link(const Diskio_drvTypeDef *lower)
+{
+  Lower = lower;
+}
 /* USER CODE END DECL */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -83,7 +92,7 @@ DSTATUS USER_initialize (
 )
 {
   /* USER CODE BEGIN INIT */
-    return USER_SPI_initialize(pdrv);
+    return Lower->disk_initialize(pdrv);
   /* USER CODE END INIT */
 }
 
@@ -97,7 +106,7 @@ DSTATUS USER_status (
 )
 {
   /* USER CODE BEGIN STATUS */
-    return USER_SPI_status(pdrv); // ADD THIS LINE
+    return Lower->disk_status(pdrv);
   /* USER CODE END STATUS */
 }
 
@@ -117,7 +126,7 @@ DRESULT USER_read (
 )
 {
   /* USER CODE BEGIN READ */
-    return USER_SPI_read(pdrv, buff, sector, count); // ADD THIS LINE
+    return Lower->disk_read(pdrv, buff, sector, count);
   /* USER CODE END READ */
 }
 
@@ -139,7 +148,7 @@ DRESULT USER_write (
 {
   /* USER CODE BEGIN WRITE */
     /* USER CODE HERE */
-    return USER_SPI_write(pdrv, buff, sector, count); // ADD THIS LINE
+    return Lower->disk_write(pdrv, buff, sector, count);
   /* USER CODE END WRITE */
 }
 #endif /* _USE_WRITE == 1 */
@@ -159,7 +168,7 @@ DRESULT USER_ioctl (
 )
 {
   /* USER CODE BEGIN IOCTL */
-    return USER_SPI_ioctl(pdrv, cmd, buff); // ADD THIS LINE
+    return Lower->disk_ioctl(pdrv, cmd, buff);
   /* USER CODE END IOCTL */
 }
 #endif /* _USE_IOCTL == 1 */
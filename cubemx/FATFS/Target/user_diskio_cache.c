@@ -0,0 +1,303 @@
+/**
+ ******************************************************************************
+ * @file    user_diskio_cache.c
+ * @brief   This file contains the implementation of the user_diskio_cache
+ *          write-back sector cache layer.
+ ******************************************************************************
+ */
+
+// FatFs keeps a single sector window per volume plus a single sector buffer
+// per file, so FAT, directory and data sectors keep evicting each other. This
+// layer sits between user_diskio.c and the SPI driver and holds the most
+// recently used single sectors.
+
+// Single sector requests (the ones FatFs makes for FAT and directory access
+// and for partial file sectors) go through the cache. Multiple sector
+// requests are file data moved straight to or from the caller's buffer, so
+// they bypass it and do not evict the metadata, only reusing or updating
+// sectors that are already cached.
+
+#include "user_diskio_cache.h"
+#include <string.h>
+
+#if USER_CACHE_ENABLE
+
+#if _MAX_SS != _MIN_SS
+#error "user_diskio_cache supports only a fixed sector size"
+#endif
+
+#define SLOT_VALID 0x01 /* Slot holds a sector */
+#define SLOT_DIRTY 0x02 /* Sector is newer than on the lower layer */
+
+typedef struct {
+    DWORD sector;  /* Sector held by the slot */
+    uint32_t used; /* UseClock at the last access */
+    BYTE pdrv;     /* Physical drive of the sector */
+    BYTE flags;    /* SLOT_xxx */
+} CACHE_SlotTypeDef;
+
+static const Diskio_drvTypeDef* Lower; /* Layer below the cache */
+
+static CACHE_SlotTypeDef Slots[USER_CACHE_SECTORS];
+static BYTE Data[USER_CACHE_SECTORS][_MAX_SS];
+static uint32_t UseClock; /* Incremented on every access */
+
+static USER_CACHE_StatsTypeDef Stats;
+
+/*--------------------------------------------------------------------------
+
+   Module Private Functions
+
+---------------------------------------------------------------------------*/
+
+static int find_slot(           /* Slot index, -1:Not cached */
+                     BYTE pdrv, /* Physical drive */
+                     DWORD sector /* Sector to look for */
+)
+{
+    int i;
+
+    for (i = 0; i < USER_CACHE_SECTORS; i++) {
+        if ((Slots[i].flags & SLOT_VALID) && Slots[i].sector == sector &&
+            Slots[i].pdrv == pdrv)
+            return i;
+    }
+
+    return -1;
+}
+
+static void touch_slot(int i)
+{
+    Slots[i].used = ++UseClock;
+}
+
+#if _USE_WRITE
+static DRESULT flush_slot(int i)
+{
+    if (Slots[i].flags & SLOT_DIRTY) {
+        if (Lower->disk_write(Slots[i].pdrv, Data[i], Slots[i].sector, 1) !=
+            RES_OK)
+            return RES_ERROR; /* Keep it dirty to retry later */
+        Slots[i].flags &= ~SLOT_DIRTY;
+        Stats.writebacks++;
+    }
+
+    return RES_OK;
+}
+
+static DRESULT flush_drive(BYTE pdrv)
+{
+    int i, next;
+
+    for (;;) { /* Write back in ascending sector order */
+        next = -1;
+        for (i = 0; i < USER_CACHE_SECTORS; i++) {
+            if ((Slots[i].flags & SLOT_DIRTY) && Slots[i].pdrv == pdrv &&
+                (next < 0 || Slots[i].sector < Slots[next].sector))
+                next = i;
+        }
+        if (next < 0)
+            return RES_OK;
+        if (flush_slot(next) != RES_OK)
+            return RES_ERROR;
+    }
+}
+#endif
+
+static int alloc_slot(void) /* Slot index, -1:Write-back failed */
+{
+    int i, victim = 0;
+
+    for (i = 0; i < USER_CACHE_SECTORS; i++) {
+        if (!(Slots[i].flags & SLOT_VALID))
+            return i; /* Free slot */
+        if (UseClock - Slots[i].used > UseClock - Slots[victim].used)
+            victim = i; /* Least recently used so far */
+    }
+
+#if _USE_WRITE
+    if (flush_slot(victim) != RES_OK)
+        return -1;
+#endif
+    Slots[victim].flags = 0;
+    Stats.evictions++;
+
+    return victim;
+}
+
+/*--------------------------------------------------------------------------
+
+   Public Functions
+
+---------------------------------------------------------------------------*/
+
+void USER_CACHE_link(const Diskio_drvTypeDef* lower)
+{
+    Lower = lower;
+}
+
+void USER_CACHE_get_stats(USER_CACHE_StatsTypeDef* stats)
+{
+    *stats = Stats;
+}
+
+void USER_CACHE_reset_stats(void)
+{
+    memset(&Stats, 0, sizeof(Stats));
+}
+
+/*-----------------------------------------------------------------------*/
+/* Disk layer functions (called through USER_CACHE_Driver)               */
+/*-----------------------------------------------------------------------*/
+
+static DSTATUS USER_CACHE_initialize(BYTE pdrv)
+{
+    int i;
+
+    if (!Lower)
+        return STA_NOINIT;
+
+    for (i = 0; i < USER_CACHE_SECTORS; i++) {
+        if (Slots[i].pdrv == pdrv)
+            Slots[i].flags = 0; /* The media may have been changed */
+    }
+
+    return Lower->disk_initialize(pdrv);
+}
+
+static DSTATUS USER_CACHE_status(BYTE pdrv)
+{
+    if (!Lower)
+        return STA_NOINIT;
+
+    return Lower->disk_status(pdrv);
+}
+
+static DRESULT USER_CACHE_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
+{
+    int i, fill = (count == 1); /* Keep only single sector requests */
+    UINT n;
+
+    if (!count)
+        return RES_PARERR;
+
+    while (count) {
+        i = find_slot(pdrv, sector);
+        if (i >= 0) { /* Hit */
+            memcpy(buff, Data[i], _MAX_SS);
+            touch_slot(i);
+            Stats.hits++;
+            n = 1;
+        } else {
+            for (n = 1; n < count && find_slot(pdrv, sector + n) < 0; n++)
+                ; /* Length of the run not in the cache */
+            Stats.misses += n;
+            if (fill) {
+                i = alloc_slot();
+                if (i < 0)
+                    return RES_ERROR;
+                if (Lower->disk_read(pdrv, Data[i], sector, 1) != RES_OK)
+                    return RES_ERROR;
+                Slots[i].sector = sector;
+                Slots[i].pdrv = pdrv;
+                Slots[i].flags = SLOT_VALID;
+                touch_slot(i);
+                memcpy(buff, Data[i], _MAX_SS);
+            } else if (Lower->disk_read(pdrv, buff, sector, n) != RES_OK) {
+                return RES_ERROR;
+            }
+        }
+        buff += n * _MAX_SS;
+        sector += n;
+        count -= n;
+    }
+
+    return RES_OK;
+}
+
+#if _USE_WRITE
+static DRESULT USER_CACHE_write(BYTE pdrv,
+                                const BYTE* buff,
+                                DWORD sector,
+                                UINT count)
+{
+    int i;
+    UINT n;
+
+    if (!count)
+        return RES_PARERR;
+
+    if (count == 1) { /* Write back later */
+        i = find_slot(pdrv, sector);
+        if (i < 0) {
+            i = alloc_slot();
+            if (i < 0)
+                return RES_ERROR;
+            Slots[i].sector = sector;
+            Slots[i].pdrv = pdrv;
+        }
+        memcpy(Data[i], buff, _MAX_SS);
+        Slots[i].flags = SLOT_VALID | SLOT_DIRTY;
+        touch_slot(i);
+
+        return RES_OK;
+    }
+
+    if (Lower->disk_write(pdrv, buff, sector, count) != RES_OK)
+        return RES_ERROR;
+
+    for (i = 0; i < USER_CACHE_SECTORS; i++) { /* Refresh the cached copies */
+        if ((Slots[i].flags & SLOT_VALID) && Slots[i].pdrv == pdrv &&
+            Slots[i].sector - sector < count) {
+            n = Slots[i].sector - sector;
+            memcpy(Data[i], buff + n * _MAX_SS, _MAX_SS);
+            Slots[i].flags = SLOT_VALID;
+        }
+    }
+
+    return RES_OK;
+}
+#endif
+
+#if _USE_IOCTL == 1
+static DRESULT USER_CACHE_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+    int i;
+    DWORD* dp;
+
+    switch (cmd) {
+#if _USE_WRITE
+        case CTRL_SYNC: /* Everything cached has to reach the media */
+            if (flush_drive(pdrv) != RES_OK)
+                return RES_ERROR;
+            break;
+#endif
+
+        case CTRL_TRIM: /* Trimmed sectors need not be written back */
+        case CTRL_ZERO: /* Zeroed ones neither (FatFs writes them if it fails) */
+            dp = buff;
+            for (i = 0; i < USER_CACHE_SECTORS; i++) {
+                if (Slots[i].pdrv == pdrv && Slots[i].sector >= dp[0] &&
+                    Slots[i].sector <= dp[1])
+                    Slots[i].flags = 0;
+            }
+            break;
+    }
+
+    return Lower->disk_ioctl(pdrv, cmd, buff);
+}
+#endif
+
+const Diskio_drvTypeDef USER_CACHE_Driver = {
+    USER_CACHE_initialize,
+    USER_CACHE_status,
+    USER_CACHE_read,
+#if _USE_WRITE
+    USER_CACHE_write,
+#endif
+#if _USE_IOCTL == 1
+    USER_CACHE_ioctl,
+#endif
+};
+
+#endif /* USER_CACHE_ENABLE */
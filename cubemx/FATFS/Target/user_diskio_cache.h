@@ -0,0 +1,42 @@
+/**
+ ******************************************************************************
+  * @file    user_diskio_cache.h
+  * @brief   This file contains the common defines and functions prototypes for
+  *          the user_diskio_cache sector cache layer
+  ******************************************************************************
+  */
+
+#ifndef _USER_DISKIO_CACHE_H
+#define _USER_DISKIO_CACHE_H
+
+#include "integer.h" //from FatFs middleware library
+#include "diskio.h" //from FatFs middleware library
+#include "ff_gen_drv.h" //from FatFs middleware library
+#include <stdint.h>
+
+//the cache is only compiled in and stacked by MX_FATFS_Init with #define USER_CACHE_ENABLE 1 in main.h
+#ifndef USER_CACHE_ENABLE
+#define USER_CACHE_ENABLE 0
+#endif
+
+//sectors held by the cache, 8 (4 KiB of RAM) keep the FAT and directory sectors of a few open files at hand
+#ifndef USER_CACHE_SECTORS
+#define USER_CACHE_SECTORS 8
+#endif
+
+typedef struct
+{
+  uint32_t hits;       /* Sectors served from the cache */
+  uint32_t misses;     /* Sectors fetched from the lower layer */
+  uint32_t evictions;  /* Sectors dropped to make room */
+  uint32_t writebacks; /* Dirty sectors written to the lower layer */
+} USER_CACHE_StatsTypeDef;
+
+//the cache is a disk layer of its own, it forwards everything it cannot serve to the layer set with USER_CACHE_link
+extern const Diskio_drvTypeDef USER_CACHE_Driver;
+
+extern void USER_CACHE_link (const Diskio_drvTypeDef *lower);
+extern void USER_CACHE_get_stats (USER_CACHE_StatsTypeDef *stats);
+extern void USER_CACHE_reset_stats (void);
+
+#endif
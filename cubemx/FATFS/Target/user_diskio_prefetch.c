@@ -0,0 +1,215 @@
+/**
+ ******************************************************************************
+ * @file    user_diskio_prefetch.c
+ * @brief   This file contains the implementation of the user_diskio_prefetch
+ *          sequential read-ahead layer.
+ ******************************************************************************
+ */
+
+// A file streamed through f_read in chunks smaller than a sector reaches the
+// disk as one single sector read after another. Once a request continues the
+// previous one, this layer reads a whole window of sectors in one multiple
+// block read and serves the following requests from it.
+
+// The window doubles each time all of the sectors read ahead get used and is
+// halved each time less than half of them do, down to 0 where read-ahead is
+// off. A random access pattern therefore stops costing extra transfers
+// quickly, while a long enough sequential run turns it back on.
+
+#include "user_diskio_prefetch.h"
+#include <string.h>
+
+#if USER_PREFETCH_ENABLE
+
+#if _MAX_SS != _MIN_SS
+#error "user_diskio_prefetch supports only a fixed sector size"
+#endif
+
+#define WINDOW_MIN 2 /* Smallest window worth a multiple block read */
+#define REARM_RUN 8  /* Sequential requests to turn read-ahead back on */
+
+static const Diskio_drvTypeDef* Lower; /* Layer below the read-ahead */
+
+static BYTE Buf[USER_PREFETCH_SECTORS][_MAX_SS];
+static BYTE BufDrv;     /* Physical drive of the buffered sectors */
+static DWORD BufStart;  /* First buffered sector */
+static UINT BufCount;   /* Number of buffered sectors */
+
+static DWORD Next;      /* Sector that continues the last request */
+static BYTE NextDrv;    /* Physical drive of the last request */
+static UINT Run;        /* Sequential requests in a row */
+static UINT Window = WINDOW_MIN; /* Read-ahead window */
+static UINT Ahead;      /* Sectors of the buffer read ahead of a request */
+static UINT Used;       /* Sectors read ahead and requested since */
+
+static USER_PREFETCH_StatsTypeDef Stats;
+
+/*--------------------------------------------------------------------------
+
+   Module Private Functions
+
+---------------------------------------------------------------------------*/
+
+/* Rate the finished read-ahead and adapt the window to it */
+static void retire(void)
+{
+    if (Ahead) {
+        if (Used >= Ahead) {
+            Window *= 2;
+            if (Window > USER_PREFETCH_SECTORS)
+                Window = USER_PREFETCH_SECTORS;
+        } else if (Used * 2 < Ahead) {
+            Window /= 2;
+            if (Window < WINDOW_MIN)
+                Window = 0; /* Back off until a long sequential run */
+        }
+        Stats.wasted += Ahead - Used;
+    }
+    Ahead = Used = 0;
+    BufCount = 0;
+}
+
+/*--------------------------------------------------------------------------
+
+   Public Functions
+
+---------------------------------------------------------------------------*/
+
+void USER_PREFETCH_link(const Diskio_drvTypeDef* lower)
+{
+    Lower = lower;
+}
+
+void USER_PREFETCH_get_stats(USER_PREFETCH_StatsTypeDef* stats)
+{
+    *stats = Stats;
+    stats->window = Window;
+}
+
+void USER_PREFETCH_reset_stats(void)
+{
+    memset(&Stats, 0, sizeof(Stats));
+}
+
+/*-----------------------------------------------------------------------*/
+/* Disk layer functions (called through USER_PREFETCH_Driver)            */
+/*-----------------------------------------------------------------------*/
+
+static DSTATUS USER_PREFETCH_initialize(BYTE pdrv)
+{
+    if (!Lower)
+        return STA_NOINIT;
+
+    if (BufDrv == pdrv)
+        BufCount = 0; /* The media may have been changed */
+
+    return Lower->disk_initialize(pdrv);
+}
+
+static DSTATUS USER_PREFETCH_status(BYTE pdrv)
+{
+    if (!Lower)
+        return STA_NOINIT;
+
+    return Lower->disk_status(pdrv);
+}
+
+static DRESULT USER_PREFETCH_read(BYTE pdrv,
+                                  BYTE* buff,
+                                  DWORD sector,
+                                  UINT count)
+{
+    UINT n;
+    int seq;
+
+    if (!count)
+        return RES_PARERR;
+
+    /* Sequential if it continues the last request or the buffered run, so
+       that FAT and directory reads in between do not break the stream */
+    seq = (pdrv == NextDrv && sector == Next) ||
+          (BufCount && pdrv == BufDrv && sector == BufStart + BufCount);
+    Run = seq ? Run + 1 : 0;
+    NextDrv = pdrv;
+    Next = sector + count;
+
+    while (count && BufCount && pdrv == BufDrv &&
+           sector - BufStart < BufCount) { /* Head of the request buffered */
+        memcpy(buff, Buf[sector - BufStart], _MAX_SS);
+        Stats.hits++;
+        if (sector - BufStart >= BufCount - Ahead)
+            Used++;
+        buff += _MAX_SS;
+        sector++;
+        count--;
+    }
+    if (!count)
+        return RES_OK;
+
+    Stats.misses += count;
+
+    if (seq) {
+        retire(); /* The stream has left the buffer, rate the last window */
+        if (!Window && Run >= REARM_RUN)
+            Window = WINDOW_MIN;
+        if (Window > count) { /* Read ahead */
+            n = Window;
+            if (Lower->disk_read(pdrv, Buf[0], sector, n) == RES_OK) {
+                memcpy(buff, Buf[0], count * _MAX_SS);
+                BufDrv = pdrv;
+                BufStart = sector;
+                BufCount = n;
+                Ahead = n - count;
+                Stats.prefetched += Ahead;
+                return RES_OK;
+            }
+            /* The window may cross the end of the media, read on demand */
+        }
+    }
+
+    return Lower->disk_read(pdrv, buff, sector, count);
+}
+
+#if _USE_WRITE
+static DRESULT USER_PREFETCH_write(BYTE pdrv,
+                                   const BYTE* buff,
+                                   DWORD sector,
+                                   UINT count)
+{
+    UINT n;
+
+    if (BufCount && pdrv == BufDrv) { /* Keep the buffered copies current */
+        for (n = 0; n < count; n++) {
+            if (sector + n - BufStart < BufCount)
+                memcpy(Buf[sector + n - BufStart], buff + n * _MAX_SS,
+                       _MAX_SS);
+        }
+    }
+
+    return Lower->disk_write(pdrv, buff, sector, count);
+}
+#endif
+
+#if _USE_IOCTL == 1
+static DRESULT USER_PREFETCH_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+    if ((cmd == CTRL_TRIM || cmd == CTRL_ZERO) && pdrv == BufDrv)
+        BufCount = 0; /* Trimmed or zeroed sectors changed behind the buffer */
+
+    return Lower->disk_ioctl(pdrv, cmd, buff);
+}
+#endif
+
+const Diskio_drvTypeDef USER_PREFETCH_Driver = {
+    USER_PREFETCH_initialize,
+    USER_PREFETCH_status,
+    USER_PREFETCH_read,
+#if _USE_WRITE
+    USER_PREFETCH_write,
+#endif
+#if _USE_IOCTL == 1
+    USER_PREFETCH_ioctl,
+#endif
+};
+
+#endif /* USER_PREFETCH_ENABLE */
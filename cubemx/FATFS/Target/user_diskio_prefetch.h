@@ -0,0 +1,43 @@
+/**
+ ******************************************************************************
+  * @file    user_diskio_prefetch.h
+  * @brief   This file contains the common defines and functions prototypes for
+  *          the user_diskio_prefetch read-ahead layer
+  ******************************************************************************
+  */
+
+#ifndef _USER_DISKIO_PREFETCH_H
+#define _USER_DISKIO_PREFETCH_H
+
+#include "integer.h" //from FatFs middleware library
+#include "diskio.h" //from FatFs middleware library
+#include "ff_gen_drv.h" //from FatFs middleware library
+#include <stdint.h>
+
+//the read-ahead is only compiled in and stacked by MX_FATFS_Init with #define USER_PREFETCH_ENABLE 1 in main.h
+#ifndef USER_PREFETCH_ENABLE
+#define USER_PREFETCH_ENABLE 0
+#endif
+
+//largest read-ahead window, the buffer for 8 sectors (4 KiB of RAM) already turns a sequential stream of single sector reads into 4 KiB transfers
+#ifndef USER_PREFETCH_SECTORS
+#define USER_PREFETCH_SECTORS 8
+#endif
+
+typedef struct
+{
+  uint32_t hits;       /* Sectors served from the read-ahead buffer */
+  uint32_t misses;     /* Sectors read on demand */
+  uint32_t prefetched; /* Sectors read ahead of the request */
+  uint32_t wasted;     /* Sectors read ahead and never requested */
+  uint32_t window;     /* Current read-ahead window (0:Backed off) */
+} USER_PREFETCH_StatsTypeDef;
+
+//the read-ahead stage is a disk layer of its own, it forwards everything to the layer set with USER_PREFETCH_link
+extern const Diskio_drvTypeDef USER_PREFETCH_Driver;
+
+extern void USER_PREFETCH_link (const Diskio_drvTypeDef *lower);
+extern void USER_PREFETCH_get_stats (USER_PREFETCH_StatsTypeDef *stats);
+extern void USER_PREFETCH_reset_stats (void);
+
+#endif
@@ -0,0 +1,254 @@
+/**
+ ******************************************************************************
+ * @file    user_diskio_queue.c
+ * @brief   This file contains the implementation of the user_diskio_queue
+ *          write-coalescing layer.
+ ******************************************************************************
+ */
+
+// FatFs writes FAT sectors, directory sectors and the file buffer one sector
+// at a time, and each of those would be a separate single block write with
+// its own select and busy wait. This layer holds single sector writes back
+// in a queue kept sorted by sector and, when the queue is full or on
+// CTRL_SYNC, writes every run of consecutive sectors with a single multiple
+// block write.
+
+// Reads of queued sectors are served from the queue. Multiple sector writes
+// go straight down and drop the queued sectors they overwrite.
+
+#include "user_diskio_queue.h"
+#include <string.h>
+
+#if USER_QUEUE_ENABLE
+
+#if _MAX_SS != _MIN_SS
+#error "user_diskio_queue supports only a fixed sector size"
+#endif
+
+static const Diskio_drvTypeDef* Lower; /* Layer below the queue */
+
+/* Queued sectors, sorted by drive and sector */
+static BYTE QueueDrv[USER_QUEUE_SECTORS];
+static DWORD QueueSector[USER_QUEUE_SECTORS];
+static BYTE QueueData[USER_QUEUE_SECTORS][_MAX_SS];
+static UINT QueueCount;
+
+static USER_QUEUE_StatsTypeDef Stats;
+
+/*--------------------------------------------------------------------------
+
+   Module Private Functions
+
+---------------------------------------------------------------------------*/
+
+/* Position of a sector in the queue, or where it would be inserted */
+static UINT find_pos(BYTE pdrv, DWORD sector)
+{
+    UINT lo = 0, hi = QueueCount, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (QueueDrv[mid] < pdrv ||
+            (QueueDrv[mid] == pdrv && QueueSector[mid] < sector))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static int is_queued(UINT i, BYTE pdrv, DWORD sector)
+{
+    return i < QueueCount && QueueDrv[i] == pdrv && QueueSector[i] == sector;
+}
+
+static void remove_range(UINT i, UINT n) /* Drop n entries at i */
+{
+    memmove(&QueueDrv[i], &QueueDrv[i + n], QueueCount - i - n);
+    memmove(&QueueSector[i], &QueueSector[i + n],
+            (QueueCount - i - n) * sizeof(DWORD));
+    memmove(QueueData[i], QueueData[i + n], (QueueCount - i - n) * _MAX_SS);
+    QueueCount -= n;
+}
+
+/* Drop the queued sectors of a drive in [st, ed] */
+static void drop(BYTE pdrv, DWORD st, DWORD ed)
+{
+    UINT i = find_pos(pdrv, st), n = 0;
+
+    while (i + n < QueueCount && QueueDrv[i + n] == pdrv &&
+           QueueSector[i + n] <= ed)
+        n++;
+    if (n)
+        remove_range(i, n);
+}
+
+/* Write the queue down, one request per run of consecutive sectors */
+static DRESULT drain(void)
+{
+    UINT n;
+
+    if (!QueueCount)
+        return RES_OK;
+
+    while (QueueCount) {
+        for (n = 1; n < QueueCount && QueueDrv[n] == QueueDrv[0] &&
+                    QueueSector[n] == QueueSector[0] + n;
+             n++)
+            ;
+        Stats.bursts++;
+        if (Lower->disk_write(QueueDrv[0], QueueData[0], QueueSector[0], n) !=
+            RES_OK)
+            return RES_ERROR; /* Keep the rest queued to retry later */
+        remove_range(0, n);
+    }
+    Stats.drains++;
+
+    return RES_OK;
+}
+
+/*--------------------------------------------------------------------------
+
+   Public Functions
+
+---------------------------------------------------------------------------*/
+
+void USER_QUEUE_link(const Diskio_drvTypeDef* lower)
+{
+    Lower = lower;
+}
+
+void USER_QUEUE_get_stats(USER_QUEUE_StatsTypeDef* stats)
+{
+    *stats = Stats;
+}
+
+void USER_QUEUE_reset_stats(void)
+{
+    memset(&Stats, 0, sizeof(Stats));
+}
+
+/*-----------------------------------------------------------------------*/
+/* Disk layer functions (called through USER_QUEUE_Driver)               */
+/*-----------------------------------------------------------------------*/
+
+static DSTATUS USER_QUEUE_initialize(BYTE pdrv)
+{
+    if (!Lower)
+        return STA_NOINIT;
+
+    drop(pdrv, 0, 0xFFFFFFFF); /* The media may have been changed */
+
+    return Lower->disk_initialize(pdrv);
+}
+
+static DSTATUS USER_QUEUE_status(BYTE pdrv)
+{
+    if (!Lower)
+        return STA_NOINIT;
+
+    return Lower->disk_status(pdrv);
+}
+
+static DRESULT USER_QUEUE_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
+{
+    UINT i = find_pos(pdrv, sector), n;
+
+    if (!count)
+        return RES_PARERR;
+
+    for (n = 0; n < count && is_queued(i + n, pdrv, sector + n); n++)
+        ;
+    if (n < count) { /* Not all of it is queued */
+        if (Lower->disk_read(pdrv, buff, sector, count) != RES_OK)
+            return RES_ERROR;
+    }
+
+    for (; i < QueueCount && QueueDrv[i] == pdrv &&
+           QueueSector[i] - sector < count;
+         i++) /* Queued sectors are newer than the media */
+        memcpy(buff + (QueueSector[i] - sector) * _MAX_SS, QueueData[i],
+               _MAX_SS);
+
+    return RES_OK;
+}
+
+#if _USE_WRITE
+static DRESULT USER_QUEUE_write(BYTE pdrv,
+                                const BYTE* buff,
+                                DWORD sector,
+                                UINT count)
+{
+    UINT i;
+
+    if (!count)
+        return RES_PARERR;
+
+    if (count > 1) { /* Already a burst */
+        drop(pdrv, sector, sector + count - 1);
+        Stats.bursts++;
+        return Lower->disk_write(pdrv, buff, sector, count);
+    }
+
+    i = find_pos(pdrv, sector);
+    if (is_queued(i, pdrv, sector)) {
+        Stats.replaced++;
+    } else {
+        if (QueueCount == USER_QUEUE_SECTORS) {
+            if (drain() != RES_OK)
+                return RES_ERROR;
+            i = 0;
+        }
+        memmove(&QueueDrv[i + 1], &QueueDrv[i], QueueCount - i);
+        memmove(&QueueSector[i + 1], &QueueSector[i],
+                (QueueCount - i) * sizeof(DWORD));
+        memmove(QueueData[i + 1], QueueData[i], (QueueCount - i) * _MAX_SS);
+        QueueDrv[i] = pdrv;
+        QueueSector[i] = sector;
+        QueueCount++;
+    }
+    memcpy(QueueData[i], buff, _MAX_SS);
+    Stats.queued++;
+
+    return RES_OK;
+}
+#endif
+
+#if _USE_IOCTL == 1
+static DRESULT USER_QUEUE_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+    DWORD* dp;
+
+    switch (cmd) {
+#if _USE_WRITE
+        case CTRL_SYNC: /* Everything queued has to reach the media */
+            if (drain() != RES_OK)
+                return RES_ERROR;
+            break;
+#endif
+
+        case CTRL_TRIM: /* Trimmed sectors need not be written */
+        case CTRL_ZERO: /* Neither do zeroed ones (FatFs writes them if it fails) */
+            dp = buff;
+            drop(pdrv, dp[0], dp[1]);
+            break;
+    }
+
+    return Lower->disk_ioctl(pdrv, cmd, buff);
+}
+#endif
+
+const Diskio_drvTypeDef USER_QUEUE_Driver = {
+    USER_QUEUE_initialize,
+    USER_QUEUE_status,
+    USER_QUEUE_read,
+#if _USE_WRITE
+    USER_QUEUE_write,
+#endif
+#if _USE_IOCTL == 1
+    USER_QUEUE_ioctl,
+#endif
+};
+
+#endif /* USER_QUEUE_ENABLE */
@@ -0,0 +1,42 @@
+/**
+ ******************************************************************************
+  * @file    user_diskio_queue.h
+  * @brief   This file contains the common defines and functions prototypes for
+  *          the user_diskio_queue write-coalescing layer
+  ******************************************************************************
+  */
+
+#ifndef _USER_DISKIO_QUEUE_H
+#define _USER_DISKIO_QUEUE_H
+
+#include "integer.h" //from FatFs middleware library
+#include "diskio.h" //from FatFs middleware library
+#include "ff_gen_drv.h" //from FatFs middleware library
+#include <stdint.h>
+
+//the write queue is only compiled in and stacked by MX_FATFS_Init with #define USER_QUEUE_ENABLE 1 in main.h
+#ifndef USER_QUEUE_ENABLE
+#define USER_QUEUE_ENABLE 0
+#endif
+
+//single sector writes held back until a sync, 4 (2 KiB of RAM) cover the FAT, directory and FSINFO sectors a sync writes together
+#ifndef USER_QUEUE_SECTORS
+#define USER_QUEUE_SECTORS 4
+#endif
+
+typedef struct
+{
+  uint32_t queued;    /* Single sector writes taken into the queue */
+  uint32_t replaced;  /* Queued sectors written again before the drain */
+  uint32_t drains;    /* Times the queue was emptied */
+  uint32_t bursts;    /* Write requests issued to the lower layer */
+} USER_QUEUE_StatsTypeDef;
+
+//the queue is a disk layer of its own, it forwards everything it does not hold back to the layer set with USER_QUEUE_link
+extern const Diskio_drvTypeDef USER_QUEUE_Driver;
+
+extern void USER_QUEUE_link (const Diskio_drvTypeDef *lower);
+extern void USER_QUEUE_get_stats (USER_QUEUE_StatsTypeDef *stats);
+extern void USER_QUEUE_reset_stats (void);
+
+#endif
@@ -26,14 +26,44 @@
 
 #include "user_diskio_spi.h"
 #include "stm32f4xx_hal.h" /* Provide the low-level HAL functions */
+#include <string.h>
 
 // Make sure you set #define SD_SPI_HANDLE as some hspix in main.h
 // Make sure you set #define SD_CS_GPIO_Port as some GPIO port in main.h
 // Make sure you set #define SD_CS_Pin as some GPIO pin in main.h
 extern SPI_HandleTypeDef SD_SPI_HANDLE;
 
+// Set #define SD_SPI_USE_DMA 1 in main.h to move data blocks by DMA (the
+// handle must then have its hdmarx and hdmatx streams linked). The driver
+// learns about the end of a transfer through USER_SPI_DmaCplt: call it from
+// HAL_SPI_TxCpltCallback, HAL_SPI_TxRxCpltCallback and HAL_SPI_ErrorCallback,
+// or set USE_HAL_SPI_REGISTER_CALLBACKS and it registers itself on the handle
+#ifndef SD_SPI_USE_DMA
+#define SD_SPI_USE_DMA 0
+#endif
+#define SD_SPI_DMA_MIN 128 /* Shorter transfers are cheaper to poll */
+
+// Set #define SD_SPI_WRITE_STREAM 0 in main.h to end every multiple block
+// write in the call that started it. Otherwise CMD25 is kept open while the
+// next write continues the previous one, and gets closed by any other request
+// or once it has been idle for SD_SPI_STREAM_IDLE_MS (see USER_SPI_poll)
+#ifndef SD_SPI_WRITE_STREAM
+#define SD_SPI_WRITE_STREAM 1
+#endif
+// Same for CMD18: set #define SD_SPI_READ_STREAM 0 in main.h to stop every
+// multiple block read with CMD12 before returning
+#ifndef SD_SPI_READ_STREAM
+#define SD_SPI_READ_STREAM 1
+#endif
+#ifndef SD_SPI_STREAM_IDLE_MS
+#define SD_SPI_STREAM_IDLE_MS 100
+#endif
+
 /* Function prototypes */
 
+// The driver reaches the hardware only through HAL_SPI_*, HAL_GPIO_WritePin,
+// HAL_GetTick and the CR1 of the SPI handle, which is what the host card
+// emulator in test/sd_emu stands in for.
 //(Note that the _256 is used as a mask to clear the prescalar bits as it
 // provides binary 111 in the correct position)
 #define FCLK_SLOW()                             \
@@ -68,6 +98,7 @@ extern SPI_HandleTypeDef SD_SPI_HANDLE;
 #define CMD0 (0)           /* GO_IDLE_STATE */
 #define CMD1 (1)           /* SEND_OP_COND (MMC) */
 #define ACMD41 (0x80 + 41) /* SEND_OP_COND (SDC) */
+#define ACMD51 (0x80 + 51) /* SEND_SCR (SDC) */
 #define CMD8 (8)           /* SEND_IF_COND */
 #define CMD9 (9)           /* SEND_CSD */
 #define CMD10 (10)         /* SEND_CID */
@@ -96,6 +127,16 @@ extern SPI_HandleTypeDef SD_SPI_HANDLE;
 static volatile DSTATUS Stat = STA_NOINIT; /* Physical drive status */
 
 static BYTE CardType; /* Card type flags */
+static BYTE EraseZero; /* Erased sectors read back zeros (SCR DATA_STAT_AFTER_ERASE) */
+
+/* Open data stream (STREAM_xxx) */
+#define STREAM_NONE 0
+#define STREAM_WRITE 1
+#define STREAM_READ 2
+
+static BYTE StreamMode;      /* Kind of the open stream */
+static DWORD StreamNext;     /* Sector that continues the open stream */
+static uint32_t StreamTick;  /* Tick of the last transfer in the stream */
 
 uint32_t spiTimerTickStart;
 uint32_t spiTimerTickDelay;
@@ -124,24 +165,109 @@ static BYTE xchg_spi(BYTE dat /* Data to send */
     return rxDat;
 }
 
+/* Called while the driver waits on the card or on a DMA transfer */
+__weak void USER_SPI_yield(void)
+{
+}
+
+#if SD_SPI_USE_DMA
+static volatile BYTE DmaBusy;  /* DMA transfer in flight */
+static volatile BYTE DmaError; /* DMA transfer failed */
+static BYTE DmaDummy = 0xFF;   /* Transmit source repeated on reads */
+
+/* Wait for the completion callback of a started DMA transfer */
+static int wait_dma(void) /* 1:OK, 0:Error or timeout */
+{
+    uint32_t tickStart = HAL_GetTick();
+
+    while (DmaBusy) {
+        if ((HAL_GetTick() - tickStart) >= 500) {
+            HAL_SPI_Abort(&SD_SPI_HANDLE);
+            DmaBusy = 0;
+            return 0;
+        }
+        USER_SPI_yield(); /* The block moves by itself, let the app run */
+    }
+
+    return !DmaError;
+}
+#endif
+
+/* End of a DMA transfer, forwarded from the HAL SPI callbacks */
+void USER_SPI_DmaCplt(SPI_HandleTypeDef* hspi)
+{
+#if SD_SPI_USE_DMA
+    if (hspi == &SD_SPI_HANDLE) {
+        if (hspi->ErrorCode != HAL_SPI_ERROR_NONE)
+            DmaError = 1; /* Came through HAL_SPI_ErrorCallback */
+        DmaBusy = 0;
+    }
+#else
+    (void)hspi;
+#endif
+}
+
 /* Receive multiple byte */
-static void rcvr_spi_multi(
+static int rcvr_spi_multi(/* 1:OK, 0:Error */
     BYTE* buff, /* Pointer to data buffer */
-    UINT btr    /* Number of bytes to receive (even number) */
+    UINT btr    /* Number of bytes to receive */
 )
 {
-    for (UINT i = 0; i < btr; i++) {
-        *(buff + i) = xchg_spi(0xFF);
+#if SD_SPI_USE_DMA
+    if (btr >= SD_SPI_DMA_MIN && SD_SPI_HANDLE.hdmarx &&
+        SD_SPI_HANDLE.hdmatx) {
+        int res;
+
+        /* Keep the tx stream on the dummy byte instead of walking memory */
+        CLEAR_BIT(SD_SPI_HANDLE.hdmatx->Instance->CR, DMA_SxCR_MINC);
+        DmaBusy = 1;
+        DmaError = 0;
+        if (HAL_SPI_TransmitReceive_DMA(
+                &SD_SPI_HANDLE, &DmaDummy, buff, (uint16_t)btr) == HAL_OK) {
+            res = wait_dma();
+        } else {
+            DmaBusy = 0;
+            res = 0;
+        }
+        SET_BIT(SD_SPI_HANDLE.hdmatx->Instance->CR, DMA_SxCR_MINC);
+
+        return res;
     }
+#endif
+
+    /* The whole block is clocked in a single transaction. The buffer doubles
+     * as the 0xFF transmit source: HAL only shifts out byte n+1 after byte n
+     * has been received, so every byte is sent before it gets overwritten. */
+    memset(buff, 0xFF, btr);
+    return HAL_SPI_TransmitReceive(&SD_SPI_HANDLE,
+                                   buff,
+                                   buff,
+                                   (uint16_t)btr,
+                                   HAL_MAX_DELAY) == HAL_OK;
 }
 
 #if _USE_WRITE
 /* Send multiple byte */
-static void xmit_spi_multi(const BYTE* buff, /* Pointer to the data */
-                           UINT btx /* Number of bytes to send (even number) */
+static int xmit_spi_multi(/* 1:OK, 0:Error */
+                          const BYTE* buff, /* Pointer to the data */
+                          UINT btx /* Number of bytes to send (even number) */
 )
 {
-    HAL_SPI_Transmit(&SD_SPI_HANDLE, buff, btx, HAL_MAX_DELAY);
+#if SD_SPI_USE_DMA
+    if (btx >= SD_SPI_DMA_MIN && SD_SPI_HANDLE.hdmatx) {
+        DmaBusy = 1;
+        DmaError = 0;
+        if (HAL_SPI_Transmit_DMA(&SD_SPI_HANDLE, buff, (uint16_t)btx) !=
+            HAL_OK) {
+            DmaBusy = 0;
+            return 0;
+        }
+        return wait_dma();
+    }
+#endif
+
+    return HAL_SPI_Transmit(&SD_SPI_HANDLE, buff, btx, HAL_MAX_DELAY) ==
+           HAL_OK;
 }
 #endif
 
@@ -165,6 +291,7 @@ static int wait_ready(        /* 1:Ready, 0:Timeout */
         d = xchg_spi(0xFF);
         /* This loop takes a time. Insert rot_rdq() here for multitask
          * envilonment. */
+        USER_SPI_yield();
     } while (d != 0xFF &&
              ((HAL_GetTick() - waitSpiTimerTickStart) <
               waitSpiTimerTickDelay)); /* Wait for card goes ready or timeout */
@@ -206,20 +333,21 @@ static int rcvr_datablock(            /* 1:OK, 0:Error */
                           UINT btr    /* Data block length (byte) */
 )
 {
-    BYTE token;
+    BYTE token, crc[2];
 
     SPI_Timer_On(200);
     do { /* Wait for DataStart token in timeout of 200ms */
         token = xchg_spi(0xFF);
         /* This loop will take a time. Insert rot_rdq() here for multitask
          * envilonment. */
+        USER_SPI_yield();
     } while ((token == 0xFF) && SPI_Timer_Status());
     if (token != 0xFE)
         return 0; /* Function fails if invalid DataStart token or timeout */
 
-    rcvr_spi_multi(buff, btr); /* Store trailing data to the buffer */
-    xchg_spi(0xFF);
-    xchg_spi(0xFF); /* Discard CRC */
+    if (!rcvr_spi_multi(buff, btr)) /* Store trailing data to the buffer */
+        return 0;
+    rcvr_spi_multi(crc, 2); /* Discard CRC */
 
     return 1; /* Function succeeded */
 }
@@ -235,19 +363,25 @@ static int xmit_datablock(/* 1:OK, 0:Failed */
                           BYTE token /* Token */
 )
 {
-    BYTE resp;
+    BYTE trailer[3];
+    UINT n;
 
     if (!wait_ready(500))
         return 0; /* Wait for card ready */
 
     xchg_spi(token);     /* Send token */
     if (token != 0xFD) { /* Send data if token is other than StopTran */
-        xmit_spi_multi(buff, 512); /* Data */
-        xchg_spi(0xFF);
-        xchg_spi(0xFF); /* Dummy CRC */
-
-        resp = xchg_spi(0xFF); /* Receive data resp */
-        if ((resp & 0x1F) != 0x05)
+        if (!xmit_spi_multi(buff, 512)) { /* Data */
+            /* The card still counts the block: clock out what a failed or
+             * aborted transfer left of it until the data response, so that
+             * a following StopTran token is taken as one */
+            for (n = 0; n < 600 && (xchg_spi(0xFF) & 0x11) != 0x01; n++)
+                ;
+            return 0;
+        }
+        rcvr_spi_multi(trailer,
+                       3); /* Dummy CRC and data resp in one transaction */
+        if ((trailer[2] & 0x1F) != 0x05)
             return 0; /* Function fails if the data packet was not accepted */
     }
     return 1;
@@ -263,7 +397,7 @@ static BYTE send_cmd(/* Return value: R1 resp (bit7==1:Failed to send) */
                      DWORD arg /* Argument */
 )
 {
-    BYTE n, res;
+    BYTE n, res, pkt[6];
 
     if (cmd & 0x80) { /* Send a CMD55 prior to ACMD<n> */
         cmd &= 0x7F;
@@ -280,17 +414,19 @@ static BYTE send_cmd(/* Return value: R1 resp (bit7==1:Failed to send) */
     }
 
     /* Send command packet */
-    xchg_spi(0x40 | cmd);        /* Start + command index */
-    xchg_spi((BYTE)(arg >> 24)); /* Argument[31..24] */
-    xchg_spi((BYTE)(arg >> 16)); /* Argument[23..16] */
-    xchg_spi((BYTE)(arg >> 8));  /* Argument[15..8] */
-    xchg_spi((BYTE)arg);         /* Argument[7..0] */
-    n = 0x01;                    /* Dummy CRC + Stop */
+    pkt[0] = 0x40 | cmd;        /* Start + command index */
+    pkt[1] = (BYTE)(arg >> 24); /* Argument[31..24] */
+    pkt[2] = (BYTE)(arg >> 16); /* Argument[23..16] */
+    pkt[3] = (BYTE)(arg >> 8);  /* Argument[15..8] */
+    pkt[4] = (BYTE)arg;         /* Argument[7..0] */
+    n = 0x01;                   /* Dummy CRC + Stop */
     if (cmd == CMD0)
         n = 0x95; /* Valid CRC for CMD0(0) */
     if (cmd == CMD8)
         n = 0x87; /* Valid CRC for CMD8(0x1AA) */
-    xchg_spi(n);
+    pkt[5] = n;
+    HAL_SPI_TransmitReceive(
+        &SD_SPI_HANDLE, pkt, pkt, 6, HAL_MAX_DELAY); /* In one transaction */
 
     /* Receive command resp */
     if (cmd == CMD12)
@@ -303,6 +439,30 @@ static BYTE send_cmd(/* Return value: R1 resp (bit7==1:Failed to send) */
     return res; /* Return received response */
 }
 
+/*-----------------------------------------------------------------------*/
+/* Close the open data stream                                            */
+/*-----------------------------------------------------------------------*/
+
+static int stream_close(void) /* 1:OK, 0:Failed */
+{
+    int res = 1;
+
+#if _USE_WRITE
+    if (StreamMode == STREAM_WRITE) {
+        if (!xmit_datablock(0, 0xFD))
+            res = 0; /* STOP_TRAN token */
+        despiselect();
+    }
+#endif
+    if (StreamMode == STREAM_READ) {
+        send_cmd(CMD12, 0); /* STOP_TRANSMISSION */
+        despiselect();
+    }
+    StreamMode = STREAM_NONE;
+
+    return res;
+}
+
 /*--------------------------------------------------------------------------
 
    Public FatFs Functions (wrapped in user_diskio.c)
@@ -321,7 +481,7 @@ static BYTE send_cmd(/* Return value: R1 resp (bit7==1:Failed to send) */
 inline DSTATUS USER_SPI_initialize(BYTE drv /* Physical drive number (0) */
 )
 {
-    BYTE n, cmd, ty, ocr[4];
+    BYTE n, cmd, ty, ocr[4], scr[8];
 
     if (drv != 0)
         return STA_NOINIT; /* Supports only drive 0 */
@@ -330,6 +490,17 @@ inline DSTATUS USER_SPI_initialize(BYTE drv /* Physical drive number (0) */
     if (Stat & STA_NODISK)
         return Stat; /* Is card existing in the soket? */
 
+#if SD_SPI_USE_DMA && USE_HAL_SPI_REGISTER_CALLBACKS == 1
+    /* Take the completion callbacks of the handle, the app has none to
+     * forward then */
+    HAL_SPI_RegisterCallback(
+        &SD_SPI_HANDLE, HAL_SPI_TX_COMPLETE_CB_ID, USER_SPI_DmaCplt);
+    HAL_SPI_RegisterCallback(
+        &SD_SPI_HANDLE, HAL_SPI_TX_RX_COMPLETE_CB_ID, USER_SPI_DmaCplt);
+    HAL_SPI_RegisterCallback(
+        &SD_SPI_HANDLE, HAL_SPI_ERROR_CB_ID, USER_SPI_DmaCplt);
+#endif
+
     FCLK_SLOW();
     for (n = 10; n; n--)
         xchg_spi(0xFF); /* Send 80 dummy clocks */
@@ -368,7 +539,13 @@ inline DSTATUS USER_SPI_initialize(BYTE drv /* Physical drive number (0) */
                 ty = 0;
         }
     }
+    EraseZero = 0;
+    if ((ty & CT_SDC) && send_cmd(ACMD51, 0) == 0 &&
+        rcvr_datablock(scr, 8)) { /* Read SCR */
+        EraseZero = !(scr[1] & 0x80);
+    }
     CardType = ty; /* Card type */
+    StreamMode = STREAM_NONE;
     despiselect();
 
     if (ty) {                /* OK */
@@ -391,9 +568,22 @@ inline DSTATUS USER_SPI_status(BYTE drv /* Physical drive number (0) */
     if (drv)
         return STA_NOINIT; /* Supports only drive 0 */
 
+    USER_SPI_poll(); /* FatFs checks the status on every API call */
+
     return Stat; /* Return disk status */
 }
 
+/*-----------------------------------------------------------------------*/
+/* Close the data stream if it has been idle for too long                */
+/*-----------------------------------------------------------------------*/
+
+void USER_SPI_poll(void)
+{
+    if (StreamMode != STREAM_NONE &&
+        (HAL_GetTick() - StreamTick) >= SD_SPI_STREAM_IDLE_MS)
+        stream_close();
+}
+
 /*-----------------------------------------------------------------------*/
 /* Read sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
@@ -410,6 +600,48 @@ inline DRESULT USER_SPI_read(
     if (Stat & STA_NOINIT)
         return RES_NOTRDY; /* Check if drive is ready */
 
+#if SD_SPI_READ_STREAM
+    if (StreamMode != STREAM_READ || sector != StreamNext) {
+        if (!stream_close())
+            return RES_ERROR; /* Pending writes have to land before reading */
+        if (count == 1 && sector != StreamNext) { /* Random single sector */
+            if ((send_cmd(CMD17,
+                          (CardType & CT_BLOCK) ? sector : sector * 512) ==
+                 0) /* READ_SINGLE_BLOCK */
+                && rcvr_datablock(buff, 512)) {
+                count = 0;
+            }
+            despiselect();
+            StreamNext = sector + 1; /* A follow-up read opens a stream */
+            return count ? RES_ERROR : RES_OK;
+        }
+        if (send_cmd(CMD18, (CardType & CT_BLOCK) ? sector : sector * 512) !=
+            0) {
+            despiselect();
+            return RES_ERROR; /* READ_MULTIPLE_BLOCK */
+        }
+        StreamMode = STREAM_READ;
+    }
+
+    do { /* Card keeps the next block ready while selected */
+        if (!rcvr_datablock(buff, 512))
+            break;
+        buff += 512;
+        sector++;
+    } while (--count);
+
+    if (count) {
+        stream_close();
+        return RES_ERROR;
+    }
+    StreamNext = sector;
+    StreamTick = HAL_GetTick();
+
+    return RES_OK;
+#else
+    if (!stream_close())
+        return RES_ERROR; /* Pending writes have to land before reading */
+
     if (!(CardType & CT_BLOCK))
         sector *= 512; /* LBA ot BA conversion (byte addressing cards) */
 
@@ -431,6 +663,7 @@ inline DRESULT USER_SPI_read(
     despiselect();
 
     return count ? RES_ERROR : RES_OK; /* Return result */
+#endif
 }
 
 /*-----------------------------------------------------------------------*/
@@ -452,6 +685,34 @@ inline DRESULT USER_SPI_write(
     if (Stat & STA_PROTECT)
         return RES_WRPRT; /* Check write protect */
 
+#if SD_SPI_WRITE_STREAM
+    if (StreamMode != STREAM_WRITE || sector != StreamNext) {
+        if (!stream_close())
+            return RES_ERROR; /* Discontinuity, end the previous stream */
+        if (send_cmd(CMD25,
+                     (CardType & CT_BLOCK) ? sector : sector * 512) != 0) {
+            despiselect();
+            return RES_ERROR; /* Open-ended WRITE_MULTIPLE_BLOCK */
+        }
+        StreamMode = STREAM_WRITE;
+    }
+
+    do { /* Card stays selected in between the calls */
+        if (!xmit_datablock(buff, 0xFC))
+            break;
+        buff += 512;
+        sector++;
+    } while (--count);
+
+    if (count) {
+        stream_close();
+        return RES_ERROR;
+    }
+    StreamNext = sector;
+    StreamTick = HAL_GetTick();
+
+    return RES_OK;
+#else
     if (!(CardType & CT_BLOCK))
         sector *= 512; /* LBA ==> BA conversion (byte addressing cards) */
 
@@ -476,6 +737,7 @@ inline DRESULT USER_SPI_write(
     despiselect();
 
     return count ? RES_ERROR : RES_OK; /* Return result */
+#endif
 }
 #endif
 
@@ -497,6 +759,11 @@ inline DRESULT USER_SPI_ioctl(BYTE drv,  /* Physical drive number (0) */
         return RES_PARERR; /* Check parameter */
     if (Stat & STA_NOINIT)
         return RES_NOTRDY; /* Check if drive is ready */
+    if (cmd == CTRL_ZERO && !EraseZero)
+        return RES_PARERR; /* Erasing does not zero, leave the open stream */
+
+    if (!stream_close())
+        return RES_ERROR; /* Commands are not accepted inside a stream */
 
     res = RES_ERROR;
 
@@ -554,6 +821,12 @@ inline DRESULT USER_SPI_ioctl(BYTE drv,  /* Physical drive number (0) */
             }
             break;
 
+        case MMC_GET_CSD: /* Read CSD (16 bytes) */
+            if (send_cmd(CMD9, 0) == 0 && rcvr_datablock(buff, 16))
+                res = RES_OK;
+            break;
+
+        case CTRL_ZERO: /* Erased sectors read back zeros, same as CTRL_TRIM */
         case CTRL_TRIM: /* Erase a block of sectors (used when _USE_ERASE == 1)
                          */
             if (!(CardType & CT_SDC))
@@ -584,4 +857,19 @@ inline DRESULT USER_SPI_ioctl(BYTE drv,  /* Physical drive number (0) */
 
     return res;
 }
-#endif
\ No newline at end of file
+#endif
+/*-----------------------------------------------------------------------*/
+/* Driver table for stacking the disk layers (see user_diskio.c)         */
+/*-----------------------------------------------------------------------*/
+
+const Diskio_drvTypeDef USER_SPI_Driver = {
+    USER_SPI_initialize,
+    USER_SPI_status,
+    USER_SPI_read,
+#if _USE_WRITE
+    USER_SPI_write,
+#endif
+#if _USE_IOCTL == 1
+    USER_SPI_ioctl,
+#endif
+};
@@ -21,6 +21,7 @@
 #include "integer.h" //from FatFs middleware library
 #include "diskio.h" //from FatFs middleware library
 #include "ff_gen_drv.h" //from FatFs middleware library
+#include "stm32f4xx_hal.h" //for SPI_HandleTypeDef
 
 //we define these as inline because we don't want them to be actual function calls (they get "called" from the cubemx autogenerated user_diskio file)
 //we define them as extern because they are defined in a separate .c file to user_diskio.c (which #includes this .h file)
@@ -35,4 +36,16 @@ extern DRESULT USER_SPI_read (BYTE pdrv, BYTE *buff, DWORD sector, UINT count);
   extern DRESULT USER_SPI_ioctl (BYTE pdrv, BYTE cmd, void *buff);
 #endif /* _USE_IOCTL == 1 */
 
+//the functions above as a driver table, to be placed under the other disk layers
+extern const Diskio_drvTypeDef USER_SPI_Driver;
+
+//closes a multiple block stream left idle for SD_SPI_STREAM_IDLE_MS, call it periodically from the application
+extern void USER_SPI_poll (void);
+
+//weak hook called while the driver waits for the card or for a DMA transfer, override it to keep the application running
+extern void USER_SPI_yield (void);
+
+//end of a DMA transfer on SD_SPI_HANDLE, call it from the HAL_SPI_TxCpltCallback, HAL_SPI_TxRxCpltCallback and HAL_SPI_ErrorCallback of the application (other handles are ignored)
+extern void USER_SPI_DmaCplt (SPI_HandleTypeDef *hspi);
+
 #endif
\ No newline at end of file
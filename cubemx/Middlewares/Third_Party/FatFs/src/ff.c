@@ -306,7 +306,7 @@
 /* Additional file access control and file status flags for internal use */
 #define FA_SEEKEND	0x20	/* Seek to end of the file on file open */
 #define FA_MODIFIED	0x40	/* File has been modified */
-#define FA_DIRTY	0x80	/* FIL.buf[] needs to be written-back */
+#define FA_DIRTY	0x80	/* FIL.buf[] (or the dirty sectors in the file buffer) needs to be written-back */
 
 
 /* Name status flags in fn[] */
@@ -393,6 +393,7 @@
 #define	DIR_Name			0		/* Short file name (11-byte) */
 #define	DIR_Attr			11		/* Attribute (BYTE) */
 #define	DIR_NTres			12		/* Lower case flag (BYTE) */
+#define	NT_LAZY				0x20	/* DIR_NTres: Cluster chain may go beyond the file size (_FS_LAZYSYNC) */
 #define DIR_CrtTime10		13		/* Created time sub-second (BYTE) */
 #define	DIR_CrtTime			14		/* Created time (DWORD) */
 #define DIR_LstAccDate		18		/* Last accessed date (WORD) */
@@ -541,6 +542,59 @@ static BYTE CurrVol;			/* Current drive */
 static FILESEM Files[_FS_LOCK];	/* Open object lock semaphores */
 #endif
 
+#if _FS_LAZYMIRROR && !_FS_READONLY
+#if _LAZYMIRROR_RANGES < 1 || _LAZYMIRROR_XFER < 1
+#error Wrong _LAZYMIRROR_RANGES or _LAZYMIRROR_XFER setting
+#endif
+static BYTE MirrorBuf[_LAZYMIRROR_XFER * _MAX_SS];	/* FAT mirroring buffer */
+#endif
+
+#if _USE_FREEMAP && !_FS_READONLY
+#if _FREEMAP_CLST < 32 || _FREEMAP_SCAN < 1
+#error Wrong _FREEMAP_CLST or _FREEMAP_SCAN setting
+#endif
+static DWORD FreeMap[_VOLUMES][(_FREEMAP_CLST + 31) / 32];	/* Free cluster bitmaps */
+static BYTE FreeScan[_FREEMAP_SCAN * _MAX_SS];				/* FAT scan buffer */
+#endif
+
+#if _USE_ALIASMAP && _USE_LFN != 0 && !_FS_READONLY
+#if _ALIASMAP_SIZE < 16
+#error Wrong _ALIASMAP_SIZE setting
+#endif
+static BYTE AliasMap[_VOLUMES][_ALIASMAP_SIZE];	/* Short name sets */
+#endif
+
+#if _USE_DIRINDEX && _USE_LFN != 0
+#if _DIRINDEX_SIZE < 256 || _DIRINDEX_SIZE > 65536
+#error Wrong _DIRINDEX_SIZE setting
+#endif
+static BYTE DirIndex[_VOLUMES][_DIRINDEX_SIZE];	/* Directory name filters */
+#endif
+
+#if _USE_DENTCACHE
+#if _DENTCACHE_SIZE < 1 || _DENTCACHE_SIZE > 256
+#error Wrong _DENTCACHE_SIZE setting
+#endif
+static DWORD DentCache[_VOLUMES][_DENTCACHE_SIZE * 3];	/* Path caches */
+#endif
+
+#if _FS_ZEROFILL && !_FS_READONLY
+#if _ZEROFILL_XFER < 1
+#error Wrong _ZEROFILL_XFER setting
+#endif
+static const BYTE ZeroBlock[_ZEROFILL_XFER * _MAX_SS];	/* Source of directory clearing */
+#endif
+
+#if _USE_FILEBUF
+#if _FS_TINY
+#error _USE_FILEBUF cannot be used with _FS_TINY
+#endif
+#if _FILEBUF_SECT < 1 || _FILEBUF_SECT > 128 || _FILEBUF_NUM < 1 || _FILEBUF_NUM > 8
+#error Wrong _FILEBUF_SECT or _FILEBUF_NUM setting
+#endif
+static BYTE FileBuf[_VOLUMES][_FILEBUF_NUM * _FILEBUF_SECT * _MAX_SS];	/* File buffer pools */
+#endif
+
 #if _USE_LFN == 0		/* Non-LFN configuration */
 #define	DEF_NAMBUF
 #define INIT_NAMBUF(fs)
@@ -875,9 +929,287 @@ void clear_lock (	/* Clear lock entries of the volume */
 
 
 
+#if _FS_LAZYMIRROR && !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Deferred FAT mirroring                                                */
+/*-----------------------------------------------------------------------*/
+
+static
+void mirror_add (
+	FATFS* fs,		/* File system object */
+	DWORD ofs		/* FAT sector written to the first FAT (offset from fatbase) */
+)
+{
+	UINT i, j, n = fs->mrcnt;
+	DWORD (*rt)[2] = fs->mrange;
+
+
+	if (fs->n_fats < 2) return;
+	for (i = 0; i < n && rt[i][1] + 1 < ofs; i++) ;	/* Find the first range that reaches the sector */
+	if (i < n && rt[i][0] <= ofs + 1) {	/* Sector in or next to the range? */
+		if (ofs < rt[i][0]) rt[i][0] = ofs;
+		if (ofs > rt[i][1]) {
+			rt[i][1] = ofs;
+			if (i + 1 < n && rt[i + 1][0] <= ofs + 1) {	/* Join the following range */
+				rt[i][1] = rt[i + 1][1];
+				for (j = i + 1; j + 1 < n; j++) {
+					rt[j][0] = rt[j + 1][0]; rt[j][1] = rt[j + 1][1];
+				}
+				fs->mrcnt--;
+			}
+		}
+		return;
+	}
+	if (n == _LAZYMIRROR_RANGES) {	/* Table full, widen the nearest range */
+		if (i == n || (i > 0 && ofs - rt[i - 1][1] < rt[i][0] - ofs)) {
+			rt[i - 1][1] = ofs;
+		} else {
+			rt[i][0] = ofs;
+		}
+		return;
+	}
+	for (j = n; j > i; j--) {	/* Insert a new range */
+		rt[j][0] = rt[j - 1][0]; rt[j][1] = rt[j - 1][1];
+	}
+	rt[i][0] = rt[i][1] = ofs;
+	fs->mrcnt++;
+}
+
+
+static
+FRESULT mirror_sync (	/* FR_OK(0):succeeded, !=0:error */
+	FATFS* fs			/* File system object */
+)
+{
+	UINT i, n, nf;
+	DWORD ofs;
+
+
+	for (i = 0; i < fs->mrcnt; i++) {	/* Copy the ranges from the first FAT to the others in ascending order */
+		for (ofs = fs->mrange[i][0]; ofs <= fs->mrange[i][1]; ofs += n) {
+			n = (UINT)(fs->mrange[i][1] - ofs + 1);
+			if (n > _LAZYMIRROR_XFER) n = _LAZYMIRROR_XFER;
+			if (disk_read(fs->drv, MirrorBuf, fs->fatbase + ofs, n) != RES_OK) return FR_DISK_ERR;
+			for (nf = 1; nf < fs->n_fats; nf++) {
+				if (disk_write(fs->drv, MirrorBuf, fs->fatbase + fs->fsize * nf + ofs, n) != RES_OK) return FR_DISK_ERR;
+			}
+		}
+	}
+	fs->mrcnt = 0;
+	return FR_OK;
+}
+
+#endif	/* _FS_LAZYMIRROR && !_FS_READONLY */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Move/Flush disk access window in the file system object               */
 /*-----------------------------------------------------------------------*/
+#if _USE_WINCACHE
+#if _FS_TINY
+#error _USE_WINCACHE cannot be used with _FS_TINY
+#endif
+#if _WINCACHE_WAYS < 1 || _WINCACHE_FAT < _WINCACHE_WAYS || _WINCACHE_DIR < _WINCACHE_WAYS || _WINCACHE_FAT % _WINCACHE_WAYS || _WINCACHE_DIR % _WINCACHE_WAYS || _WINCACHE_FAT + _WINCACHE_DIR > 255
+#error Wrong _WINCACHE_FAT, _WINCACHE_DIR or _WINCACHE_WAYS setting
+#endif
+#define WC_SLOTS	(_WINCACHE_FAT + _WINCACHE_DIR)
+
+static
+void wc_reset (
+	FATFS* fs			/* File system object */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < WC_SLOTS; i++) {	/* Empty all slots */
+		fs->wsect[i] = 0xFFFFFFFF;
+		fs->wdirty[i] = 0;
+		fs->wused[i] = 0;
+	}
+	fs->wtick = 0;
+	fs->whit[0] = fs->whit[1] = fs->wmiss[0] = fs->wmiss[1] = 0;
+	fs->wflag = 0; fs->winsect = 0xFFFFFFFF;
+}
+
+
+static
+UINT wc_set (	/* Returns the first slot of the set the sector maps to */
+	FATFS* fs,		/* File system object */
+	DWORD sector	/* Sector number */
+)
+{
+	if (sector - fs->fatbase < fs->fsize) {	/* FAT pool */
+		return (UINT)((sector - fs->fatbase) % (_WINCACHE_FAT / _WINCACHE_WAYS)) * _WINCACHE_WAYS;
+	}
+	return _WINCACHE_FAT + (UINT)(sector % (_WINCACHE_DIR / _WINCACHE_WAYS)) * _WINCACHE_WAYS;	/* Other pool */
+}
+
+
+static
+UINT wc_find (	/* Returns the slot holding the sector, or WC_SLOTS if not cached */
+	FATFS* fs,		/* File system object */
+	DWORD sector	/* Sector number */
+)
+{
+	UINT i, s;
+
+
+	s = wc_set(fs, sector);
+	for (i = s; i < s + _WINCACHE_WAYS; i++) {
+		if (fs->wsect[i] == sector) return i;
+	}
+	return WC_SLOTS;
+}
+
+
+#if !_FS_READONLY
+static
+FRESULT wc_write (	/* Returns FR_OK or FR_DISK_ERROR */
+	FATFS* fs,		/* File system object */
+	const BYTE* buf,	/* Sector data */
+	DWORD wsect		/* Sector number */
+)
+{
+#if !_FS_LAZYMIRROR
+	UINT nf;
+#endif
+
+
+	if (disk_write(fs->drv, buf, wsect, 1) != RES_OK) return FR_DISK_ERR;
+	if (wsect - fs->fatbase < fs->fsize) {		/* Is it in the FAT area? */
+#if _FS_LAZYMIRROR
+		mirror_add(fs, wsect - fs->fatbase);	/* Reflect the change to the FAT copies later */
+#else
+		for (nf = fs->n_fats; nf >= 2; nf--) {	/* Reflect the change to all FAT copies */
+			wsect += fs->fsize;
+			disk_write(fs->drv, buf, wsect, 1);
+		}
+#endif
+	}
+	return FR_OK;
+}
+
+
+static
+FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERROR */
+	FATFS* fs			/* File system object */
+)
+{
+	UINT i;
+	FRESULT res = FR_OK;
+
+
+	if (fs->wflag) {	/* Write back the current sector if it is dirty */
+		if (wc_write(fs, fs->win, fs->winsect) != FR_OK) return FR_DISK_ERR;
+		fs->wflag = 0;
+		i = wc_find(fs, fs->winsect);	/* A cached copy is outdated (the window may have been moved without loading) */
+		if (i < WC_SLOTS) {
+			fs->wsect[i] = 0xFFFFFFFF; fs->wdirty[i] = 0;
+		}
+	}
+	for (i = 0; i < WC_SLOTS; i++) {	/* Write back the dirty sectors in the cache */
+		if (fs->wdirty[i]) {
+			if (wc_write(fs, fs->wbuf[i], fs->wsect[i]) != FR_OK) {
+				res = FR_DISK_ERR;
+			} else {
+				fs->wdirty[i] = 0;
+			}
+		}
+	}
+	return res;
+}
+
+
+#if _FS_ZEROFILL
+static
+void wc_drop (
+	FATFS* fs,		/* File system object */
+	DWORD sect,		/* First sector of the block */
+	UINT n			/* Number of sectors */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < WC_SLOTS; i++) {	/* Forget the cached sectors in the block (they are overwritten behind the cache) */
+		if (fs->wsect[i] - sect < n) {
+			fs->wsect[i] = 0xFFFFFFFF; fs->wdirty[i] = 0;
+		}
+	}
+}
+#endif
+#endif
+
+
+static
+FRESULT wc_park (	/* Put the current sector into the cache. Returns FR_OK or FR_DISK_ERROR */
+	FATFS* fs		/* File system object */
+)
+{
+	UINT i, s, v;
+
+
+	if (fs->winsect == 0xFFFFFFFF) return FR_OK;	/* No valid sector in the window */
+	i = wc_find(fs, fs->winsect);
+	if (i == WC_SLOTS) {	/* Not cached, take the least recently used slot of the set */
+		s = v = wc_set(fs, fs->winsect);
+		for (i = s + 1; i < s + _WINCACHE_WAYS; i++) {
+			if (fs->wused[i] < fs->wused[v]) v = i;
+		}
+#if !_FS_READONLY
+		if (fs->wdirty[v]) {	/* Write back the evicted sector */
+			if (wc_write(fs, fs->wbuf[v], fs->wsect[v]) != FR_OK) return FR_DISK_ERR;
+			fs->wdirty[v] = 0;
+		}
+#endif
+		i = v;
+	}
+	mem_cpy(fs->wbuf[i], fs->win, SS(fs));
+	fs->wsect[i] = fs->winsect;
+	fs->wdirty[i] = fs->wflag;
+	fs->wused[i] = ++fs->wtick;
+	fs->wflag = 0;
+	return FR_OK;
+}
+
+
+static
+FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERROR */
+	FATFS* fs,			/* File system object */
+	DWORD sector		/* Sector number to make appearance in the fs->win[] */
+)
+{
+	FRESULT res = FR_OK;
+	UINT i, p;
+
+
+	if (sector != fs->winsect) {	/* Window offset changed? */
+		res = wc_park(fs);			/* Keep the current sector in the cache */
+		if (res == FR_OK) {
+			p = (wc_set(fs, sector) < _WINCACHE_FAT) ? 0 : 1;
+			i = wc_find(fs, sector);
+			if (i < WC_SLOTS) {		/* Cached? (the slot is updated when the sector is parked again) */
+				fs->whit[p]++;
+				mem_cpy(fs->win, fs->wbuf[i], SS(fs));
+				fs->wflag = fs->wdirty[i];
+				fs->wdirty[i] = 0;
+			} else {				/* Fill sector window with new data */
+				fs->wmiss[p]++;
+				if (disk_read(fs->drv, fs->win, sector, 1) != RES_OK) {
+					sector = 0xFFFFFFFF;	/* Invalidate window if data is not reliable */
+					res = FR_DISK_ERR;
+				}
+			}
+			fs->winsect = sector;
+		}
+	}
+	return res;
+}
+
+#else
 #if !_FS_READONLY
 static
 FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERROR */
@@ -885,7 +1217,9 @@ FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERROR */
 )
 {
 	DWORD wsect;
+#if !_FS_LAZYMIRROR
 	UINT nf;
+#endif
 	FRESULT res = FR_OK;
 
 
@@ -896,10 +1230,14 @@ FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERROR */
 		} else {
 			fs->wflag = 0;
 			if (wsect - fs->fatbase < fs->fsize) {		/* Is it in the FAT area? */
+#if _FS_LAZYMIRROR
+				mirror_add(fs, wsect - fs->fatbase);	/* Reflect the change to the FAT copies later */
+#else
 				for (nf = fs->n_fats; nf >= 2; nf--) {	/* Reflect the change to all FAT copies */
 					wsect += fs->fsize;
 					disk_write(fs->drv, fs->win, wsect, 1);
 				}
+#endif
 			}
 		}
 	}
@@ -931,6 +1269,7 @@ FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERROR */
 	}
 	return res;
 }
+#endif	/* _USE_WINCACHE */
 
 
 
@@ -949,6 +1288,9 @@ FRESULT sync_fs (	/* FR_OK:succeeded, !=0:error */
 
 
 	res = sync_window(fs);
+#if _FS_LAZYMIRROR
+	if (res == FR_OK) res = mirror_sync(fs);	/* Bring the FAT copies up to date */
+#endif
 	if (res == FR_OK) {
 		/* Update FSInfo sector if needed */
 		if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {
@@ -1124,6 +1466,15 @@ FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 			fs->wflag = 1;
 			break;
 		}
+#if _USE_FREEMAP
+		if (res == FR_OK && fs->fmap) {	/* Keep the free cluster bitmap in sync */
+			if (val) {
+				fs->fmap[clst / 32] |= (DWORD)1 << (clst % 32);
+			} else {
+				fs->fmap[clst / 32] &= ~((DWORD)1 << (clst % 32));
+			}
+		}
+#endif
 	}
 	return res;
 }
@@ -1133,75 +1484,263 @@ FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 
 
 
-#if _FS_EXFAT && !_FS_READONLY
+#if _USE_FREEMAP && !_FS_READONLY
 /*-----------------------------------------------------------------------*/
-/* exFAT: Accessing FAT and Allocation Bitmap                            */
+/* FAT handling - Free cluster bitmap (FAT16/32)                         */
 /*-----------------------------------------------------------------------*/
 
-/*--------------------------------------*/
-/* Find a contiguous free cluster block */
-/*--------------------------------------*/
-
 static
-DWORD find_bitmap (	/* 0:Not found, 2..:Cluster block found, 0xFFFFFFFF:Disk error */
-	FATFS* fs,	/* File system object */
-	DWORD clst,	/* Cluster number to scan from */
-	DWORD ncl	/* Number of contiguous clusters to find (1..) */
+FRESULT fmap_build (	/* FR_OK(0):succeeded, !=0:error */
+	FATFS* fs,		/* File system object */
+	BYTE fmt,		/* FAT sub-type (FS_FAT16 or FS_FAT32) */
+	DWORD* map		/* Bitmap to be built */
 )
 {
-	BYTE bm, bv;
-	UINT i;
-	DWORD val, scl, ctr;
+	DWORD clst, nfree, sect, val;
+	UINT i, n, esz;
+	BYTE *p;
 
 
-	clst -= 2;	/* The first bit in the bitmap corresponds to cluster #2 */
-	if (clst >= fs->n_fatent - 2) clst = 0;
-	scl = val = clst; ctr = 0;
-	for (;;) {
-		if (move_window(fs, fs->database + val / 8 / SS(fs)) != FR_OK) return 0xFFFFFFFF;	/* (assuming bitmap is located top of the cluster heap) */
-		i = val / 8 % SS(fs); bm = 1 << (val % 8);
-		do {
-			do {
-				bv = fs->win[i] & bm; bm <<= 1;		/* Get bit value */
-				if (++val >= fs->n_fatent - 2) {	/* Next cluster (with wrap-around) */
-					val = 0; bm = 0; i = SS(fs);
-				}
-				if (!bv) {	/* Is it a free cluster? */
-					if (++ctr == ncl) return scl + 2;	/* Check if run length is sufficient for required */
-				} else {
-					scl = val; ctr = 0;		/* Encountered a cluster in-use, restart to scan */
-				}
-				if (val == clst) return 0;	/* All cluster scanned? */
-			} while (bm);
-			bm = 1;
-		} while (++i < SS(fs));
+	esz = (fmt == FS_FAT16) ? 2 : 4;		/* Size of an FAT entry */
+	mem_set(map, 0xFF, (UINT)((fs->n_fatent + 31) / 32 * sizeof (DWORD)));	/* All 'in use', including clusters 0, 1 and the padding */
+	clst = nfree = 0; sect = fs->fatbase;
+	while (clst < fs->n_fatent) {
+		n = (UINT)((fs->n_fatent - clst + SS(fs) / esz - 1) / (SS(fs) / esz));	/* Remaining FAT sectors */
+		if (n > _FREEMAP_SCAN) n = _FREEMAP_SCAN;
+		if (disk_read(fs->drv, FreeScan, sect, n) != RES_OK) return FR_DISK_ERR;
+		sect += n;
+		for (p = FreeScan, i = n * SS(fs) / esz; i && clst < fs->n_fatent; i--, clst++, p += esz) {
+			val = (esz == 2) ? ld_word(p) : ld_dword(p) & 0x0FFFFFFF;
+			if (val == 0 && clst >= 2) {	/* Free cluster? */
+				map[clst / 32] &= ~((DWORD)1 << (clst % 32));
+				nfree++;
+			}
+		}
+	}
+	if (fs->free_clst != nfree) {	/* Correct the free cluster count */
+		fs->free_clst = nfree;
+		fs->fsi_flag |= 1;
 	}
+	return FR_OK;
 }
 
 
-/*----------------------------------------*/
-/* Set/Clear a block of allocation bitmap */
-/*----------------------------------------*/
+static
+DWORD fmap_find (	/* 0:No free cluster, >=2:Free cluster number */
+	FATFS* fs,		/* File system object */
+	DWORD scl		/* Cluster to scan after */
+)
+{
+	DWORD *map = fs->fmap;
+	DWORD clst, bm;
+	UINT i, nw, n;
+
+
+	nw = (UINT)((fs->n_fatent + 31) / 32);
+	clst = scl + 1;
+	if (clst >= fs->n_fatent) clst = 2;
+	i = (UINT)(clst / 32);
+	bm = map[i] | (((DWORD)1 << (clst % 32)) - 1);	/* Mask out the clusters before the start */
+	for (n = nw + 1; n; n--) {	/* Up to the start word again on wrap-around */
+		if (~bm) {	/* Any free cluster in this word? */
+			clst = (DWORD)i * 32;
+			while (bm & 1) {
+				bm >>= 1; clst++;
+			}
+			return clst;
+		}
+		if (++i >= nw) i = 0;
+		bm = map[i];
+	}
+	return 0;
+}
+
 
 static
-FRESULT change_bitmap (
-	FATFS* fs,	/* File system object */
-	DWORD clst,	/* Cluster number to change from */
-	DWORD ncl,	/* Number of clusters to be changed */
-	int bv		/* bit value to be set (0 or 1) */
+DWORD fmap_count (	/* Number of free clusters */
+	FATFS* fs		/* File system object */
 )
 {
-	BYTE bm;
+	DWORD nfree = 0, bm;
 	UINT i;
-	DWORD sect;
 
-	clst -= 2;	/* The first bit corresponds to cluster #2 */
-	sect = fs->database + clst / 8 / SS(fs);	/* Sector address (assuming bitmap is located top of the cluster heap) */
-	i = clst / 8 % SS(fs);						/* Byte offset in the sector */
-	bm = 1 << (clst % 8);						/* Bit mask in the byte */
-	for (;;) {
-		if (move_window(fs, sect++) != FR_OK) return FR_DISK_ERR;
-		do {
+
+	for (i = 0; i < (fs->n_fatent + 31) / 32; i++) {
+		for (bm = ~fs->fmap[i]; bm; bm &= bm - 1) nfree++;	/* Count zero bits */
+	}
+	return nfree;
+}
+
+#endif	/* _USE_FREEMAP && !_FS_READONLY */
+
+
+
+
+#if !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Find a contiguous free cluster block (FAT12/16/32)     */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD find_fat (	/* 0:Not found, 2..:Cluster block found, 1:Internal error, 0xFFFFFFFF:Disk error */
+	_FDID* obj,		/* Corresponding object */
+	DWORD clst,		/* Cluster number to scan from */
+	DWORD ncl		/* Number of contiguous clusters to find (1..) */
+)
+{
+	FATFS *fs = obj->fs;
+	DWORD scl = 0, ctr = 0, left, val;
+	UINT i, n, epc;
+	BYTE *p;
+
+
+	if (clst < 2 || clst >= fs->n_fatent) clst = 2;
+	left = fs->n_fatent - 2;	/* Every cluster is checked once, the block does not wrap around */
+#if _USE_FREEMAP
+	if (fs->fmap) {		/* Scan the free cluster bitmap */
+		while (left) {
+			if (clst % 32 == 0 && left >= 32 && fs->n_fatent - clst >= 32 && fs->fmap[clst / 32] == 0xFFFFFFFF) {
+				ctr = 0; clst += 32; left -= 32;	/* Skip a word of clusters in use */
+			} else {
+				if (fs->fmap[clst / 32] & ((DWORD)1 << (clst % 32))) {
+					ctr = 0;
+				} else {
+					if (ctr++ == 0) scl = clst;
+					if (ctr == ncl) return scl;
+				}
+				clst++; left--;
+			}
+			if (clst >= fs->n_fatent) {	/* Wrap-around */
+				clst = 2; ctr = 0;
+			}
+		}
+		return 0;
+	}
+#endif
+	if (fs->fs_type == FS_FAT12) {	/* FAT12 entries can straddle sectors, get them one by one */
+		while (left--) {
+			val = get_fat(obj, clst);
+			if (val == 1 || val == 0xFFFFFFFF) return val;
+			if (val != 0) {
+				ctr = 0;
+			} else {
+				if (ctr++ == 0) scl = clst;
+				if (ctr == ncl) return scl;
+			}
+			if (++clst >= fs->n_fatent) {	/* Wrap-around */
+				clst = 2; ctr = 0;
+			}
+		}
+		return 0;
+	}
+	epc = SS(fs) / ((fs->fs_type == FS_FAT16) ? 2 : 4);	/* FAT16/32: Parse each FAT sector in the window at once */
+	while (left) {
+		if (move_window(fs, fs->fatbase + clst / epc) != FR_OK) return 0xFFFFFFFF;
+		i = clst % epc;
+		n = epc - i;								/* Entries to check in this sector */
+		if (n > fs->n_fatent - clst) n = (UINT)(fs->n_fatent - clst);
+		if (n > left) n = (UINT)left;
+		left -= n;
+		if (fs->fs_type == FS_FAT16) {
+			for (p = fs->win + i * 2; n; n--, clst++, p += 2) {
+				if (ld_word(p) != 0) {
+					ctr = 0;
+				} else {
+					if (ctr++ == 0) scl = clst;
+					if (ctr == ncl) return scl;
+				}
+			}
+		} else {
+			for (p = fs->win + i * 4; n; n--, clst++, p += 4) {
+				if (ld_dword(p) & 0x0FFFFFFF) {
+					ctr = 0;
+				} else {
+					if (ctr++ == 0) scl = clst;
+					if (ctr == ncl) return scl;
+				}
+			}
+		}
+		if (clst >= fs->n_fatent) {	/* Wrap-around */
+			clst = 2; ctr = 0;
+		}
+	}
+	return 0;
+}
+
+#endif	/* !_FS_READONLY */
+
+
+
+
+#if _FS_EXFAT && !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* exFAT: Accessing FAT and Allocation Bitmap                            */
+/*-----------------------------------------------------------------------*/
+
+/*--------------------------------------*/
+/* Find a contiguous free cluster block */
+/*--------------------------------------*/
+
+static
+DWORD find_bitmap (	/* 0:Not found, 2..:Cluster block found, 0xFFFFFFFF:Disk error */
+	FATFS* fs,	/* File system object */
+	DWORD clst,	/* Cluster number to scan from */
+	DWORD ncl	/* Number of contiguous clusters to find (1..) */
+)
+{
+	BYTE bm, bv;
+	UINT i;
+	DWORD val, scl, ctr;
+
+
+	clst -= 2;	/* The first bit in the bitmap corresponds to cluster #2 */
+	if (clst >= fs->n_fatent - 2) clst = 0;
+	scl = val = clst; ctr = 0;
+	for (;;) {
+		if (move_window(fs, fs->database + val / 8 / SS(fs)) != FR_OK) return 0xFFFFFFFF;	/* (assuming bitmap is located top of the cluster heap) */
+		i = val / 8 % SS(fs); bm = 1 << (val % 8);
+		do {
+			do {
+				bv = fs->win[i] & bm; bm <<= 1;		/* Get bit value */
+				if (++val >= fs->n_fatent - 2) {	/* Next cluster (with wrap-around) */
+					val = 0; bm = 0; i = SS(fs);
+				}
+				if (!bv) {	/* Is it a free cluster? */
+					if (++ctr == ncl) return scl + 2;	/* Check if run length is sufficient for required */
+				} else {
+					scl = val; ctr = 0;		/* Encountered a cluster in-use, restart to scan */
+				}
+				if (val == clst) return 0;	/* All cluster scanned? */
+			} while (bm);
+			bm = 1;
+		} while (++i < SS(fs));
+	}
+}
+
+
+/*----------------------------------------*/
+/* Set/Clear a block of allocation bitmap */
+/*----------------------------------------*/
+
+static
+FRESULT change_bitmap (
+	FATFS* fs,	/* File system object */
+	DWORD clst,	/* Cluster number to change from */
+	DWORD ncl,	/* Number of clusters to be changed */
+	int bv		/* bit value to be set (0 or 1) */
+)
+{
+	BYTE bm;
+	UINT i;
+	DWORD sect;
+
+	clst -= 2;	/* The first bit corresponds to cluster #2 */
+	sect = fs->database + clst / 8 / SS(fs);	/* Sector address (assuming bitmap is located top of the cluster heap) */
+	i = clst / 8 % SS(fs);						/* Byte offset in the sector */
+	bm = 1 << (clst % 8);						/* Bit mask in the byte */
+	for (;;) {
+		if (move_window(fs, sect++) != FR_OK) return FR_DISK_ERR;
+		do {
 			do {
 				if (bv == (int)((fs->win[i] & bm) != 0)) return FR_INT_ERR;	/* Is the bit expected value? */
 				fs->win[i] ^= bm;	/* Flip the bit */
@@ -1275,8 +1814,11 @@ FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 )
 {
 	FRESULT res = FR_OK;
-	DWORD nxt;
+	DWORD nxt, fcl = clst, ncl = 0;
 	FATFS *fs = obj->fs;
+	UINT sz;
+	BYTE *p;
+	int last = 0;
 #if _FS_EXFAT || _USE_TRIM
 	DWORD scl = clst, ecl = clst;
 #endif
@@ -1293,19 +1835,36 @@ FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 	}
 
 	/* Remove the chain */
+	sz = (fs->fs_type == FS_FAT16) ? 2 : (fs->fs_type == FS_FAT32) ? 4 : 0;	/* Size of a FAT entry to be cleared in place */
 	do {
-		nxt = get_fat(obj, clst);			/* Get cluster status */
-		if (nxt == 0) break;				/* Empty cluster? */
-		if (nxt == 1) return FR_INT_ERR;	/* Internal error? */
-		if (nxt == 0xFFFFFFFF) return FR_DISK_ERR;	/* Disk error? */
-		if (!_FS_EXFAT || fs->fs_type != FS_EXFAT) {
-			res = put_fat(fs, clst, 0);		/* Mark the cluster 'free' on the FAT */
-			if (res != FR_OK) return res;
-		}
-		if (fs->free_clst < fs->n_fatent - 2) {	/* Update FSINFO */
-			fs->free_clst++;
-			fs->fsi_flag |= 1;
+		if (sz) {	/* FAT16/32: Read and clear the link in the window, which stays on the FAT sector as long as the chain does */
+			res = move_window(fs, fs->fatbase + clst / (SS(fs) / sz));
+			if (res != FR_OK) break;
+			p = fs->win + clst * sz % SS(fs);
+			nxt = (sz == 2) ? ld_word(p) : ld_dword(p) & 0x0FFFFFFF;	/* Get cluster status */
+			if (nxt == 0) break;				/* Empty cluster? */
+			if (nxt == 1) { res = FR_INT_ERR; break; }	/* Internal error? */
+			if (sz == 2) {						/* Mark the cluster 'free' */
+				st_word(p, 0);
+			} else {
+				st_dword(p, ld_dword(p) & 0xF0000000);	/* (upper 4 bits are reserved) */
+			}
+			fs->wflag = 1;
+#if _USE_FREEMAP
+			if (fs->fmap) fs->fmap[clst / 32] &= ~((DWORD)1 << (clst % 32));	/* Keep the free cluster bitmap in sync */
+#endif
+		} else {	/* FAT12/exFAT */
+			nxt = get_fat(obj, clst);			/* Get cluster status */
+			if (nxt == 0) break;				/* Empty cluster? */
+			if (nxt == 1) { res = FR_INT_ERR; break; }	/* Internal error? */
+			if (nxt == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }	/* Disk error? */
+			if (!_FS_EXFAT || fs->fs_type != FS_EXFAT) {
+				res = put_fat(fs, clst, 0);		/* Mark the cluster 'free' on the FAT */
+				if (res != FR_OK) break;
+			}
 		}
+		ncl++;
+		if (clst == fs->last_clst) last = 1;
 #if _FS_EXFAT || _USE_TRIM
 		if (ecl + 1 == nxt) {	/* Is next cluster contiguous? */
 			ecl = nxt;
@@ -1313,7 +1872,7 @@ FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 #if _FS_EXFAT
 			if (fs->fs_type == FS_EXFAT) {
 				res = change_bitmap(fs, scl, ecl - scl + 1, 0);	/* Mark the cluster block 'free' on the bitmap */
-				if (res != FR_OK) return res;
+				if (res != FR_OK) break;
 			}
 #endif
 #if _USE_TRIM
@@ -1327,6 +1886,13 @@ FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 		clst = nxt;					/* Next cluster */
 	} while (clst < fs->n_fatent);	/* Repeat while not the last link */
 
+	if (ncl && fs->free_clst <= fs->n_fatent - 2) {	/* Update FSINFO with the clusters freed */
+		fs->free_clst = (fs->free_clst + ncl < fs->n_fatent - 2) ? fs->free_clst + ncl : fs->n_fatent - 2;
+		fs->fsi_flag |= 1;
+	}
+	if (last) fs->last_clst = (fcl > 2) ? fcl - 1 : 2;	/* The last allocation has gone, allocate from the freed space next */
+	if (res != FR_OK) return res;
+
 #if _FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {
 		if (pclst == 0) {	/* Does the object have no chain? */
@@ -1397,18 +1963,15 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 	} else
 #endif
 	{	/* On the FAT12/16/32 volume */
-		ncl = scl;	/* Start cluster */
-		for (;;) {
-			ncl++;							/* Next cluster */
-			if (ncl >= fs->n_fatent) {		/* Check wrap-around */
-				ncl = 2;
-				if (ncl > scl) return 0;	/* No free cluster */
-			}
-			cs = get_fat(obj, ncl);			/* Get the cluster status */
-			if (cs == 0) break;				/* Found a free cluster */
-			if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* An error occurred */
-			if (ncl == scl) return 0;		/* No free cluster */
+#if _USE_FREEMAP
+		if (fs->fmap) {		/* Find a free cluster on the bitmap */
+			ncl = fmap_find(fs, scl);
+		} else
+#endif
+		{
+			ncl = find_fat(obj, scl + 1, 1);	/* Find a free cluster on the FAT, next to the start cluster first */
 		}
+		if (ncl < 2 || ncl == 0xFFFFFFFF) return ncl;	/* No free cluster or an error occurred */
 		res = put_fat(fs, ncl, 0xFFFFFFFF);	/* Mark the new cluster 'EOC' */
 		if (res == FR_OK && clst != 0) {
 			res = put_fat(fs, clst, ncl);	/* Link it from the previous one if needed */
@@ -1462,6 +2025,386 @@ DWORD clmt_clust (	/* <2:Error, >=2:Cluster number */
 
 
 
+#if _USE_LINKMAP
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Automatic link map of the open files                   */
+/*-----------------------------------------------------------------------*/
+
+static
+void lmap_init (
+	FATFS* fs		/* Pointer to the file system object */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < _LINKMAP_FRAGS; i++) {	/* Put all fragments on the free list */
+		fs->lmfrag[i].next = (WORD)(i + 2);
+	}
+	fs->lmfrag[_LINKMAP_FRAGS - 1].next = 0;
+	fs->lmfree = 1;
+}
+
+
+static
+void lmap_free (
+	FIL* fp			/* Pointer to the file object */
+)
+{
+	FATFS *fs = fp->obj.fs;
+
+
+	if (fp->lmtop) {	/* Return the fragments of the file to the free list */
+		fs->lmfrag[fp->lmlast - 1].next = fs->lmfree;
+		fs->lmfree = fp->lmtop;
+	}
+	fp->lmtop = fp->lmlast = 0;
+	fp->lmncl = 0;
+}
+
+
+static
+DWORD lmap_clust (	/* 0:Not mapped, >=2:Cluster number */
+	FIL* fp,		/* Pointer to the file object */
+	DWORD cl		/* Cluster order from top of the file */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	LMFRAG *fr;
+	DWORD top;
+	WORD i;
+
+
+	if (cl >= fp->lmncl) return 0;			/* Not mapped yet? */
+	fr = &fs->lmfrag[fp->lmlast - 1];
+	top = fp->lmncl - fr->ncl;
+	if (cl >= top) return fr->clst + cl - top;	/* In the last fragment? (sequential access) */
+	for (i = fp->lmtop; ; i = fr->next) {	/* Find the fragment */
+		fr = &fs->lmfrag[i - 1];
+		if (cl < fr->ncl) break;
+		cl -= fr->ncl;
+	}
+	return fr->clst + cl;
+}
+
+
+static
+void lmap_add (
+	FIL* fp,		/* Pointer to the file object */
+	DWORD cl,		/* Cluster order from top of the file */
+	DWORD clst		/* Cluster number at the order */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	LMFRAG *fr;
+	WORD i;
+
+
+	if (cl != fp->lmncl) return;	/* The map grows only at its end */
+	if (fp->lmlast) {
+		fr = &fs->lmfrag[fp->lmlast - 1];
+		if (fr->clst + fr->ncl == clst) {	/* Contiguous to the last fragment? */
+			fr->ncl++; fp->lmncl++;
+			return;
+		}
+	}
+	i = fs->lmfree;
+	if (i == 0) return;			/* No free fragment (rest of the chain stays on the FAT) */
+	fr = &fs->lmfrag[i - 1];
+	fs->lmfree = fr->next;
+	fr->clst = clst; fr->ncl = 1; fr->next = 0;
+	if (fp->lmlast) {
+		fs->lmfrag[fp->lmlast - 1].next = i;
+	} else {
+		fp->lmtop = i;
+	}
+	fp->lmlast = i;
+	fp->lmncl++;
+}
+
+
+static
+DWORD lmap_next (	/* 0:Disk full (stretch), 1:Internal error, 0xFFFFFFFF:Disk error, >=2:Cluster number or end of chain */
+	FIL* fp,		/* Pointer to the file object */
+	DWORD cl,		/* Cluster order from top of the file to get the cluster of */
+	DWORD clst,		/* Cluster at the order cl - 1 */
+	int stretch		/* 0:Follow the chain, 1:Follow or stretch the chain */
+)
+{
+	DWORD ncl;
+
+
+#if _FS_READONLY
+	(void)stretch;		/* Never set without write access */
+#endif
+	ncl = lmap_clust(fp, cl);
+	if (ncl == 0) {		/* Not mapped, follow the chain on the FAT and record it */
+		lmap_add(fp, cl - 1, clst);
+#if !_FS_READONLY
+		if (stretch) {
+			ncl = create_chain(&fp->obj, clst);
+		} else
+#endif
+		{
+			ncl = get_fat(&fp->obj, clst);
+		}
+		if (ncl >= 2 && ncl < fp->obj.fs->n_fatent) lmap_add(fp, cl, ncl);
+	}
+	return ncl;
+}
+
+#endif	/* _USE_LINKMAP */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* File access - Get the cluster at a cluster boundary of the file       */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD next_clust (	/* 0:Disk full (stretch), 1:Internal error, 0xFFFFFFFF:Disk error, >=2:Cluster number or end of chain */
+	FIL* fp,		/* Pointer to the file object */
+	FSIZE_t ofs,	/* File offset on the cluster boundary (>0) */
+	DWORD clst,		/* Cluster just before the offset */
+	int stretch		/* 0:Follow the chain, 1:Follow or stretch the chain */
+)
+{
+#if _USE_EXPAND
+	if (fp->xncl && ofs / SS(fp->obj.fs) / fp->obj.fs->csize < fp->xncl) return clst + 1;	/* In the block reserved for the stream */
+#endif
+#if _USE_FASTSEEK
+	if (fp->cltbl) return clmt_clust(fp, ofs);	/* Get cluster# from the CLMT */
+#endif
+#if _USE_LINKMAP
+	return lmap_next(fp, (DWORD)(ofs / SS(fp->obj.fs) / fp->obj.fs->csize), clst, stretch);	/* Follow (or stretch) cluster chain on the link map or FAT */
+#else
+#if !_FS_READONLY
+	if (stretch) return create_chain(&fp->obj, clst);	/* Follow or stretch cluster chain on the FAT */
+#else
+	(void)stretch;		/* Never set without write access */
+#endif
+	return get_fat(&fp->obj, clst);	/* Follow cluster chain on the FAT */
+#endif
+}
+
+
+
+
+#if !_FS_TINY
+/*-----------------------------------------------------------------------*/
+/* File access - Flush and load the file buffer                          */
+/*-----------------------------------------------------------------------*/
+
+#if _USE_FILEBUF && _FILEBUF_SHARE
+static
+void fb_check (
+	FIL* fp			/* Pointer to the file object */
+)
+{
+	if (fp->fbid && fp->obj.fs->fbtag[fp->fbid - 1] != fp->fbtag) {	/* Has another file taken the buffer? */
+		fp->fbid = 0;		/* It has written back our data as well */
+		fp->fbcnt = 0;
+		fp->buf = fp->fbuf = 0;
+		fp->flag &= (BYTE)~FA_DIRTY;
+	}
+}
+#endif
+
+
+#if !_FS_READONLY
+static
+FRESULT fb_flush (	/* FR_OK(0):succeeded, !=0:error */
+	FIL* fp			/* Pointer to the file object */
+)
+{
+#if _USE_FILEBUF && _FILEBUF_SHARE
+	fb_check(fp);
+#endif
+	if (fp->flag & FA_DIRTY) {	/* Write-back cached data if needed */
+#if _USE_FILEBUF
+		if (disk_write(fp->obj.fs->drv, fp->fbuf + fp->fbdlo * SS(fp->obj.fs), fp->fbsect + fp->fbdlo, fp->fbdhi - fp->fbdlo) != RES_OK) return FR_DISK_ERR;
+#if _FILEBUF_SHARE
+		fp->obj.fs->fbdhi[fp->fbid - 1] = fp->obj.fs->fbdlo[fp->fbid - 1];	/* Nothing left for the pool to write back */
+#endif
+#else
+		if (disk_write(fp->obj.fs->drv, fp->buf, fp->sect, 1) != RES_OK) return FR_DISK_ERR;
+#endif
+		fp->flag &= (BYTE)~FA_DIRTY;
+	}
+	return FR_OK;
+}
+
+
+#if _USE_FILEBUF
+static
+void fb_dirty (
+	FIL* fp			/* Pointer to the file object with the current sector modified */
+)
+{
+	BYTE i = (BYTE)(fp->sect - fp->fbsect);
+#if _FILEBUF_SHARE
+	FATFS *fs = fp->obj.fs;
+#endif
+
+
+	if (!(fp->flag & FA_DIRTY)) {
+		fp->fbdlo = i; fp->fbdhi = i + 1;
+		fp->flag |= FA_DIRTY;
+	} else {
+		if (i < fp->fbdlo) fp->fbdlo = i;
+		if (i >= fp->fbdhi) fp->fbdhi = i + 1;
+	}
+#if _FILEBUF_SHARE
+	fs->fbsect[fp->fbid - 1] = fp->fbsect;	/* Let the pool write back the data if another file takes the buffer */
+	fs->fbdlo[fp->fbid - 1] = fp->fbdlo;
+	fs->fbdhi[fp->fbid - 1] = fp->fbdhi;
+#endif
+}
+#endif
+#endif
+
+
+#if _USE_FILEBUF
+static
+FRESULT fb_take (	/* FR_OK(0):succeeded, !=0:error */
+	FIL* fp			/* Pointer to the file object to take a buffer from the pool */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	UINT i;
+#if _FILEBUF_SHARE
+	UINT v;
+	DWORD age, vage;
+#endif
+
+
+	for (i = 0; i < _FILEBUF_NUM && (fs->fbuse & (1 << i)); i++) ;	/* Find a free buffer */
+#if _FILEBUF_SHARE
+	if (i == _FILEBUF_NUM) {	/* Take the least recently used buffer from another file, one without unwritten data first */
+		v = 0; vage = 0;
+		for (i = 0; i < _FILEBUF_NUM; i++) {
+			age = fs->fbclk - fs->fbage[i];
+			if (age > 0x7FFFFFFF) age = 0x7FFFFFFF;
+			if (fs->fbdlo[i] == fs->fbdhi[i]) age |= 0x80000000;
+			if (age >= vage) {
+				vage = age; v = i;
+			}
+		}
+#if !_FS_READONLY
+		if (fs->fbdlo[v] != fs->fbdhi[v]) {	/* Write-back the data of the other file, which may be gone without f_close() */
+			if (disk_write(fs->drv, fs->fbpool + v * _FILEBUF_SECT * _MAX_SS + fs->fbdlo[v] * SS(fs), fs->fbsect[v] + fs->fbdlo[v], fs->fbdhi[v] - fs->fbdlo[v]) != RES_OK) return FR_DISK_ERR;
+		}
+#endif
+		i = v;				/* The other file sees the new tag and reloads its current sector at the next access */
+	}
+#endif
+	if (i < _FILEBUF_NUM) {
+		fs->fbuse |= (BYTE)(1 << i);
+		fp->fbid = (BYTE)(i + 1);
+		fp->fbuf = fs->fbpool + i * _FILEBUF_SECT * _MAX_SS;
+#if _FILEBUF_SHARE
+		fs->fbtag[i] = fp->fbtag = ++fs->fbclk;
+		fs->fbdlo[i] = fs->fbdhi[i] = 0;
+#endif
+	}
+	return FR_OK;
+}
+#endif
+
+
+static
+FRESULT fb_load (	/* FR_OK(0):succeeded, !=0:error */
+	FIL* fp,		/* Pointer to the file object */
+	DWORD sect,		/* Sector of the file pointer to be the current sector */
+	int fill		/* 0:The sector is to be written over, 1:Read it */
+)
+{
+	FATFS *fs = fp->obj.fs;
+#if _USE_FILEBUF
+	DWORD ofs, n;
+	FSIZE_t rem;
+
+
+	ofs = sect - fp->fbsect;
+	if (ofs >= fp->fbcnt) {	/* Not in the file buffer? */
+		if (!fill && ofs == fp->fbcnt && ofs < (fp->fbid ? _FILEBUF_SECT : _FILEBUF_SHARE ? 0 : 1)) {
+			fp->fbcnt++;	/* Extend the buffered run at its end (growing edge) */
+		} else {
+#if !_FS_READONLY
+			if (fb_flush(fp) != FR_OK) return FR_DISK_ERR;
+#endif
+			if (!fp->fbid && fb_take(fp) != FR_OK) return FR_DISK_ERR;	/* Take a buffer from the pool */
+			n = 1;
+			if (fill) {		/* Read the sectors ahead in the cluster and the file as well */
+				n = fp->fbid ? _FILEBUF_SECT : 1;
+				ofs = fs->csize - ((DWORD)(fp->fptr / SS(fs)) & (fs->csize - 1));
+				if (n > ofs) n = ofs;
+				rem = fp->obj.objsize - (fp->fptr - fp->fptr % SS(fs));
+				if ((FSIZE_t)n * SS(fs) > rem) n = (DWORD)((rem + SS(fs) - 1) / SS(fs));
+				if (n < 1) n = 1;
+				fp->fbcnt = 0;
+				if (disk_read(fs->drv, fp->fbuf, sect, n) != RES_OK) return FR_DISK_ERR;
+			}
+			fp->fbsect = sect; fp->fbcnt = (BYTE)n;
+			ofs = 0;
+		}
+	}
+	fp->buf = fp->fbuf + ofs * SS(fs);
+#if _FILEBUF_SHARE
+	fs->fbage[fp->fbid - 1] = ++fs->fbclk;	/* Mark the buffer used */
+#endif
+#else
+#if !_FS_READONLY
+	if (fb_flush(fp) != FR_OK) return FR_DISK_ERR;	/* Write-back dirty sector cache */
+#endif
+	if (fill && disk_read(fs->drv, fp->buf, sect, 1) != RES_OK) return FR_DISK_ERR;	/* Fill sector cache */
+#endif
+	fp->sect = sect;
+	return FR_OK;
+}
+
+
+#if _USE_FILEBUF && _FILEBUF_SHARE
+static
+FRESULT fb_hold (	/* FR_OK(0):succeeded, !=0:error */
+	FIL* fp			/* Pointer to the file object to be accessed */
+)
+{
+	FATFS *fs = fp->obj.fs;
+
+
+	fb_check(fp);
+	if (fp->fbid) {			/* Mark the buffer used */
+		fs->fbage[fp->fbid - 1] = ++fs->fbclk;
+	} else if (fp->sect) {	/* Has the buffer been taken by another file? */
+		if (fp->fptr % SS(fs)) return fb_load(fp, fp->sect, 1);	/* Reload the current sector */
+		fp->sect = 0;		/* The sector is loaded when the file pointer enters it */
+	}
+	return FR_OK;
+}
+#endif
+
+
+#if _USE_FILEBUF
+static
+void fb_free (
+	FIL* fp			/* Pointer to the file object to be invalidated */
+)
+{
+#if _FILEBUF_SHARE
+	fb_check(fp);			/* Nothing to return if another file has taken the buffer */
+#endif
+	if (fp->fbid) fp->obj.fs->fbuse &= (BYTE)~(1 << (fp->fbid - 1));	/* Return the file buffer to the pool */
+	fp->fbid = 0;
+}
+#endif
+
+#endif	/* !_FS_TINY */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Set directory index                              */
 /*-----------------------------------------------------------------------*/
@@ -1511,6 +2454,54 @@ FRESULT dir_sdi (	/* FR_OK(0):succeeded, !=0:error */
 
 
 
+#if !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Fill a cluster with zeros                        */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT dir_clear (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS *fs,		/* File system object */
+	DWORD clst		/* Directory table to clear */
+)
+{
+	DWORD sect;
+	UINT n;
+#if _FS_ZEROFILL
+	UINT szb;
+	DWORD rt[2];
+#endif
+
+
+	if (sync_window(fs) != FR_OK) return FR_DISK_ERR;	/* Flush disk access window */
+	sect = clust2sect(fs, clst);		/* Top of the cluster */
+	fs->winsect = sect;					/* Set window to top of the cluster */
+	mem_set(fs->win, 0, SS(fs));		/* Clear window buffer */
+#if _FS_ZEROFILL
+#if _USE_WINCACHE
+	wc_drop(fs, sect, fs->csize);
+#endif
+	rt[0] = sect; rt[1] = sect + fs->csize - 1;
+	if (disk_ioctl(fs->drv, CTRL_ZERO, rt) == RES_OK) return FR_OK;	/* Let the device clear the cluster if it can */
+	for (n = 0; n < fs->csize; n += szb) {	/* Write the zero block over the cluster */
+		szb = fs->csize - n;
+		if (szb > _ZEROFILL_XFER) szb = _ZEROFILL_XFER;
+		if (disk_write(fs->drv, ZeroBlock, sect + n, szb) != RES_OK) return FR_DISK_ERR;
+	}
+#else
+	for (n = 0; n < fs->csize; n++, fs->winsect++) {	/* Fill the cluster with 0 */
+		fs->wflag = 1;
+		if (sync_window(fs) != FR_OK) return FR_DISK_ERR;
+	}
+	fs->winsect = sect;					/* Restore window offset */
+#endif
+	return FR_OK;
+}
+#endif	/* !_FS_READONLY */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Move directory table index next                  */
 /*-----------------------------------------------------------------------*/
@@ -1523,9 +2514,6 @@ FRESULT dir_next (	/* FR_OK(0):succeeded, FR_NO_FILE:End of table, FR_DENIED:Cou
 {
 	DWORD ofs, clst;
 	FATFS *fs = dp->obj.fs;
-#if !_FS_READONLY
-	UINT n;
-#endif
 
 	ofs = dp->dptr + SZDIRE;	/* Next entry */
 	if (!dp->sect || ofs >= (DWORD)((_FS_EXFAT && fs->fs_type == FS_EXFAT) ? MAX_DIR_EX : MAX_DIR)) return FR_NO_FILE;	/* Report EOT when offset has reached max value */
@@ -1554,13 +2542,7 @@ FRESULT dir_next (	/* FR_OK(0):succeeded, FR_NO_FILE:End of table, FR_DENIED:Cou
 					if (clst == 0xFFFFFFFF) return FR_DISK_ERR;	/* Disk error */
 					/* Clean-up the stretched table */
 					if (_FS_EXFAT) dp->obj.stat |= 4;			/* The directory needs to be updated */
-					if (sync_window(fs) != FR_OK) return FR_DISK_ERR;	/* Flush disk access window */
-					mem_set(fs->win, 0, SS(fs));				/* Clear window buffer */
-					for (n = 0, fs->winsect = clust2sect(fs, clst); n < fs->csize; n++, fs->winsect++) {	/* Fill the new cluster with 0 */
-						fs->wflag = 1;
-						if (sync_window(fs) != FR_OK) return FR_DISK_ERR;
-					}
-					fs->winsect -= n;							/* Restore window offset */
+					if (dir_clear(fs, clst) != FR_OK) return FR_DISK_ERR;	/* Fill the new cluster with 0 */
 #else
 					if (!stretch) dp->sect = 0;					/* (this line is to suppress compiler warning) */
 					dp->sect = 0; return FR_NO_FILE;			/* Report EOT */
@@ -1580,6 +2562,27 @@ FRESULT dir_next (	/* FR_OK(0):succeeded, FR_NO_FILE:End of table, FR_DENIED:Cou
 
 
 
+#if _USE_DENTCACHE || (_USE_LFN != 0 && ((_USE_ALIASMAP && !_FS_READONLY) || _USE_DIRINDEX))
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Get the key of a directory                       */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD dir_key (		/* Returns the start cluster that identifies the directory */
+	DIR* dp			/* Pointer to the directory object */
+)
+{
+	DWORD clst = dp->obj.sclust;
+
+
+	if (clst == 0 && dp->obj.fs->fs_type == FS_FAT32) clst = dp->obj.fs->dirbase;	/* The root directory has two names on the FAT32 volume */
+	return clst;
+}
+
+#endif
+
+
+
 #if !_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Reserve a block of directory entries             */
@@ -1596,7 +2599,11 @@ FRESULT dir_alloc (	/* FR_OK(0):succeeded, !=0:error */
 	FATFS *fs = dp->obj.fs;
 
 
+#if _USE_DIRINDEX && _USE_LFN != 0
+	res = dir_sdi(dp, (fs->xdir == dir_key(dp) && fs->xfre) ? fs->xfre - SZDIRE : 0);	/* The entries before the first free one of the indexed directory are in use (start at the last of them, as the free one can be past the end of the table) */
+#else
 	res = dir_sdi(dp, 0);
+#endif
 	if (res == FR_OK) {
 		n = 0;
 		do {
@@ -1831,11 +2838,150 @@ void gen_numname (
 			j++;
 		}
 	}
-	do {
-		dst[j++] = (i < 8) ? ns[i++] : ' ';
-	} while (j < 8);
+	do {
+		dst[j++] = (i < 8) ? ns[i++] : ' ';
+	} while (j < 8);
+}
+#endif	/* _USE_LFN != 0 && !_FS_READONLY */
+
+
+
+#if _USE_DENTCACHE || (_USE_READDIRN && _FS_MINIMIZE <= 1) || (_USE_LFN != 0 && ((_USE_ALIASMAP && !_FS_READONLY) || _USE_DIRINDEX))
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Hash of a name                                   */
+/*-----------------------------------------------------------------------*/
+
+#define NHASH_INIT	0x811C9DC5	/* Hash of an empty name (FNV-1a offset basis) */
+
+static
+DWORD name_hash (	/* Returns the hash with the character added (FNV-1a) */
+	DWORD h,		/* Hash of the name so far */
+	WCHAR wc		/* Character */
+)
+{
+	return ((h ^ wc) * 0x01000193) & 0xFFFFFFFF;
+}
+
+#endif
+
+
+
+#if _USE_LFN != 0 && (_FS_MINIMIZE <= 1 || _FS_RPATH >= 2 || _USE_DIRINDEX)
+/*-----------------------------------------------------------------------*/
+/* FAT-LFN: Get the SFN in the form it reads                             */
+/*-----------------------------------------------------------------------*/
+
+static
+void get_sfn (
+	WCHAR* sfn,			/* Buffer to store the SFN (body.ext) in OEM code, 13 items */
+	const BYTE* dir,	/* Pointer to the SFN entry */
+	int lcase			/* Apply the case info of the entry */
+)
+{
+	UINT i, j;
+	WCHAR wc;
+
+
+	i = j = 0;
+	while (i < 11) {
+		wc = dir[i++];
+		if (wc == ' ') continue;				/* Skip padding spaces */
+		if (wc == RDDEM) wc = DDEM;				/* Restore replaced DDEM character */
+		if (i == 9) sfn[j++] = '.';				/* Insert a . if extension is exist */
+		if (IsDBCS1(wc) && i != 8 && i != 11 && IsDBCS2(dir[i])) {
+			wc = wc << 8 | dir[i++];
+		}
+		if (lcase && IsUpper(wc) && (dir[DIR_NTres] & ((i >= 9) ? NS_EXT : NS_BODY))) {
+			wc += 0x20;			/* To lower */
+		}
+		sfn[j++] = wc;
+	}
+	sfn[j] = 0;
+}
+
+#endif
+
+
+
+#if _USE_ALIASMAP && _USE_LFN != 0 && !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT-LFN: Short name set of a directory                                */
+/*-----------------------------------------------------------------------*/
+
+
+static
+UINT amap_bit (		/* Returns the bit of the SFN in the set */
+	const BYTE* sfn,	/* Pointer to the SFN */
+	UINT k				/* Hash function (0 or 1) */
+)
+{
+	DWORD h = k ? NHASH_INIT : 0x3C6EF372;	/* Two hash functions by the initial value */
+	UINT i;
+
+
+	for (i = 0; i < 11; i++) h = name_hash(h, sfn[i]);	/* Hash the 11 bytes */
+	return (UINT)(h % (_ALIASMAP_SIZE * 8));
+}
+
+
+static
+void amap_add (
+	FATFS* fs,			/* File system object */
+	const BYTE* sfn		/* Pointer to the SFN */
+)
+{
+	UINT b;
+
+
+	b = amap_bit(sfn, 0); fs->amap[b / 8] |= 1 << b % 8;
+	b = amap_bit(sfn, 1); fs->amap[b / 8] |= 1 << b % 8;
+}
+
+
+static
+int amap_test (		/* 0:Not in the directory, 1:Can be in the directory */
+	FATFS* fs,			/* File system object */
+	const BYTE* sfn		/* Pointer to the SFN */
+)
+{
+	UINT b0 = amap_bit(sfn, 0), b1 = amap_bit(sfn, 1);
+
+
+	return (fs->amap[b0 / 8] & 1 << b0 % 8) && (fs->amap[b1 / 8] & 1 << b1 % 8);
+}
+
+
+static
+FRESULT amap_build (	/* FR_OK(0):succeeded, !=0:error */
+	DIR* dp				/* Directory to be scanned */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	DIR dj;
+	BYTE c;
+
+
+	fs->adir = 0xFFFFFFFF;			/* The set is invalid until the scan completes */
+	mem_set(fs->amap, 0, _ALIASMAP_SIZE);
+	mem_cpy(&dj, dp, sizeof (DIR));	/* Scan with a copy of the directory object */
+	res = dir_sdi(&dj, 0);
+	while (res == FR_OK) {
+		res = move_window(fs, dj.sect);
+		if (res != FR_OK) break;
+		c = dj.dir[DIR_Name];
+		if (c == 0) break;			/* Reached to end of the table */
+		if (c != DDEM && !(dj.dir[DIR_Attr] & AM_VOL)) {	/* Put the SFN entries (not LFN, volume label and deleted) */
+			amap_add(fs, dj.dir);
+		}
+		res = dir_next(&dj, 0);
+	}
+	if (res == FR_NO_FILE) res = FR_OK;	/* Reached to end of the table */
+	if (res == FR_OK) fs->adir = dir_key(dp);
+	return res;
 }
-#endif	/* _USE_LFN != 0 && !_FS_READONLY */
+
+#endif	/* _USE_ALIASMAP && _USE_LFN != 0 && !_FS_READONLY */
 
 
 
@@ -2203,12 +3349,13 @@ FRESULT dir_read (
 
 
 /*-----------------------------------------------------------------------*/
-/* Directory handling - Find an object in the directory                  */
+/* Directory handling - Search the entries for the name                  */
 /*-----------------------------------------------------------------------*/
 
 static
-FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
-	DIR* dp			/* Pointer to the directory object with the file name */
+FRESULT dir_scan (	/* FR_OK(0):succeeded, FR_NO_FILE:not found, !=0:error */
+	DIR* dp,		/* Pointer to the directory object with the file name, at the entry to start at */
+	int blk			/* 0:Search up to end of the table, 1:Search the entry block at the current entry only */
 )
 {
 	FRESULT res;
@@ -2218,29 +3365,6 @@ FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 	BYTE a, ord, sum;
 #endif
 
-	res = dir_sdi(dp, 0);			/* Rewind directory object */
-	if (res != FR_OK) return res;
-#if _FS_EXFAT
-	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
-		BYTE nc;
-		UINT di, ni;
-		WORD hash = xname_sum(fs->lfnbuf);		/* Hash value of the name to find */
-
-		while ((res = dir_read(dp, 0)) == FR_OK) {	/* Read an item */
-#if _MAX_LFN < 255
-			if (fs->dirbuf[XDIR_NumName] > _MAX_LFN) continue;			/* Skip comparison if inaccessible object name */
-#endif
-			if (ld_word(fs->dirbuf + XDIR_NameHash) != hash) continue;	/* Skip comparison if hash mismatched */
-			for (nc = fs->dirbuf[XDIR_NumName], di = SZDIRE * 2, ni = 0; nc; nc--, di += 2, ni++) {	/* Compare the name */
-				if ((di % SZDIRE) == 0) di += 2;
-				if (ff_wtoupper(ld_word(fs->dirbuf + di)) != ff_wtoupper(fs->lfnbuf[ni])) break;
-			}
-			if (nc == 0 && !fs->lfnbuf[ni]) break;	/* Name matched? */
-		}
-		return res;
-	}
-#endif
-	/* On the FAT12/16/32 volume */
 #if _USE_LFN != 0
 	ord = sum = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
 #endif
@@ -2252,6 +3376,7 @@ FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 #if _USE_LFN != 0	/* LFN configuration */
 		dp->obj.attr = a = dp->dir[DIR_Attr] & AM_MASK;
 		if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {	/* An entry without valid data */
+			if (blk) { res = FR_NO_FILE; break; }	/* Not an entry block */
 			ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
 		} else {
 			if (a == AM_LFN) {			/* An LFN entry is found */
@@ -2267,18 +3392,439 @@ FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 			} else {					/* An SFN entry is found */
 				if (!ord && sum == sum_sfn(dp->dir)) break;	/* LFN matched? */
 				if (!(dp->fn[NSFLAG] & NS_LOSS) && !mem_cmp(dp->dir, dp->fn, 11)) break;	/* SFN matched? */
+				if (blk) { res = FR_NO_FILE; break; }	/* End of the entry block */
 				ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
 			}
 		}
 #else		/* Non LFN configuration */
 		dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
 		if (!(dp->dir[DIR_Attr] & AM_VOL) && !mem_cmp(dp->dir, dp->fn, 11)) break;	/* Is it a valid entry? */
+		if (blk) { res = FR_NO_FILE; break; }
+#endif
+		res = dir_next(dp, 0);	/* Next entry */
+	} while (res == FR_OK);
+
+	return res;
+}
+
+
+
+
+#if _USE_DIRINDEX && _USE_LFN != 0
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Hashed index of a directory                      */
+/*-----------------------------------------------------------------------*/
+
+#define DIX_WIDTH	16	/* Bytes of the filter per sector of a new index, halved as the directory grows */
+#define DIX_BITS	6	/* Bits set for a name in the filter of its sector (taken 5 bits apart from its hash) */
+
+static
+DWORD dix_mix (		/* Returns the hash with the character added */
+	DWORD h,		/* Hash of the name so far */
+	UINT i,			/* Position of the character in the name */
+	WCHAR wc		/* Character */
+)
+{
+	DWORD t;
+
+
+	t = name_hash(name_hash(NHASH_INIT, (WCHAR)i), ff_wtoupper(wc));	/* Characters are added up in any order, as LFN entries are stored last part first */
+	t ^= t >> 15;	/* Bring the upper bits down to the slot index */
+	t = (t * 0x85EBCA6B) & 0xFFFFFFFF;
+	t ^= t >> 13;
+	return (h + t) & 0xFFFFFFFF;
+}
+
+
+static
+DWORD dix_lfn (		/* Returns the hash of a name */
+	const WCHAR* lfn	/* Pointer to the name */
+)
+{
+	UINT i;
+	DWORD h = 0;
+
+
+	for (i = 0; lfn[i]; i++) h = dix_mix(h, i, lfn[i]);
+	return h;
+}
+
+
+static
+DWORD dix_lfn_part (	/* Returns the hash with the part of LFN added */
+	DWORD h,			/* Hash of the LFN so far */
+	const BYTE* dir		/* Pointer to the LFN entry */
+)
+{
+	UINT i, s;
+	WCHAR wc;
+
+
+	i = ((dir[LDIR_Ord] & 0x3F) - 1) * 13;	/* Position of the part in the LFN */
+	for (s = 0; s < 13; s++) {
+		wc = ld_word(dir + LfnOfs[s]);
+		if (!wc) break;					/* End of the LFN */
+		h = dix_mix(h, i + s, wc);
+	}
+	return h;
+}
+
+
+static
+DWORD dix_sfn (		/* Returns the hash of an SFN in the form it reads (body.ext) */
+	const BYTE* dir		/* Pointer to the SFN */
+)
+{
+	UINT i;
+	WCHAR sfn[13];
+	DWORD h = 0;
+
+
+	get_sfn(sfn, dir, 0);
+	for (i = 0; sfn[i]; i++) h = dix_mix(h, i, ff_convert(sfn[i], 1));	/* OEM -> Unicode */
+	return h;
+}
+
+
+static
+int dix_numbered (	/* 1:The SFN is a numbered one */
+	const BYTE* dir		/* Pointer to the SFN */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < 8 && dir[i] != '~'; i++) ;
+	return i < 8;
+}
+
+
+static
+void dix_put (
+	FATFS* fs,		/* File system object */
+	DWORD h,		/* Hash of the name */
+	DWORD sect		/* Sector of the directory the entry block starts in */
+)
+{
+	UINT i, n, w;
+	BYTE *p;
+
+
+	while (sect >= _DIRINDEX_SIZE / fs->xwid && fs->xwid > 1) {	/* Halve the filters until they cover the sector */
+		w = fs->xwid / 2;
+		for (n = 0; n < (UINT)fs->xsct * w; n++) {	/* Fold each filter into its lower half (in place, front to back) */
+			fs->xtbl[n] = fs->xtbl[n / w * 2 * w + n % w] | fs->xtbl[n / w * 2 * w + n % w + w];
+		}
+		mem_set(fs->xtbl + n, 0, _DIRINDEX_SIZE - n);
+		fs->xwid = (BYTE)w;
+	}
+	if (sect >= fs->xsct) fs->xsct = (WORD)(sect + 1);
+	if (sect < _DIRINDEX_SIZE / fs->xwid) {	/* Set the bits of the name in the filter of the sector */
+		p = fs->xtbl + sect * fs->xwid;
+		for (i = 0; i < DIX_BITS; i++) {
+			n = (UINT)(h >> i * 5) % (fs->xwid * 8);
+			p[n / 8] |= 1 << n % 8;
+		}
+	}
+}
+
+
+static
+int dix_test (		/* 1:The name may be in the sector, 0:It is not */
+	FATFS* fs,		/* File system object */
+	DWORD h,		/* Hash of the name */
+	DWORD sect		/* Sector of the directory */
+)
+{
+	UINT i, n;
+	BYTE *p = fs->xtbl + sect * fs->xwid;
+
+
+	for (i = 0; i < DIX_BITS; i++) {
+		n = (UINT)(h >> i * 5) % (fs->xwid * 8);
+		if (!(p[n / 8] & 1 << n % 8)) return 0;
+	}
+	return 1;
+}
+
+
+static
+void dix_add (
+	FATFS* fs,		/* File system object */
+	const BYTE* dir,	/* Pointer to the SFN of the object */
+	DWORD hl,		/* Hash of the LFN of the object */
+	int lfn,		/* The object has a valid LFN */
+	DWORD ofs		/* Offset of the entry block */
+)
+{
+	DWORD hs = dix_sfn(dir);
+
+
+	if (lfn) {
+		dix_put(fs, hl, ofs / SS(fs));
+		if (hl == hs || dix_numbered(dir)) return;	/* A search by the SFN tests the same bits, or searches without index */
+	}
+	dix_put(fs, hs, ofs / SS(fs));
+}
+
+
+static
+FRESULT dix_build (	/* FR_OK(0):succeeded, !=0:error */
+	DIR* dp			/* Directory to be indexed */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	DIR dj;
+	BYTE c, a, ord, sum;
+	DWORD blk, h;
+
+
+	fs->xdir = 0xFFFFFFFF;			/* The index is invalid until the scan completes */
+	fs->xsct = 0; fs->xwid = DIX_WIDTH; fs->xfre = 0xFFFFFFFF;
+	mem_set(fs->xtbl, 0, _DIRINDEX_SIZE);
+	mem_cpy(&dj, dp, sizeof (DIR));	/* Scan with a copy of the directory object */
+	ord = sum = 0xFF; blk = 0xFFFFFFFF; h = 0;
+	res = dir_sdi(&dj, 0);
+	while (res == FR_OK) {
+		res = move_window(fs, dj.sect);
+		if (res != FR_OK) break;
+		c = dj.dir[DIR_Name];
+		if ((c == 0 || c == DDEM) && fs->xfre == 0xFFFFFFFF) fs->xfre = dj.dptr;	/* The first free entry */
+		if (c == 0) break;			/* Reached to end of the table */
+		a = dj.dir[DIR_Attr] & AM_MASK;
+		if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {	/* An entry without valid data */
+			ord = 0xFF; blk = 0xFFFFFFFF;
+		} else if (a == AM_LFN) {	/* An LFN entry (tracked as dir_scan() does) */
+			if (c & LLEF) {
+				sum = dj.dir[LDIR_Chksum];
+				c &= (BYTE)~LLEF; ord = c;
+				blk = dj.dptr; h = 0;
+			}
+			if (c == ord && sum == dj.dir[LDIR_Chksum]) {
+				h = dix_lfn_part(h, dj.dir); ord--;
+			} else {
+				ord = 0xFF;
+			}
+		} else {					/* An SFN entry */
+			dix_add(fs, dj.dir, h, !ord && sum == sum_sfn(dj.dir), (blk != 0xFFFFFFFF) ? blk : dj.dptr);
+			ord = 0xFF; blk = 0xFFFFFFFF;
+		}
+		res = dir_next(&dj, 0);
+	}
+	if (fs->xfre == 0xFFFFFFFF) fs->xfre = dj.dptr;	/* No free entry in the table */
+	if (res == FR_NO_FILE) res = FR_OK;	/* Reached to end of the table */
+	if (res == FR_OK) fs->xdir = dir_key(dp);
+	return res;
+}
+
+
+static
+FRESULT dix_find (	/* FR_OK(0):succeeded, FR_NO_FILE:not found, !=0:error */
+	DIR* dp			/* Pointer to the directory object with the file name */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	DWORD h, sect, ncov;
+	BYTE c, a;
+
+
+	h = (dp->fn[NSFLAG] & NS_NOLFN) ? dix_sfn(dp->fn) : dix_lfn(fs->lfnbuf);
+	ncov = _DIRINDEX_SIZE / fs->xwid;	/* Number of sectors the filters can cover */
+	for (sect = 0; sect < fs->xsct && sect < ncov; sect++) {
+		if (!dix_test(fs, h, sect)) continue;	/* The name is not in this sector */
+		res = dir_sdi(dp, sect * SS(fs));
+		while (res == FR_OK && dp->dptr < (sect + 1) * SS(fs)) {	/* Check the entry blocks starting in the sector */
+			res = move_window(fs, dp->sect);
+			if (res != FR_OK) return res;
+			c = dp->dir[DIR_Name];
+			if (c == 0) break;			/* Reached to end of the table */
+			a = dp->dir[DIR_Attr] & AM_MASK;
+			if (c != DDEM && (a == AM_LFN ? (c & LLEF) != 0 : !(a & AM_VOL))) {	/* Top of an entry block */
+				res = dir_scan(dp, 1);
+				if (res != FR_NO_FILE) return res;	/* Found or error */
+			}
+			res = dir_next(dp, 0);
+		}
+		if (res != FR_OK && res != FR_NO_FILE) return res;
+	}
+	if (fs->xsct > ncov) {	/* The sectors beyond the filters are searched without index */
+		res = dir_sdi(dp, ncov * SS(fs));
+		if (res == FR_OK) res = dir_scan(dp, 0);
+		if (res != FR_NO_FILE) return res;
+	}
+	if (!(dp->fn[NSFLAG] & NS_LOSS) && dix_numbered(dp->fn)) {	/* A numbered SFN of an object with LFN is not indexed */
+		res = dir_sdi(dp, 0);
+		if (res == FR_OK) res = dir_scan(dp, 0);
+		return res;
+	}
+	return FR_NO_FILE;
+}
+
+#endif	/* _USE_DIRINDEX && _USE_LFN != 0 */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Find an object in the directory                  */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
+	DIR* dp			/* Pointer to the directory object with the file name */
+)
+{
+	FRESULT res;
+#if _FS_EXFAT || (_USE_DIRINDEX && _USE_LFN != 0)
+	FATFS *fs = dp->obj.fs;
+#endif
+
+	res = dir_sdi(dp, 0);			/* Rewind directory object */
+	if (res != FR_OK) return res;
+#if _FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
+		BYTE nc;
+		UINT di, ni;
+		WORD hash = xname_sum(fs->lfnbuf);		/* Hash value of the name to find */
+
+		while ((res = dir_read(dp, 0)) == FR_OK) {	/* Read an item */
+#if _MAX_LFN < 255
+			if (fs->dirbuf[XDIR_NumName] > _MAX_LFN) continue;			/* Skip comparison if inaccessible object name */
+#endif
+			if (ld_word(fs->dirbuf + XDIR_NameHash) != hash) continue;	/* Skip comparison if hash mismatched */
+			for (nc = fs->dirbuf[XDIR_NumName], di = SZDIRE * 2, ni = 0; nc; nc--, di += 2, ni++) {	/* Compare the name */
+				if ((di % SZDIRE) == 0) di += 2;
+				if (ff_wtoupper(ld_word(fs->dirbuf + di)) != ff_wtoupper(fs->lfnbuf[ni])) break;
+			}
+			if (nc == 0 && !fs->lfnbuf[ni]) break;	/* Name matched? */
+		}
+		return res;
+	}
+#endif
+	/* On the FAT12/16/32 volume */
+#if _USE_DIRINDEX && _USE_LFN != 0
+	if (fs->xdir == dir_key(dp)) return dix_find(dp);	/* Look the name up in the index of the directory */
+#endif
+	res = dir_scan(dp, 0);
+#if _USE_DIRINDEX && _USE_LFN != 0
+	if ((res == FR_OK || res == FR_NO_FILE) && dp->dptr / SZDIRE >= _DIRINDEX_MIN && fs->xdir != dir_key(dp)) {	/* Index a large directory for the next search */
+		if (dix_build(dp) != FR_OK || (res == FR_OK && move_window(fs, dp->sect) != FR_OK)) res = FR_DISK_ERR;
+	}
+#endif
+
+	return res;
+}
+
+
+
+
+#if _USE_DENTCACHE
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Cache of the objects found on a path             */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD dc_hash (		/* Returns the hash of the segment name */
+	DIR* dp			/* Pointer to the directory object with the segment name */
+)
+{
+	UINT i;
+	DWORD h = NHASH_INIT;
+
+
+#if _USE_LFN != 0
+	if (!(dp->fn[NSFLAG] & NS_NOLFN)) {	/* The name is compared as LFN */
+		for (i = 0; dp->obj.fs->lfnbuf[i]; i++) h = name_hash(h, ff_wtoupper(dp->obj.fs->lfnbuf[i]));
+		return h;
+	}
+#endif
+	for (i = 0; i < 11; i++) h = name_hash(h, dp->fn[i]);
+	return h;
+}
+
+
+static
+void dc_front (
+	DWORD* dc,		/* Path cache */
+	UINT i			/* Entry to be moved to the front (most recently used) */
+)
+{
+	DWORD d = dc[i * 3], h = dc[i * 3 + 1], ofs = dc[i * 3 + 2];
+
+
+	for (i *= 3; i; i--) dc[i + 2] = dc[i - 1];
+	dc[0] = d; dc[1] = h; dc[2] = ofs;
+}
+
+
+static
+FRESULT dc_find (	/* FR_OK(0):found, FR_NO_FILE:not in the cache, !=0:error */
+	DIR* dp,		/* Pointer to the directory object with the segment name */
+	DWORD h			/* Hash of the segment name */
+)
+{
+	FRESULT res;
+	DWORD *dc = dp->obj.fs->dcache, key;
+	UINT i;
+
+
+	if (_FS_EXFAT && dp->obj.fs->fs_type == FS_EXFAT) return FR_NO_FILE;
+	key = dir_key(dp);
+	for (i = 0; i < _DENTCACHE_SIZE && (dc[i * 3] != key || dc[i * 3 + 1] != h); i++) ;
+	if (i == _DENTCACHE_SIZE) return FR_NO_FILE;
+	res = dir_sdi(dp, dc[i * 3 + 2]);
+	if (res == FR_OK) res = dir_scan(dp, 1);	/* Check the name at the entry block */
+	if (res == FR_OK) dc_front(dc, i);
+	if (res == FR_NO_FILE) dc[i * 3] = 0xFFFFFFFF;	/* The entry is obsolete */
+	return res;
+}
+
+
+static
+void dc_put (
+	DIR* dp,		/* Directory object pointing the object found */
+	DWORD h			/* Hash of the segment name */
+)
+{
+	DWORD *dc = dp->obj.fs->dcache, key;
+	UINT i;
+
+
+	if (_FS_EXFAT && dp->obj.fs->fs_type == FS_EXFAT) return;
+	key = dir_key(dp);
+	for (i = 0; i < _DENTCACHE_SIZE - 1 && dc[i * 3] != 0xFFFFFFFF && (dc[i * 3] != key || dc[i * 3 + 1] != h); i++) ;	/* Same name, an unused entry or else the least recently used one */
+	dc[i * 3] = key;
+	dc[i * 3 + 1] = h;
+#if _USE_LFN != 0
+	dc[i * 3 + 2] = (dp->blk_ofs == 0xFFFFFFFF) ? dp->dptr : dp->blk_ofs;
+#else
+	dc[i * 3 + 2] = dp->dptr;
 #endif
-		res = dir_next(dp, 0);	/* Next entry */
-	} while (res == FR_OK);
+	dc_front(dc, i);
+}
 
-	return res;
+
+#if !_FS_READONLY && _FS_MINIMIZE == 0
+static
+void dc_drop (
+	FATFS* fs,		/* File system object */
+	DWORD key,		/* Directory of the objects */
+	DWORD st,		/* Offset of the first entry to drop */
+	DWORD ed		/* Offset of the last entry to drop */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < _DENTCACHE_SIZE; i++) {
+		if (fs->dcache[i * 3] == key && fs->dcache[i * 3 + 2] >= st && fs->dcache[i * 3 + 2] <= ed) fs->dcache[i * 3] = 0xFFFFFFFF;
+	}
 }
+#endif
+
+#endif	/* _USE_DENTCACHE */
 
 
 
@@ -2335,6 +3881,17 @@ FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many S
 	mem_cpy(sn, dp->fn, 12);
 	if (sn[NSFLAG] & NS_LOSS) {			/* When LFN is out of 8.3 format, generate a numbered name */
 		dp->fn[NSFLAG] = NS_NOLFN;		/* Find only SFN */
+#if _USE_ALIASMAP
+		if (fs->adir != dir_key(dp)) {	/* Build the short name set of the directory if needed */
+			res = amap_build(dp);
+			if (res != FR_OK) return res;
+		}
+		for (n = 1; n < 100; n++) {
+			gen_numname(dp->fn, sn, fs->lfnbuf, n);	/* Generate a numbered name */
+			if (!amap_test(fs, dp->fn)) break;	/* Not in the set, it does not collide */
+		}
+		if (n == 100) {					/* Search the directory if the set could not tell */
+#endif
 		for (n = 1; n < 100; n++) {
 			gen_numname(dp->fn, sn, fs->lfnbuf, n);	/* Generate a numbered name */
 			res = dir_find(dp);				/* Check if the name collides with existing SFN */
@@ -2342,6 +3899,9 @@ FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many S
 		}
 		if (n == 100) return FR_DENIED;		/* Abort if too many collisions */
 		if (res != FR_NO_FILE) return res;	/* Abort if the result is other than 'not collided' */
+#if _USE_ALIASMAP
+		}
+#endif
 		dp->fn[NSFLAG] = sn[NSFLAG];
 	}
 
@@ -2375,6 +3935,16 @@ FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many S
 			mem_cpy(dp->dir + DIR_Name, dp->fn, 11);	/* Put SFN */
 #if _USE_LFN != 0
 			dp->dir[DIR_NTres] = dp->fn[NSFLAG] & (NS_BODY | NS_EXT);	/* Put NT flag */
+#if _USE_ALIASMAP
+			if (fs->adir == dir_key(dp)) amap_add(fs, dp->fn);	/* Keep the short name set up to date */
+#endif
+#if _USE_DIRINDEX
+			if (fs->xdir == dir_key(dp)) {	/* Keep the directory index up to date */
+				nent = (dp->fn[NSFLAG] & NS_LFN) ? (nlen + 12) / 13 : 0;	/* Number of LFN entries */
+				dix_add(fs, dp->fn, nent ? dix_lfn(fs->lfnbuf) : 0, nent != 0, dp->dptr - nent * SZDIRE);
+				if (fs->xfre == dp->dptr - nent * SZDIRE) fs->xfre = dp->dptr + SZDIRE;	/* The first free entry has been taken */
+			}
+#endif
 #endif
 			fs->wflag = 1;
 		}
@@ -2402,6 +3972,14 @@ FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 #if _USE_LFN != 0	/* LFN configuration */
 	DWORD last = dp->dptr;
 
+#if _USE_DIRINDEX
+	if (fs->xdir == dir_key(dp) && ((dp->blk_ofs == 0xFFFFFFFF) ? last : dp->blk_ofs) < fs->xfre) {	/* The name stays in the filter, the entries become free */
+		fs->xfre = (dp->blk_ofs == 0xFFFFFFFF) ? last : dp->blk_ofs;
+	}
+#endif
+#if _USE_DENTCACHE
+	dc_drop(fs, dir_key(dp), (dp->blk_ofs == 0xFFFFFFFF) ? last : dp->blk_ofs, last);	/* The object is no longer found there */
+#endif
 	res = (dp->blk_ofs == 0xFFFFFFFF) ? FR_OK : dir_sdi(dp, dp->blk_ofs);	/* Goto top of the entry block if LFN is exist */
 	if (res == FR_OK) {
 		do {
@@ -2421,6 +3999,9 @@ FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 	}
 #else			/* Non LFN configuration */
 
+#if _USE_DENTCACHE
+	dc_drop(fs, dir_key(dp), dp->dptr, dp->dptr);	/* The object is no longer found there */
+#endif
 	res = move_window(fs, dp->sect);
 	if (res == FR_OK) {
 		dp->dir[DIR_Name] = DDEM;
@@ -2447,11 +4028,14 @@ void get_fileinfo (		/* No return code */
 )
 {
 	UINT i, j;
-	TCHAR c;
 	DWORD tm;
 #if _USE_LFN != 0
-	WCHAR w, lfv;
+	UINT k;
+	WCHAR w, lfv, sfn[13];
+	TCHAR *p;
 	FATFS *fs = dp->obj.fs;
+#else
+	TCHAR c;
 #endif
 
 
@@ -2483,37 +4067,22 @@ void get_fileinfo (		/* No return code */
 		}
 	}
 
-	i = j = 0;
-	lfv = fno->fname[i];	/* LFN is exist if non-zero */
-	while (i < 11) {		/* Copy name body and extension */
-		c = (TCHAR)dp->dir[i++];
-		if (c == ' ') continue;				/* Skip padding spaces */
-		if (c == RDDEM) c = (TCHAR)DDEM;	/* Restore replaced DDEM character */
-		if (i == 9) {						/* Insert a . if extension is exist */
-			if (!lfv) fno->fname[j] = '.';
-			fno->altname[j++] = '.';
-		}
+	lfv = fno->fname[0];	/* LFN is exist if non-zero */
+	for (k = lfv ? 1 : 0; k < 2; k++) {	/* Put the SFN into fname[] if no LFN (k = 0) and into altname[] (k = 1) */
+		get_sfn(sfn, dp->dir, k == 0);	/* The case info applies to fname[] */
+		p = k ? fno->altname : fno->fname;
+		for (i = j = 0; (w = sfn[i]) != 0; i++) {
 #if _LFN_UNICODE
-		if (IsDBCS1(c) && i != 8 && i != 11 && IsDBCS2(dp->dir[i])) {
-			c = c << 8 | dp->dir[i++];
-		}
-		c = ff_convert(c, 1);	/* OEM -> Unicode */
-		if (!c) c = '?';
+			w = ff_convert(w, 1);	/* OEM -> Unicode */
+			if (!w) w = '?';
+#else
+			if (w >= 0x100) p[j++] = (TCHAR)(w >> 8);	/* Put 1st byte if it is a DBC */
 #endif
-		fno->altname[j] = c;
-		if (!lfv) {
-			if (IsUpper(c) && (dp->dir[DIR_NTres] & ((i >= 9) ? NS_EXT : NS_BODY))) {
-				c += 0x20;			/* To lower */
-			}
-			fno->fname[j] = c;
+			p[j++] = (TCHAR)w;
 		}
-		j++;
+		p[j] = 0;	/* Terminate the SFN */
 	}
-	if (!lfv) {
-		fno->fname[j] = 0;
-		if (!dp->dir[DIR_NTres]) j = 0;	/* Altname is no longer needed if neither LFN nor case info is exist. */
-	}
-	fno->altname[j] = 0;	/* Terminate the SFN */
+	if (!lfv && !(dp->dir[DIR_NTres] & (NS_BODY | NS_EXT))) fno->altname[0] = 0;	/* Altname is no longer needed if neither LFN nor case info is exist. */
 
 #else	/* Non-LFN configuration */
 	i = j = 0;
@@ -2537,6 +4106,148 @@ void get_fileinfo (		/* No return code */
 
 
 
+#if _USE_READDIRN && _FS_MINIMIZE <= 1
+/*-----------------------------------------------------------------------*/
+/* Get compact file information from directory entry                     */
+/*-----------------------------------------------------------------------*/
+
+#if _USE_LFN != 0
+static
+void get_sfn_name (	/* Put the SFN in the form it reads into the LFN working buffer */
+	DIR* dp			/* Pointer to the directory object */
+)
+{
+	UINT i;
+	WCHAR wc, *lfn = dp->obj.fs->lfnbuf;
+
+
+	get_sfn(lfn, dp->dir, 1);
+	for (i = 0; lfn[i]; i++) {
+		wc = ff_convert(lfn[i], 1);	/* OEM -> Unicode */
+		lfn[i] = wc ? wc : '?';
+	}
+}
+#endif
+
+
+static
+int get_fileent (	/* 1:Got, 0:No room in the name buffer */
+	DIR* dp,		/* Pointer to the directory object at the item read */
+	FILEENT* ent,	/* Pointer to the compact file information to be filled */
+	TCHAR** nbuf,	/* Pointer to the free part of the name buffer (null:names are not read) */
+	UINT* nsz		/* Pointer to the size of the free part */
+)
+{
+	UINT i, j;
+	DWORD tm, h = NHASH_INIT;
+#if _USE_LFN != 0
+	WCHAR w;
+	FATFS *fs = dp->obj.fs;
+	int lfn;
+
+
+#if _FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
+		for (i = SZDIRE * 2, j = 0; j < fs->dirbuf[XDIR_NumName]; i += 2, j++) {	/* Get the name from the entry block */
+			if ((i % SZDIRE) == 0) i += 2;
+			fs->lfnbuf[j] = ld_word(fs->dirbuf + i);
+		}
+		fs->lfnbuf[j] = 0;
+		lfn = 1;
+	} else
+#endif
+	{	/* On the FAT12/16/32 volume */
+		lfn = (dp->blk_ofs != 0xFFFFFFFF);
+		if (!lfn) get_sfn_name(dp);	/* The SFN is the primary name */
+	}
+	for (i = 0; (w = fs->lfnbuf[i]) != 0; i++) {	/* Hash the up-cased name */
+		h = name_hash(h, (w < 0x80) ? (IsLower(w) ? w - 0x20 : w) : ff_wtoupper(w));
+	}
+	ent->nhash = h;
+
+	ent->fname = 0;
+	if (nbuf) {	/* Put the name into the name buffer */
+		for (;;) {
+			i = j = 0;
+			while ((w = fs->lfnbuf[j++]) != 0) {
+#if !_LFN_UNICODE
+				w = ff_convert(w, 0);		/* Unicode -> OEM */
+				if (w == 0) break;			/* Not in the code page */
+				if (_DF1S && w >= 0x100) {	/* Put 1st byte if it is a DBC (always false at SBCS cfg) */
+					if (i >= *nsz) return 0;
+					(*nbuf)[i++] = (char)(w >> 8);
+				}
+#endif
+				if (i >= *nsz) return 0;
+				(*nbuf)[i++] = (TCHAR)w;
+			}
+			if (w == 0 && fs->lfnbuf[j - 1] == 0) break;	/* The name is converted */
+			if (!lfn || (_FS_EXFAT && fs->fs_type == FS_EXFAT)) {	/* No SFN to fall back on */
+				if (*nsz < 1) return 0;
+				i = 0; (*nbuf)[i++] = '?';
+				break;
+			}
+			get_sfn_name(dp);	/* Give the SFN as f_readdir() does */
+			lfn = 0;
+		}
+		if (i >= *nsz) return 0;
+		(*nbuf)[i++] = 0;
+		ent->fname = *nbuf;
+		*nbuf += i; *nsz -= i;
+	}
+#if _FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {
+		ent->fattrib = fs->dirbuf[XDIR_Attr];
+		ent->fsize = ld_qword(fs->dirbuf + XDIR_FileSize);
+		ent->sclust = ld_dword(fs->dirbuf + XDIR_FstClus);
+		tm = ld_dword(fs->dirbuf + XDIR_ModTime);
+		ent->ftime = (WORD)tm; ent->fdate = (WORD)(tm >> 16);
+		return 1;
+	}
+#endif
+
+#else	/* Non-LFN configuration */
+	TCHAR c;
+
+
+	ent->fname = 0;
+	if (nbuf) {
+		if (*nsz < 13) return 0;
+		ent->fname = *nbuf;
+	}
+	i = j = 0;
+	while (i < 11) {		/* Hash and copy name body and extension */
+		c = (TCHAR)dp->dir[i++];
+		if (c == ' ') continue;				/* Skip padding spaces */
+		if (c == RDDEM) c = (TCHAR)DDEM;	/* Restore replaced DDEM character */
+		if (i == 9) {						/* Insert a . if extension is exist */
+			h = name_hash(h, '.');
+			if (nbuf) (*nbuf)[j] = '.';
+			j++;
+		}
+		h = name_hash(h, (BYTE)c);
+		if (nbuf) (*nbuf)[j] = c;
+		j++;
+	}
+	ent->nhash = h;
+	if (nbuf) {
+		(*nbuf)[j++] = 0;
+		*nbuf += j; *nsz -= j;
+	}
+#endif
+
+	ent->fattrib = dp->dir[DIR_Attr];				/* Attribute */
+	ent->fsize = ld_dword(dp->dir + DIR_FileSize);	/* Size */
+	ent->sclust = ld_clust(dp->obj.fs, dp->dir);	/* Start cluster */
+	tm = ld_dword(dp->dir + DIR_ModTime);			/* Timestamp */
+	ent->ftime = (WORD)tm; ent->fdate = (WORD)(tm >> 16);
+	return 1;
+}
+
+#endif /* _USE_READDIRN && _FS_MINIMIZE <= 1 */
+
+
+
 #if _USE_FIND && _FS_MINIMIZE <= 1
 /*-----------------------------------------------------------------------*/
 /* Pattern matching                                                      */
@@ -2819,6 +4530,9 @@ FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 	BYTE ns;
 	_FDID *obj = &dp->obj;
 	FATFS *fs = obj->fs;
+#if _USE_DENTCACHE
+	DWORD h;
+#endif
 
 
 #if _FS_RPATH != 0
@@ -2855,7 +4569,16 @@ FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 		for (;;) {
 			res = create_name(dp, &path);	/* Get a segment name of the path */
 			if (res != FR_OK) break;
+#if _USE_DENTCACHE
+			h = dc_hash(dp);
+			res = dc_find(dp, h);			/* Look the segment up in the path cache */
+			if (res == FR_NO_FILE) {
+				res = dir_find(dp);			/* Find an object with the segment name */
+				if (res == FR_OK) dc_put(dp, h);
+			}
+#else
 			res = dir_find(dp);				/* Find an object with the segment name */
+#endif
 			ns = dp->fn[NSFLAG];
 			if (res != FR_OK) {				/* Failed to find the object */
 				if (res == FR_NO_FILE) {	/* Object is not found */
@@ -2967,7 +4690,11 @@ BYTE check_fs (	/* 0:FAT, 1:exFAT, 2:Valid BS but not FAT, 3:Not a BS, 4:Disk er
 	DWORD sect	/* Sector# (lba) to load and check if it is an FAT-VBR or not */
 )
 {
+#if _USE_WINCACHE
+	wc_reset(fs);									/* Empty window cache */
+#else
 	fs->wflag = 0; fs->winsect = 0xFFFFFFFF;		/* Invaidate window */
+#endif
 	if (move_window(fs, sect) != FR_OK) return 4;	/* Load boot record */
 
 	if (ld_word(fs->win + BS_55AA) != 0xAA55) return 3;	/* Check boot record signature (always placed here even if the sector size is >512) */
@@ -3032,6 +4759,31 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 	/* Following code attempts to mount the volume. (analyze BPB and initialize the fs object) */
 
 	fs->fs_type = 0;					/* Clear the file system object */
+#if _USE_FREEMAP && !_FS_READONLY
+	fs->fmap = 0;						/* No free cluster bitmap until it is built */
+#endif
+#if _USE_ALIASMAP && _USE_LFN != 0 && !_FS_READONLY
+	fs->amap = AliasMap[vol];			/* Short name set is built on demand */
+	fs->adir = 0xFFFFFFFF;
+#endif
+#if _USE_DIRINDEX && _USE_LFN != 0
+	fs->xtbl = DirIndex[vol];			/* Directory index is built on demand */
+	fs->xdir = 0xFFFFFFFF;
+#endif
+#if _USE_DENTCACHE
+	fs->dcache = DentCache[vol];		/* Path cache starts empty */
+	mem_set(fs->dcache, 0xFF, sizeof DentCache[0]);
+#endif
+#if _FS_LAZYMIRROR && !_FS_READONLY
+	fs->mrcnt = 0;						/* No FAT sector to be mirrored */
+#endif
+#if _USE_FILEBUF
+	fs->fbpool = FileBuf[vol];			/* All file buffers are free */
+	fs->fbuse = 0;
+#if _FILEBUF_SHARE
+	fs->fbclk = 0;
+#endif
+#endif
 	fs->drv = LD2PD(vol);				/* Bind the logical drive and a physical drive */
 	stat = disk_initialize(fs->drv);	/* Initialize the physical drive */
 	if (stat & STA_NOINIT) { 			/* Check if the initialization succeeded */
@@ -3185,11 +4937,20 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 			}
 		}
 #endif	/* (_FS_NOFSINFO & 3) != 3 */
+#if _USE_FREEMAP
+		if (fmt != FS_FAT12 && fs->n_fatent <= _FREEMAP_CLST) {	/* Build free cluster bitmap if it fits */
+			if (fmap_build(fs, fmt, FreeMap[vol]) != FR_OK) return FR_DISK_ERR;
+			fs->fmap = FreeMap[vol];
+		}
+#endif
 #endif	/* !_FS_READONLY */
 	}
 
 	fs->fs_type = fmt;		/* FAT sub-type */
 	fs->id = ++Fsid;		/* File system mount ID */
+#if _USE_LINKMAP
+	lmap_init(fs);			/* Initialize link map fragment pool */
+#endif
 #if _USE_LFN == 1
 	fs->lfnbuf = LfnBuf;	/* Static LFN working buffer */
 #if _FS_EXFAT
@@ -3245,6 +5006,184 @@ FRESULT validate (	/* Returns FR_OK or FR_INVALID_OBJECT */
 
 
 
+#if !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* File access - Flush cached data and update the directory entry        */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT sync_file (	/* FR_OK(0):succeeded, !=0:error */
+	FIL* fp			/* Pointer to the file object */
+)
+{
+	FRESULT res = FR_OK;
+	FATFS *fs = fp->obj.fs;
+	DWORD tm;
+	BYTE *dir;
+#if _FS_EXFAT
+	DIR dj;
+	DEF_NAMBUF
+#endif
+
+	if (fp->flag & FA_MODIFIED) {	/* Is there any change to the file? */
+#if !_FS_TINY
+		if (fb_flush(fp) != FR_OK) return FR_DISK_ERR;	/* Write-back cached data if needed */
+#endif
+		/* Update the directory entry */
+		tm = GET_FATTIME();				/* Modified time */
+#if _FS_EXFAT
+		if (fs->fs_type == FS_EXFAT) {
+			res = fill_first_frag(&fp->obj);	/* Fill first fragment on the FAT if needed */
+			if (res == FR_OK) {
+				res = fill_last_frag(&fp->obj, fp->clust, 0xFFFFFFFF);	/* Fill last fragment on the FAT if needed */
+			}
+			if (res == FR_OK) {
+				INIT_NAMBUF(fs);
+				res = load_obj_dir(&dj, &fp->obj);	/* Load directory entry block */
+				if (res == FR_OK) {
+					fs->dirbuf[XDIR_Attr] |= AM_ARC;				/* Set archive bit */
+					fs->dirbuf[XDIR_GenFlags] = fp->obj.stat | 1;	/* Update file allocation info */
+					st_dword(fs->dirbuf + XDIR_FstClus, fp->obj.sclust);
+					st_qword(fs->dirbuf + XDIR_FileSize, fp->obj.objsize);
+					st_qword(fs->dirbuf + XDIR_ValidFileSize, fp->obj.objsize);
+					st_dword(fs->dirbuf + XDIR_ModTime, tm);		/* Update modified time */
+					fs->dirbuf[XDIR_ModTime10] = 0;
+					st_dword(fs->dirbuf + XDIR_AccTime, 0);
+					res = store_xdir(&dj);	/* Restore it to the directory */
+					if (res == FR_OK) {
+						res = sync_fs(fs);
+						fp->flag &= (BYTE)~FA_MODIFIED;
+					}
+				}
+				FREE_NAMBUF();
+			}
+		} else
+#endif
+		{
+			res = move_window(fs, fp->dir_sect);
+			if (res == FR_OK) {
+				dir = fp->dir_ptr;
+				dir[DIR_Attr] |= AM_ARC;						/* Set archive bit */
+				st_clust(fp->obj.fs, dir, fp->obj.sclust);		/* Update file allocation info  */
+				st_dword(dir + DIR_FileSize, (DWORD)fp->obj.objsize);	/* Update file size */
+				st_dword(dir + DIR_ModTime, tm);				/* Update modified time */
+				st_word(dir + DIR_LstAccDate, 0);
+#if _FS_LAZYSYNC
+				dir[DIR_NTres] = (dir[DIR_NTres] & ~NT_LAZY) | fp->lzmark;	/* Set or clear lazy sync mark */
+				fp->lzsize = fp->obj.objsize;
+				fp->lztick = _LAZYSYNC_TICK();
+#endif
+				fs->wflag = 1;
+				res = sync_fs(fs);					/* Restore it to the directory */
+				fp->flag &= (BYTE)~FA_MODIFIED;
+			}
+		}
+	}
+
+	return res;
+}
+
+
+#if _FS_LAZYSYNC
+/*-----------------------------------------------------------------------*/
+/* File access - Flush data and FAT only (lazy sync)                     */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT sync_data (	/* FR_OK(0):succeeded, !=0:error */
+	FIL* fp			/* Pointer to the file object */
+)
+{
+	FATFS *fs = fp->obj.fs;
+
+
+#if !_FS_TINY
+	if (fb_flush(fp) != FR_OK) return FR_DISK_ERR;	/* Write-back cached data if needed */
+#endif
+	if (sync_window(fs) != FR_OK) return FR_DISK_ERR;	/* Write the FAT sectors of the appended clusters */
+	if (disk_ioctl(fs->drv, CTRL_SYNC, 0) != RES_OK) return FR_DISK_ERR;
+	return FR_OK;			/* The directory entry stays modified */
+}
+
+
+static
+FRESULT recover_size (	/* FR_OK(0):succeeded, !=0:error */
+	FIL* fp			/* Pointer to the file object opened for write with marked directory entry */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	DWORD clst, nxt, ncl, bcs;
+	FRESULT res = FR_OK;
+
+
+	fs->free_clst = 0xFFFFFFFF;		/* FSINFO has missed the clusters appended since the last update */
+	fs->fsi_flag |= 1;
+	bcs = (DWORD)fs->csize * SS(fs);	/* Cluster size */
+	ncl = (DWORD)((fp->obj.objsize + bcs - 1) / bcs);	/* Clusters holding the recorded size */
+	clst = fp->obj.sclust;
+	if (ncl == 0) {		/* Release the whole chain */
+		if (clst) res = remove_chain(&fp->obj, clst, 0);
+		fp->obj.sclust = 0;
+	} else {			/* Release the clusters appended after the last directory update */
+		while (res == FR_OK && --ncl) {
+			clst = get_fat(&fp->obj, clst);
+			if (clst == 0xFFFFFFFF) res = FR_DISK_ERR;
+			if (clst < 2 || clst >= fs->n_fatent) res = FR_INT_ERR;
+		}
+		if (res == FR_OK) {
+			nxt = get_fat(&fp->obj, clst);
+			if (nxt == 0xFFFFFFFF) res = FR_DISK_ERR;
+			if (nxt == 1) res = FR_INT_ERR;
+			if (res == FR_OK && nxt >= 2 && nxt < fs->n_fatent) res = remove_chain(&fp->obj, nxt, clst);
+		}
+	}
+	if (res == FR_OK) res = move_window(fs, fp->dir_sect);	/* Clear the mark */
+	if (res == FR_OK) {
+		st_clust(fs, fp->dir_ptr, fp->obj.sclust);
+		fp->dir_ptr[DIR_NTres] &= ~NT_LAZY;
+		fs->wflag = 1;
+	}
+	return res;
+}
+
+#endif	/* _FS_LAZYSYNC */
+
+
+#if _USE_EXPAND
+/*-----------------------------------------------------------------------*/
+/* File access - Release the part of the stream block not written        */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT end_stream (	/* FR_OK(0):succeeded, !=0:error */
+	FIL* fp				/* Pointer to the file object in stream mode */
+)
+{
+	FRESULT res = FR_OK;
+	DWORD bcs, ncl;
+
+
+	bcs = (DWORD)fp->obj.fs->csize * SS(fp->obj.fs);	/* Cluster size */
+	ncl = (DWORD)((fp->obj.objsize + bcs - 1) / bcs);	/* Number of clusters in use */
+	if (ncl < fp->xncl) {	/* Is a part of the block left? (it is contiguous from the top of the file) */
+		if (ncl == 0) {		/* Nothing written, remove the entire chain */
+			res = remove_chain(&fp->obj, fp->obj.sclust, 0);
+			fp->obj.sclust = 0;
+		} else {			/* Remove the clusters following the last one in use */
+			res = remove_chain(&fp->obj, fp->obj.sclust + ncl, fp->obj.sclust + ncl - 1);
+		}
+		fp->flag |= FA_MODIFIED;
+	}
+	fp->xncl = 0;			/* Leave stream mode */
+	return res;
+}
+
+#endif	/* _USE_EXPAND */
+#endif	/* !_FS_READONLY */
+
+
+
+
 /*---------------------------------------------------------------------------
 
    Public Functions (FatFs API)
@@ -3275,6 +5214,11 @@ FRESULT f_mount (
 	cfs = FatFs[vol];					/* Pointer to fs object */
 
 	if (cfs) {
+#if _FS_LAZYMIRROR && !_FS_READONLY
+		if (cfs->fs_type && cfs->mrcnt && mirror_sync(cfs) == FR_OK) {	/* Bring the FAT copies of the old volume up to date */
+			disk_ioctl(cfs->drv, CTRL_SYNC, 0);
+		}
+#endif
 #if _FS_LOCK != 0
 		clear_lock(cfs);
 #endif
@@ -3458,6 +5402,22 @@ FRESULT f_open (
 			}
 #if _USE_FASTSEEK
 			fp->cltbl = 0;			/* Disable fast seek mode */
+#endif
+#if _USE_LINKMAP
+			fp->lmtop = fp->lmlast = 0;	/* Empty link map */
+			fp->lmncl = 0;
+#endif
+#if _USE_EXPAND
+			fp->xncl = 0;			/* Not a stream */
+#endif
+#if _USE_FILEBUF
+#if _FILEBUF_SHARE
+			fp->buf = fp->fbuf = 0;		/* No buffer from the pool until the first transfer */
+#else
+			fp->buf = fp->fbuf = fp->sbuf;	/* No buffer from the pool until the first transfer */
+#endif
+			fp->fbid = 0;
+			fp->fbcnt = 0;
 #endif
 			fp->obj.fs = fs;	 	/* Validate the file object */
 			fp->obj.id = fs->id;
@@ -3466,15 +5426,28 @@ FRESULT f_open (
 			fp->sect = 0;			/* Invalidate current data sector */
 			fp->fptr = 0;			/* Set file pointer top of the file */
 #if !_FS_READONLY
-#if !_FS_TINY
+#if _FS_LAZYSYNC
+			fp->lzmark = 0;
+			fp->lzsize = fp->obj.objsize;
+			fp->lztick = _LAZYSYNC_TICK();
+			if ((mode & FA_WRITE) && fs->fs_type != FS_EXFAT && (fp->dir_ptr[DIR_NTres] & NT_LAZY)) {	/* Was it left open with lazy sync? */
+				res = recover_size(fp);		/* Keep the size of the last directory update */
+				fp->flag |= FA_MODIFIED;	/* Write the changes at f_close() */
+			}
+#endif
+#if !_FS_TINY && !(_USE_FILEBUF && _FILEBUF_SHARE)
 			mem_set(fp->buf, 0, _MAX_SS);	/* Clear sector buffer */
 #endif
-			if ((mode & FA_SEEKEND) && fp->obj.objsize > 0) {	/* Seek to end of file if FA_OPEN_APPEND is specified */
+			if (res == FR_OK && (mode & FA_SEEKEND) && fp->obj.objsize > 0) {	/* Seek to end of file if FA_OPEN_APPEND is specified */
 				fp->fptr = fp->obj.objsize;			/* Offset to seek */
 				bcs = (DWORD)fs->csize * SS(fs);	/* Cluster size in byte */
 				clst = fp->obj.sclust;				/* Follow the cluster chain */
 				for (ofs = fp->obj.objsize; res == FR_OK && ofs > bcs; ofs -= bcs) {
+#if _USE_LINKMAP
+					clst = lmap_next(fp, (DWORD)((fp->obj.objsize - ofs) / bcs) + 1, clst, 0);
+#else
 					clst = get_fat(&fp->obj, clst);
+#endif
 					if (clst <= 1) res = FR_INT_ERR;
 					if (clst == 0xFFFFFFFF) res = FR_DISK_ERR;
 				}
@@ -3485,11 +5458,14 @@ FRESULT f_open (
 					} else {
 						fp->sect = sc + (DWORD)(ofs / SS(fs));
 #if !_FS_TINY
-						if (disk_read(fs->drv, fp->buf, fp->sect, 1) != RES_OK) res = FR_DISK_ERR;
+						if (fb_load(fp, fp->sect, 1) != FR_OK) res = FR_DISK_ERR;
 #endif
 					}
 				}
 			}
+#if _USE_FILEBUF
+			if (res != FR_OK) fb_free(fp);	/* Return the file buffer taken on the way */
+#endif
 #endif
 		}
 
@@ -3519,14 +5495,20 @@ FRESULT f_read (
 	FATFS *fs;
 	DWORD clst, sect;
 	FSIZE_t remain;
-	UINT rcnt, cc, csect;
+	UINT rcnt, cc, csect, ncs;
 	BYTE *rbuff = (BYTE*)buff;
+#if _USE_FILEBUF && !_FS_READONLY && _FS_MINIMIZE <= 2
+	UINT i;
+#endif
 
 
 	*br = 0;	/* Clear read byte counter */
 	res = validate(&fp->obj, &fs);				/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);	/* Check validity */
 	if (!(fp->flag & FA_READ)) LEAVE_FF(fs, FR_DENIED); /* Check access mode */
+#if _USE_FILEBUF && _FILEBUF_SHARE
+	if (fb_hold(fp) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Get the buffer back if another file took it */
+#endif
 	remain = fp->obj.objsize - fp->fptr;
 	if (btr > remain) btr = (UINT)remain;		/* Truncate btr by remaining bytes */
 
@@ -3538,14 +5520,7 @@ FRESULT f_read (
 				if (fp->fptr == 0) {			/* On the top of the file? */
 					clst = fp->obj.sclust;		/* Follow cluster chain from the origin */
 				} else {						/* Middle or end of the file */
-#if _USE_FASTSEEK
-					if (fp->cltbl) {
-						clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
-					} else
-#endif
-					{
-						clst = get_fat(&fp->obj, fp->clust);	/* Follow cluster chain on the FAT */
-					}
+					clst = next_clust(fp, fp->fptr, fp->clust, 0);	/* Follow cluster chain */
 				}
 				if (clst < 2) ABORT(fs, FR_INT_ERR);
 				if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
@@ -3556,8 +5531,14 @@ FRESULT f_read (
 			sect += csect;
 			cc = btr / SS(fs);					/* When remaining bytes >= sector size, */
 			if (cc) {							/* Read maximum contiguous sectors directly */
-				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
-					cc = fs->csize - csect;
+				for (ncs = fs->csize - csect; ncs < cc; ncs += fs->csize) {	/* Extend it over the following clusters while they are contiguous */
+					clst = next_clust(fp, fp->fptr + (FSIZE_t)ncs * SS(fs), fp->clust, 0);
+					if (clst == 1) ABORT(fs, FR_INT_ERR);
+					if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
+					if (clst != fp->clust + 1) {	/* Clip at the cluster boundary */
+						cc = ncs; break;
+					}
+					fp->clust = clst;
 				}
 				if (disk_read(fs->drv, rbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
 #if !_FS_READONLY && _FS_MINIMIZE <= 2			/* Replace one of the read sectors with cached data if it contains a dirty sector */
@@ -3565,6 +5546,10 @@ FRESULT f_read (
 				if (fs->wflag && fs->winsect - sect < cc) {
 					mem_cpy(rbuff + ((fs->winsect - sect) * SS(fs)), fs->win, SS(fs));
 				}
+#elif _USE_FILEBUF
+				for (i = fp->fbdlo; (fp->flag & FA_DIRTY) && i < fp->fbdhi; i++) {
+					if (fp->fbsect + i - sect < cc) mem_cpy(rbuff + ((fp->fbsect + i - sect) * SS(fs)), fp->fbuf + i * SS(fs), SS(fs));
+				}
 #else
 				if ((fp->flag & FA_DIRTY) && fp->sect - sect < cc) {
 					mem_cpy(rbuff + ((fp->sect - sect) * SS(fs)), fp->buf, SS(fs));
@@ -3576,13 +5561,7 @@ FRESULT f_read (
 			}
 #if !_FS_TINY
 			if (fp->sect != sect) {			/* Load data sector if not in cache */
-#if !_FS_READONLY
-				if (fp->flag & FA_DIRTY) {		/* Write-back dirty sector cache */
-					if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
-					fp->flag &= (BYTE)~FA_DIRTY;
-				}
-#endif
-				if (disk_read(fs->drv, fp->buf, sect, 1) != RES_OK)	ABORT(fs, FR_DISK_ERR);	/* Fill sector cache */
+				if (fb_load(fp, sect, 1) != FR_OK) ABORT(fs, FR_DISK_ERR);
 			}
 #endif
 			fp->sect = sect;
@@ -3618,19 +5597,31 @@ FRESULT f_write (
 	FRESULT res;
 	FATFS *fs;
 	DWORD clst, sect;
-	UINT wcnt, cc, csect;
+	UINT wcnt, cc, csect, ncs;
 	const BYTE *wbuff = (const BYTE*)buff;
+#if _USE_FILEBUF && _FS_MINIMIZE <= 2
+	UINT i;
+#endif
+#if _USE_EXPAND && _EXPAND_SYNC
+	FSIZE_t osz;
+#endif
 
 
 	*bw = 0;	/* Clear write byte counter */
 	res = validate(&fp->obj, &fs);			/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);	/* Check validity */
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
+#if _USE_FILEBUF && _FILEBUF_SHARE
+	if (fb_hold(fp) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Get the buffer back if another file took it */
+#endif
 
 	/* Check fptr wrap-around (file size cannot reach 4GiB on FATxx) */
 	if ((!_FS_EXFAT || fs->fs_type != FS_EXFAT) && (DWORD)(fp->fptr + btw) < (DWORD)fp->fptr) {
 		btw = (UINT)(0xFFFFFFFF - (DWORD)fp->fptr);
 	}
+#if _USE_EXPAND && _EXPAND_SYNC
+	osz = fp->obj.objsize;
+#endif
 
 	for ( ;  btw;							/* Repeat until all data written */
 		wbuff += wcnt, fp->fptr += wcnt, fp->obj.objsize = (fp->fptr > fp->obj.objsize) ? fp->fptr : fp->obj.objsize, *bw += wcnt, btw -= wcnt) {
@@ -3643,14 +5634,7 @@ FRESULT f_write (
 						clst = create_chain(&fp->obj, 0);	/* create a new cluster chain */
 					}
 				} else {					/* On the middle or end of the file */
-#if _USE_FASTSEEK
-					if (fp->cltbl) {
-						clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
-					} else
-#endif
-					{
-						clst = create_chain(&fp->obj, fp->clust);	/* Follow or stretch cluster chain on the FAT */
-					}
+					clst = next_clust(fp, fp->fptr, fp->clust, 1);	/* Follow or stretch cluster chain */
 				}
 				if (clst == 0) break;		/* Could not allocate a new cluster (disk full) */
 				if (clst == 1) ABORT(fs, FR_INT_ERR);
@@ -3660,7 +5644,7 @@ FRESULT f_write (
 			}
 #if _FS_TINY
 			if (fs->winsect == fp->sect && sync_window(fs) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Write-back sector cache */
-#else
+#elif !_USE_FILEBUF
 			if (fp->flag & FA_DIRTY) {		/* Write-back sector cache */
 				if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
 				fp->flag &= (BYTE)~FA_DIRTY;
@@ -3671,8 +5655,14 @@ FRESULT f_write (
 			sect += csect;
 			cc = btw / SS(fs);				/* When remaining bytes >= sector size, */
 			if (cc) {						/* Write maximum contiguous sectors directly */
-				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
-					cc = fs->csize - csect;
+				for (ncs = fs->csize - csect; ncs < cc; ncs += fs->csize) {	/* Extend it over the following clusters while they are contiguous */
+					clst = next_clust(fp, fp->fptr + (FSIZE_t)ncs * SS(fs), fp->clust, 1);
+					if (clst == 1) ABORT(fs, FR_INT_ERR);
+					if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
+					if (clst != fp->clust + 1) {	/* Clip at the cluster boundary (disk full or fragmented) */
+						cc = ncs; break;
+					}
+					fp->clust = clst;
 				}
 				if (disk_write(fs->drv, wbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
 #if _FS_MINIMIZE <= 2
@@ -3681,6 +5671,10 @@ FRESULT f_write (
 					mem_cpy(fs->win, wbuff + ((fs->winsect - sect) * SS(fs)), SS(fs));
 					fs->wflag = 0;
 				}
+#elif _USE_FILEBUF
+				for (i = 0; i < fp->fbcnt; i++) {	/* Update the buffered sectors overwritten by the direct write */
+					if (fp->fbsect + i - sect < cc) mem_cpy(fp->fbuf + i * SS(fs), wbuff + ((fp->fbsect + i - sect) * SS(fs)), SS(fs));
+				}
 #else
 				if (fp->sect - sect < cc) { /* Refill sector cache if it gets invalidated by the direct write */
 					mem_cpy(fp->buf, wbuff + ((fp->sect - sect) * SS(fs)), SS(fs));
@@ -3697,10 +5691,8 @@ FRESULT f_write (
 				fs->winsect = sect;
 			}
 #else
-			if (fp->sect != sect && 		/* Fill sector cache with file data */
-				fp->fptr < fp->obj.objsize &&
-				disk_read(fs->drv, fp->buf, sect, 1) != RES_OK) {
-					ABORT(fs, FR_DISK_ERR);
+			if (fp->sect != sect) {			/* Fill sector cache with file data */
+				if (fb_load(fp, sect, fp->fptr < fp->obj.objsize) != FR_OK) ABORT(fs, FR_DISK_ERR);
 			}
 #endif
 			fp->sect = sect;
@@ -3713,13 +5705,22 @@ FRESULT f_write (
 		fs->wflag = 1;
 #else
 		mem_cpy(fp->buf + fp->fptr % SS(fs), wbuff, wcnt);	/* Fit data to the sector */
+#if _USE_FILEBUF
+		fb_dirty(fp);
+#else
 		fp->flag |= FA_DIRTY;
+#endif
 #endif
 	}
 
 	fp->flag |= FA_MODIFIED;				/* Set file change flag */
+#if _USE_EXPAND && _EXPAND_SYNC
+	if (fp->xncl && osz / SS(fs) / _EXPAND_SYNC != fp->obj.objsize / SS(fs) / _EXPAND_SYNC) {	/* Has the stream passed a sync point? */
+		res = sync_file(fp);				/* Update the directory entry */
+	}
+#endif
 
-	LEAVE_FF(fs, FR_OK);
+	LEAVE_FF(fs, res);
 }
 
 
@@ -3735,66 +5736,28 @@ FRESULT f_sync (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD tm;
-	BYTE *dir;
-#if _FS_EXFAT
-	DIR dj;
-	DEF_NAMBUF
-#endif
+
 
 	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
 	if (res == FR_OK) {
-		if (fp->flag & FA_MODIFIED) {	/* Is there any change to the file? */
-#if !_FS_TINY
-			if (fp->flag & FA_DIRTY) {	/* Write-back cached data if needed */
-				if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
-				fp->flag &= (BYTE)~FA_DIRTY;
+#if _FS_LAZYSYNC
+		if ((fp->flag & FA_MODIFIED) && fs->fs_type != FS_EXFAT
+#if _USE_EXPAND
+			&& !fp->xncl
+#endif
+			&& fp->lzsize && fp->obj.objsize >= fp->lzsize		/* Has the file only grown? */
+			&& (fp->obj.objsize - fp->lzsize) / SS(fs) < _LAZYSYNC_SECT
+			&& (DWORD)(_LAZYSYNC_TICK() - fp->lztick) < _LAZYSYNC_MS) {
+			if (fp->lzmark) {
+				res = sync_data(fp);	/* Flush data and FAT, the directory entry follows later */
+			} else {
+				fp->lzmark = NT_LAZY;
+				res = sync_file(fp);	/* Update the directory entry with the mark at first */
 			}
+		} else
 #endif
-			/* Update the directory entry */
-			tm = GET_FATTIME();				/* Modified time */
-#if _FS_EXFAT
-			if (fs->fs_type == FS_EXFAT) {
-				res = fill_first_frag(&fp->obj);	/* Fill first fragment on the FAT if needed */
-				if (res == FR_OK) {
-					res = fill_last_frag(&fp->obj, fp->clust, 0xFFFFFFFF);	/* Fill last fragment on the FAT if needed */
-				}
-				if (res == FR_OK) {
-					INIT_NAMBUF(fs);
-					res = load_obj_dir(&dj, &fp->obj);	/* Load directory entry block */
-					if (res == FR_OK) {
-						fs->dirbuf[XDIR_Attr] |= AM_ARC;				/* Set archive bit */
-						fs->dirbuf[XDIR_GenFlags] = fp->obj.stat | 1;	/* Update file allocation info */
-						st_dword(fs->dirbuf + XDIR_FstClus, fp->obj.sclust);
-						st_qword(fs->dirbuf + XDIR_FileSize, fp->obj.objsize);
-						st_qword(fs->dirbuf + XDIR_ValidFileSize, fp->obj.objsize);
-						st_dword(fs->dirbuf + XDIR_ModTime, tm);		/* Update modified time */
-						fs->dirbuf[XDIR_ModTime10] = 0;
-						st_dword(fs->dirbuf + XDIR_AccTime, 0);
-						res = store_xdir(&dj);	/* Restore it to the directory */
-						if (res == FR_OK) {
-							res = sync_fs(fs);
-							fp->flag &= (BYTE)~FA_MODIFIED;
-						}
-					}
-					FREE_NAMBUF();
-				}
-			} else
-#endif
-			{
-				res = move_window(fs, fp->dir_sect);
-				if (res == FR_OK) {
-					dir = fp->dir_ptr;
-					dir[DIR_Attr] |= AM_ARC;						/* Set archive bit */
-					st_clust(fp->obj.fs, dir, fp->obj.sclust);		/* Update file allocation info  */
-					st_dword(dir + DIR_FileSize, (DWORD)fp->obj.objsize);	/* Update file size */
-					st_dword(dir + DIR_ModTime, tm);				/* Update modified time */
-					st_word(dir + DIR_LstAccDate, 0);
-					fs->wflag = 1;
-					res = sync_fs(fs);					/* Restore it to the directory */
-					fp->flag &= (BYTE)~FA_MODIFIED;
-				}
-			}
+		{
+			res = sync_file(fp);	/* Flush cached data and update the directory entry */
 		}
 	}
 
@@ -3817,24 +5780,45 @@ FRESULT f_close (
 	FRESULT res;
 	FATFS *fs;
 
+
+	res = validate(&fp->obj, &fs);		/* Lock volume */
+	if (res == FR_OK) {
 #if !_FS_READONLY
-	res = f_sync(fp);					/* Flush cached data */
-	if (res == FR_OK)
+#if _USE_EXPAND
+		if (fp->xncl && fp->err != FR_INT_ERR) {	/* Shrink the stream block to the file size, also after a disk error (not if the chain is in doubt) */
+			res = end_stream(fp);
+		}
+		if (res == FR_OK)
 #endif
-	{
-		res = validate(&fp->obj, &fs);	/* Lock volume */
-		if (res == FR_OK) {
+		{
+#if _FS_LAZYSYNC
+			if (fp->lzmark) {			/* Clear the lazy sync mark */
+				fp->lzmark = 0;
+				fp->flag |= FA_MODIFIED;
+			}
+#endif
+			res = sync_file(fp);		/* Flush cached data */
+		}
+		if (res == FR_OK)
+#endif
+		{
 #if _FS_LOCK != 0
 			res = dec_lock(fp->obj.lockid);	/* Decrement file open counter */
 			if (res == FR_OK)
 #endif
 			{
+#if _USE_LINKMAP
+				lmap_free(fp);			/* Release the link map */
+#endif
+#if _USE_FILEBUF
+				fb_free(fp);			/* Return the file buffer to the pool */
+#endif
 				fp->obj.fs = 0;			/* Invalidate file object */
 			}
+		}
 #if _FS_REENTRANT
-			unlock_fs(fs, FR_OK);		/* Unlock volume */
+		unlock_fs(fs, FR_OK);			/* Unlock volume */
 #endif
-		}
 	}
 	return res;
 }
@@ -4009,6 +5993,8 @@ FRESULT f_lseek (
 	FSIZE_t ifptr;
 #if _USE_FASTSEEK
 	DWORD cl, pcl, ncl, tcl, dsc, tlen, ulen, *tbl;
+#elif _USE_LINKMAP
+	DWORD cl;
 #endif
 
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
@@ -4019,6 +6005,9 @@ FRESULT f_lseek (
 	}
 #endif
 	if (res != FR_OK) LEAVE_FF(fs, res);
+#if _USE_FILEBUF && _FILEBUF_SHARE
+	if (fb_hold(fp) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Get the buffer back if another file took it */
+#endif
 
 #if _USE_FASTSEEK
 	if (fp->cltbl) {	/* Fast seek */
@@ -4057,13 +6046,7 @@ FRESULT f_lseek (
 				dsc += (DWORD)((ofs - 1) / SS(fs)) & (fs->csize - 1);
 				if (fp->fptr % SS(fs) && dsc != fp->sect) {	/* Refill sector cache if needed */
 #if !_FS_TINY
-#if !_FS_READONLY
-					if (fp->flag & FA_DIRTY) {		/* Write-back dirty sector cache */
-						if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
-						fp->flag &= (BYTE)~FA_DIRTY;
-					}
-#endif
-					if (disk_read(fs->drv, fp->buf, dsc, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);	/* Load current sector */
+					if (fb_load(fp, dsc, 1) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Load current sector */
 #endif
 					fp->sect = dsc;
 				}
@@ -4102,6 +6085,16 @@ FRESULT f_lseek (
 				fp->clust = clst;
 			}
 			if (clst != 0) {
+#if _USE_LINKMAP
+				cl = (DWORD)((fp->fptr + ofs - 1) / bcs);	/* Cluster order of the target */
+				if (cl >= fp->lmncl) cl = fp->lmncl ? fp->lmncl - 1 : 0;
+				if (cl > (DWORD)(fp->fptr / bcs)) {		/* Skip the mapped part of the chain */
+					clst = lmap_clust(fp, cl);
+					ofs -= (FSIZE_t)cl * bcs - fp->fptr;
+					fp->fptr = (FSIZE_t)cl * bcs;
+					fp->clust = clst;
+				}
+#endif
 				while (ofs > bcs) {						/* Cluster following loop */
 					ofs -= bcs; fp->fptr += bcs;
 #if !_FS_READONLY
@@ -4110,14 +6103,22 @@ FRESULT f_lseek (
 							fp->obj.objsize = fp->fptr;
 							fp->flag |= FA_MODIFIED;
 						}
+#if _USE_LINKMAP
+						clst = lmap_next(fp, (DWORD)(fp->fptr / bcs), clst, 1);	/* Follow chain with forceed stretch */
+#else
 						clst = create_chain(&fp->obj, clst);	/* Follow chain with forceed stretch */
+#endif
 						if (clst == 0) {				/* Clip file size in case of disk full */
 							ofs = 0; break;
 						}
 					} else
 #endif
 					{
+#if _USE_LINKMAP
+						clst = lmap_next(fp, (DWORD)(fp->fptr / bcs), clst, 0);	/* Follow cluster chain if not in write mode */
+#else
 						clst = get_fat(&fp->obj, clst);	/* Follow cluster chain if not in write mode */
+#endif
 					}
 					if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
 					if (clst <= 1 || clst >= fs->n_fatent) ABORT(fs, FR_INT_ERR);
@@ -4137,13 +6138,7 @@ FRESULT f_lseek (
 		}
 		if (fp->fptr % SS(fs) && nsect != fp->sect) {	/* Fill sector cache if needed */
 #if !_FS_TINY
-#if !_FS_READONLY
-			if (fp->flag & FA_DIRTY) {			/* Write-back dirty sector cache */
-				if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
-				fp->flag &= (BYTE)~FA_DIRTY;
-			}
-#endif
-			if (disk_read(fs->drv, fp->buf, nsect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);	/* Fill sector cache */
+			if (fb_load(fp, nsect, 1) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Fill sector cache */
 #endif
 			fp->sect = nsect;
 		}
@@ -4293,6 +6288,53 @@ FRESULT f_readdir (
 
 
 
+#if _USE_READDIRN
+/*-----------------------------------------------------------------------*/
+/* Read Directory Entries in a Batch                                     */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_readdirn (
+	DIR* dp,			/* Pointer to the open directory object */
+	FILEENT* ent,		/* Pointer to the array of compact file information to return */
+	UINT cnt,			/* Number of items in the array */
+	TCHAR* nbuf,		/* Pointer to the buffer to store the names (null:names are not read) */
+	UINT nsz,			/* Size of the name buffer in unit of TCHAR */
+	UINT* rcnt			/* Pointer to number of items read (0:end of the directory) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	UINT n = 0;
+	DEF_NAMBUF
+
+
+	res = validate(&dp->obj, &fs);	/* Check validity of the directory object */
+	if (res == FR_OK) {
+		INIT_NAMBUF(fs);
+		while (n < cnt) {
+			res = dir_read(dp, 0);			/* Read an item */
+			if (res != FR_OK) break;
+			if (!get_fileent(dp, &ent[n], nbuf ? &nbuf : 0, &nsz)) {	/* Get the object information */
+#if _USE_LFN != 0
+				if (dp->blk_ofs != 0xFFFFFFFF) res = dir_sdi(dp, dp->blk_ofs);	/* Read the item again from top of its entry block in the next call */
+#endif
+				if (res == FR_OK && n == 0) res = FR_INVALID_PARAMETER;	/* The name buffer cannot take a name */
+				break;
+			}
+			n++;
+			res = dir_next(dp, 0);			/* Increment index for next */
+			if (res != FR_OK) break;
+		}
+		if (res == FR_NO_FILE) res = FR_OK;	/* Ignore end of directory */
+		FREE_NAMBUF();
+	}
+	*rcnt = n;
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
 #if _USE_FIND
 /*-----------------------------------------------------------------------*/
 /* Find Next File                                                        */
@@ -4409,6 +6451,11 @@ FRESULT f_getfree (
 		} else {
 			/* Get number of free clusters */
 			nfree = 0;
+#if _USE_FREEMAP
+			if (fs->fmap) {		/* FAT16/32 with bitmap: Count on the bitmap */
+				nfree = fmap_count(fs);
+			} else
+#endif
 			if (fs->fs_type == FS_FAT12) {	/* FAT12: Sector unalighed FAT entries */
 				clst = 2; obj.fs = fs;
 				do {
@@ -4484,6 +6531,9 @@ FRESULT f_truncate (
 	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
+#if _USE_FILEBUF && _FILEBUF_SHARE
+	if (fb_hold(fp) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Get the buffer back if another file took it */
+#endif
 
 	if (fp->fptr < fp->obj.objsize) {	/* Process when fptr is not on the eof */
 		if (fp->fptr == 0) {	/* When set file size to zero, remove entire cluster chain */
@@ -4500,14 +6550,24 @@ FRESULT f_truncate (
 		}
 		fp->obj.objsize = fp->fptr;	/* Set file size to current R/W point */
 		fp->flag |= FA_MODIFIED;
+#if _USE_LINKMAP
+		lmap_free(fp);				/* The link map may cover removed clusters */
+#endif
+#if _USE_EXPAND
+		fp->xncl = 0;				/* The rest of a stream block has been removed as well */
+#endif
+#if _FS_LAZYSYNC
+		fp->lzsize = 0;				/* The directory entry is updated at the next sync */
+#endif
 #if !_FS_TINY
-		if (res == FR_OK && (fp->flag & FA_DIRTY)) {
-			if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) {
-				res = FR_DISK_ERR;
-			} else {
-				fp->flag &= (BYTE)~FA_DIRTY;
-			}
+		if (res == FR_OK) res = fb_flush(fp);
+#if _USE_FILEBUF
+		if (fp->fptr % SS(fs) == 0) {	/* Forget the buffered sectors, they may be in the removed clusters */
+			fp->fbcnt = 0; fp->sect = 0;
+		} else {						/* Keep those up to the current sector */
+			fp->fbcnt = (BYTE)(fp->sect - fp->fbsect + 1);
 		}
+#endif
 #endif
 		if (res != FR_OK) ABORT(fs, res);
 	}
@@ -4601,6 +6661,12 @@ FRESULT f_unlink (
 					res = remove_chain(&dj.obj, dclst, 0);
 #endif
 				}
+#if _USE_DIRINDEX && _USE_LFN != 0
+				if (dclst == fs->xdir) fs->xdir = 0xFFFFFFFF;	/* The index of the removed directory is obsolete */
+#endif
+#if _USE_DENTCACHE
+				if (dclst) dc_drop(fs, dclst, 0, 0xFFFFFFFF);	/* So are the objects found in it */
+#endif
 				if (res == FR_OK) res = sync_fs(fs);
 			}
 		}
@@ -4625,8 +6691,7 @@ FRESULT f_mkdir (
 	DIR dj;
 	FATFS *fs;
 	BYTE *dir;
-	UINT n;
-	DWORD dsc, dcl, pcl, tm;
+	DWORD dcl, pcl, tm;
 	DEF_NAMBUF
 
 
@@ -4647,12 +6712,13 @@ FRESULT f_mkdir (
 			if (dcl == 0) res = FR_DENIED;		/* No space to allocate a new cluster */
 			if (dcl == 1) res = FR_INT_ERR;
 			if (dcl == 0xFFFFFFFF) res = FR_DISK_ERR;
-			if (res == FR_OK) res = sync_window(fs);	/* Flush FAT */
+#if _USE_DENTCACHE
+			if (res == FR_OK) dc_drop(fs, dcl, 0, 0xFFFFFFFF);	/* Nothing can be found in the new table yet */
+#endif
+			if (res == FR_OK) res = dir_clear(fs, dcl);	/* Clean up the new table (the window is left at its top sector) */
 			tm = GET_FATTIME();
 			if (res == FR_OK) {					/* Initialize the new directory table */
-				dsc = clust2sect(fs, dcl);
 				dir = fs->win;
-				mem_set(dir, 0, SS(fs));
 				if (!_FS_EXFAT || fs->fs_type != FS_EXFAT) {
 					mem_set(dir + DIR_Name, ' ', 11);	/* Create "." entry */
 					dir[DIR_Name] = '.';
@@ -4663,13 +6729,7 @@ FRESULT f_mkdir (
 					dir[SZDIRE + 1] = '.'; pcl = dj.obj.sclust;
 					if (fs->fs_type == FS_FAT32 && pcl == fs->dirbase) pcl = 0;
 					st_clust(fs, dir + SZDIRE, pcl);
-				}
-				for (n = fs->csize; n; n--) {	/* Write dot entries and clear following sectors */
-					fs->winsect = dsc++;
 					fs->wflag = 1;
-					res = sync_window(fs);
-					if (res != FR_OK) break;
-					mem_set(dir, 0, SS(fs));
 				}
 			}
 			if (res == FR_OK) {
@@ -5140,12 +7200,12 @@ FRESULT f_setlabel (
 FRESULT f_expand (
 	FIL* fp,		/* Pointer to the file object */
 	FSIZE_t fsz,	/* File size to be expanded to */
-	BYTE opt		/* Operation mode 0:Find and prepare or 1:Find and allocate */
+	BYTE opt		/* Operation mode 0:Find and prepare, 1:Find and allocate or 2:Find and allocate for a stream */
 )
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD n, clst, stcl, scl, ncl, tcl, lclst;
+	DWORD n, clst, stcl, scl, tcl, lclst;
 
 
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
@@ -5153,6 +7213,7 @@ FRESULT f_expand (
 	if (fsz == 0 || fp->obj.objsize != 0 || !(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
 #if _FS_EXFAT
 	if (fs->fs_type != FS_EXFAT && fsz >= 0x100000000) LEAVE_FF(fs, FR_DENIED);	/* Check if in size limit */
+	if (fs->fs_type == FS_EXFAT && opt == 2) LEAVE_FF(fs, FR_DENIED);	/* A stream needs the FAT chain (not on exFAT) */
 #endif
 	n = (DWORD)fs->csize * SS(fs);	/* Cluster size */
 	tcl = (DWORD)(fsz / n) + ((fsz & (n - 1)) ? 1 : 0);	/* Number of clusters required */
@@ -5175,19 +7236,10 @@ FRESULT f_expand (
 	} else
 #endif
 	{
-		scl = clst = stcl; ncl = 0;
-		for (;;) {	/* Find a contiguous cluster block */
-			n = get_fat(&fp->obj, clst);
-			if (++clst >= fs->n_fatent) clst = 2;
-			if (n == 1) { res = FR_INT_ERR; break; }
-			if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
-			if (n == 0) {	/* Is it a free cluster? */
-				if (++ncl == tcl) break;	/* Break if a contiguous cluster block is found */
-			} else {
-				scl = clst; ncl = 0;		/* Not a free cluster */
-			}
-			if (clst == stcl) { res = FR_DENIED; break; }	/* No contiguous cluster? */
-		}
+		scl = find_fat(&fp->obj, stcl, tcl);		/* Find a contiguous cluster block */
+		if (scl == 0) res = FR_DENIED;				/* No contiguous cluster block was found */
+		if (scl == 1) res = FR_INT_ERR;
+		if (scl == 0xFFFFFFFF) res = FR_DISK_ERR;
 		if (res == FR_OK) {	/* A contiguous free area is found */
 			if (opt) {		/* Allocate it now */
 				for (clst = scl, n = tcl; n; clst++, n--) {	/* Create a cluster chain on the FAT */
@@ -5205,7 +7257,14 @@ FRESULT f_expand (
 		fs->last_clst = lclst;		/* Set suggested start cluster to start next */
 		if (opt) {	/* Is it allocated now? */
 			fp->obj.sclust = scl;		/* Update object allocation information */
-			fp->obj.objsize = fsz;
+			if (opt == 2) {				/* The file grows into the block from size 0 */
+				fp->xncl = tcl;
+#if _FS_LAZYSYNC
+				fp->lzmark = 0;			/* A stream is not recovered from its chain */
+#endif
+			} else {
+				fp->obj.objsize = fsz;
+			}
 			if (_FS_EXFAT) fp->obj.stat = 2;	/* Set status 'contiguous chain' */
 			fp->flag |= FA_MODIFIED;
 			if (fs->free_clst <= fs->n_fatent - 2) {	/* Update FSINFO */
@@ -5246,6 +7305,9 @@ FRESULT f_forward (
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
 	if (!(fp->flag & FA_READ)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
+#if _USE_FILEBUF && _FILEBUF_SHARE
+	if (fb_hold(fp) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Get the buffer back if another file took it */
+#endif
 
 	remain = fp->obj.objsize - fp->fptr;
 	if (btf > remain) btf = (UINT)remain;			/* Truncate btf by remaining bytes */
@@ -5270,13 +7332,7 @@ FRESULT f_forward (
 		dbuf = fs->win;
 #else
 		if (fp->sect != sect) {		/* Fill sector cache with file data */
-#if !_FS_READONLY
-			if (fp->flag & FA_DIRTY) {		/* Write-back dirty sector cache */
-				if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
-				fp->flag &= (BYTE)~FA_DIRTY;
-			}
-#endif
-			if (disk_read(fs->drv, fp->buf, sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+			if (fb_load(fp, sect, 1) != FR_OK) ABORT(fs, FR_DISK_ERR);
 		}
 		dbuf = fp->buf;
 #endif
@@ -5900,6 +7956,225 @@ TCHAR* f_gets (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Line reader - Find a line end                                         */
+/*-----------------------------------------------------------------------*/
+
+#if _LFN_UNICODE && (_STRF_ENCODE == 1 || _STRF_ENCODE == 2)
+#define LN_UNIT	2	/* Size of the line end on the file */
+#else
+#define LN_UNIT	1
+#endif
+#if _LFN_UNICODE && _STRF_ENCODE == 1
+#define LN_TAIL	1	/* Bytes of the line end following the '\n' byte */
+#else
+#define LN_TAIL	0
+#endif
+
+static
+UINT find_eol (		/* Index of the last byte of the first line end, n:not found */
+	const BYTE* buf,	/* Pointer to the top of the line */
+	UINT sp,			/* Index to scan from */
+	UINT n				/* Number of bytes of the data (n >= LN_UNIT) */
+)
+{
+	UINT ed = n - LN_TAIL;
+	DWORD w;
+
+
+	for (;;) {
+		while (ed - sp >= 4) {		/* Scan four bytes at a time */
+			w = ld_dword(buf + sp) ^ 0x0A0A0A0A;
+			if ((w - 0x01010101) & ~w & 0x80808080) break;	/* Is there a '\n' in them? */
+			sp += 4;
+		}
+		while (sp < ed && buf[sp] != '\n') sp++;
+		if (sp == ed) return n;
+#if LN_UNIT == 2 && _STRF_ENCODE == 1	/* UTF-16LE: 0x0A 0x00 at a character boundary */
+		if (sp % 2 == 0 && buf[sp + 1] == 0) return sp + 1;
+#elif LN_UNIT == 2						/* UTF-16BE: 0x00 0x0A at a character boundary */
+		if (sp % 2 == 1 && buf[sp - 1] == 0) return sp;
+#else
+		return sp;
+#endif
+		sp++;
+	}
+}
+
+
+
+#if _LFN_UNICODE
+/*-----------------------------------------------------------------------*/
+/* Line reader - Decode a line into the line buffer                      */
+/*-----------------------------------------------------------------------*/
+
+static
+UINT decode_line (	/* Number of bytes decoded */
+	FLINE* lr,		/* Pointer to the line reader object */
+	const BYTE* s,	/* Pointer to the line on the file */
+	UINT n,			/* Number of bytes of the line */
+	int all,		/* 0:Leave an incomplete character at the end, 1:Decode to the end */
+	UINT* len		/* Pointer to return the number of characters decoded */
+)
+{
+	UINT i = 0, nc;
+	TCHAR c, *p = lr->lbuf;
+
+
+	while (i < n) {
+		c = s[i];
+		nc = 1;				/* Number of bytes of the character */
+#if _STRF_ENCODE == 3		/* UTF-8 */
+		if (c >= 0xC0 && c < 0xF0) nc = (c < 0xE0) ? 2 : 3;
+#elif _STRF_ENCODE == 2 || _STRF_ENCODE == 1	/* UTF-16BE or UTF-16LE */
+		nc = 2;
+#else						/* ANSI/OEM */
+		if (IsDBCS1(c)) nc = 2;
+#endif
+		if (n - i < nc) {	/* Incomplete character at the end */
+			if (!all) break;
+			i = n; break;	/* Drop it at the end of the file */
+		}
+#if _STRF_ENCODE == 3
+		if (c >= 0x80) {
+			if (c < 0xC0) {			/* Skip stray trailer */
+				i++; continue;
+			}
+			if (c < 0xE0) {			/* Two-byte sequence (0x80-0x7FF) */
+				c = (c & 0x1F) << 6 | (s[i + 1] & 0x3F);
+				if (c < 0x80) c = '?';	/* Reject invalid code range */
+			} else if (c < 0xF0) {	/* Three-byte sequence (0x800-0xFFFF) */
+				c = c << 12 | (s[i + 1] & 0x3F) << 6 | (s[i + 2] & 0x3F);
+				if (c < 0x800) c = '?';	/* Reject invalid code range */
+			} else {				/* Reject four-byte sequence */
+				c = '?';
+			}
+		}
+#elif _STRF_ENCODE == 2
+		c = s[i + 1] + (s[i] << 8);
+#elif _STRF_ENCODE == 1
+		c = s[i] + (s[i + 1] << 8);
+#else
+		if (nc == 2) c = (c << 8) + s[i + 1];
+		c = ff_convert(c, 1);	/* OEM -> Unicode */
+		if (!c) c = '?';
+#endif
+		*p++ = c;
+		i += nc;
+	}
+	*len = (UINT)(p - lr->lbuf);
+	return i;
+}
+#endif
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Line reader - Start reading lines of the file                         */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_lineopen (
+	FLINE* lr,		/* Pointer to the line reader object to initialize */
+	FIL* fp,		/* Pointer to the open file object, read from the file pointer on */
+	void* buf,		/* Pointer to the read buffer (aligned to TCHAR at _LFN_UNICODE) */
+	UINT sz			/* Size of the read buffer in bytes (a multiple of the sector size plus one fits best) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	UINT n;
+
+
+	res = validate(&fp->obj, &fs);				/* Check validity of the file object */
+	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
+	if (!(fp->flag & FA_READ)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
+#if _LFN_UNICODE
+	n = (sz - sizeof (TCHAR)) / (1 + sizeof (TCHAR)) & ~(UINT)(sizeof (TCHAR) - 1);	/* Read area, the decoded line takes the rest */
+	lr->lbuf = (TCHAR*)((BYTE*)buf + n);
+#else
+	n = sz - 1;		/* Read area, a byte is left for the terminator */
+#endif
+	if (!buf || sz < 16 || n < 4) LEAVE_FF(fs, FR_INVALID_PARAMETER);
+	lr->fp = fp;
+	lr->buf = (BYTE*)buf;
+	lr->sz = n;
+	lr->rp = lr->sp = lr->wp = 0;
+	lr->part = 0;
+
+	LEAVE_FF(fs, FR_OK);
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Line reader - Get a line                                              */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_getline (
+	FLINE* lr,		/* Pointer to the line reader object */
+	TCHAR** line,	/* Pointer to return the line without the line end (null:end of the file), valid until the next call */
+	UINT* len		/* Pointer to return the number of characters of the line */
+)
+{
+	FRESULT res = FR_OK;
+	FIL *fp = lr->fp;
+	BYTE *buf = lr->buf;
+	UINT rp = lr->rp, sp = lr->sp, wp = lr->wp, ep, ln, br, top;
+
+
+	*line = 0; *len = 0;
+	lr->part = 0;
+	if (!fp->obj.fs) return FR_INVALID_OBJECT;
+	for (;;) {
+		ep = (wp - rp >= LN_UNIT) ? rp + find_eol(buf + rp, sp - rp, wp - rp) : wp;
+		if (ep < wp) break;				/* A line end is found */
+		sp = (wp - rp >= LN_UNIT) ? wp - LN_TAIL : rp;	/* No line end in the data up to here */
+		if (rp > 0) {					/* Move the rest of the data to the top (mem_cpy copies forward) */
+			mem_cpy(buf, buf + rp, wp - rp);
+			sp -= rp; wp -= rp; rp = 0;
+			ep = wp;
+		}
+		if (wp == lr->sz) break;		/* The line is longer than the buffer, return a part of it */
+		ln = lr->sz - wp;				/* Read so that the file pointer stays on the sector boundary */
+		br = (UINT)((fp->fptr + ln) % SS(fp->obj.fs));
+		if (br < ln) ln -= br;
+		res = f_read(fp, buf + wp, ln, &br);
+		if (res != FR_OK || br == 0) break;	/* Error or end of the file */
+		wp += br;
+	}
+
+	if (res == FR_OK && rp < wp) {
+		top = rp;
+		ln = (ep < wp) ? ep + 1 - LN_UNIT : wp;	/* End of the line on the file */
+		rp = (ep < wp) ? ep + 1 : wp;			/* Top of the next line */
+#if _LFN_UNICODE
+		br = decode_line(lr, buf + top, ln - top, ep < wp || wp < lr->sz, len);
+		if (ep == wp) rp = top + br;			/* An incomplete character at the end is left to the next part */
+#if _USE_STRFUNC == 2
+		if (*len && lr->lbuf[*len - 1] == '\r') (*len)--;	/* Strip '\r' of the CRLF line end (or at the end of a part) */
+#endif
+		lr->part = (ep == wp && wp == lr->sz);
+		lr->lbuf[*len] = 0;
+		*line = lr->lbuf;
+#else
+#if _USE_STRFUNC == 2
+		if (ln > top && buf[ln - 1] == '\r') ln--;	/* Strip '\r' of the CRLF line end (or at the end of a part) */
+#endif
+		lr->part = (ep == wp && wp == lr->sz);
+		buf[ln] = 0;					/* Terminate the line in place */
+		*line = (TCHAR*)(buf + top);
+		*len = ln - top;
+#endif
+		sp = rp;
+	}
+	lr->rp = rp; lr->sp = sp; lr->wp = wp;
+
+	return res;
+}
+
+
+
+
 #if !_FS_READONLY
 #include <stdarg.h>
 /*-----------------------------------------------------------------------*/
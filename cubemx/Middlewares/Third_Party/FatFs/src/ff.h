@@ -80,6 +80,18 @@ typedef DWORD FSIZE_t;
 
 
 
+/* Link map fragment (_USE_LINKMAP) */
+
+#if _USE_LINKMAP
+typedef struct {
+	DWORD	clst;		/* Top cluster of the fragment */
+	DWORD	ncl;		/* Number of clusters in the fragment */
+	WORD	next;		/* Next fragment of the file or free fragment (index + 1, 0:none) */
+} LMFRAG;
+#endif
+
+
+
 /* File system object structure (FATFS) */
 
 typedef struct {
@@ -106,6 +118,39 @@ typedef struct {
 #if !_FS_READONLY
 	DWORD	last_clst;		/* Last allocated cluster */
 	DWORD	free_clst;		/* Number of free clusters */
+#if _USE_FREEMAP
+	DWORD*	fmap;			/* Free cluster bitmap (b=1:in use, 0:not available) */
+#endif
+#if _USE_ALIASMAP && _USE_LFN != 0
+	BYTE*	amap;			/* Short name set of the directory adir */
+	DWORD	adir;			/* Directory the short name set belongs to (0xFFFFFFFF:none) */
+#endif
+#if _FS_LAZYMIRROR
+	WORD	mrcnt;			/* Number of FAT sector ranges to be mirrored */
+	DWORD	mrange[_LAZYMIRROR_RANGES][2];	/* FAT sector ranges to be mirrored, sorted ([0]:first, [1]:last, offset from fatbase) */
+#endif
+#endif
+#if _USE_DIRINDEX && _USE_LFN != 0
+	BYTE*	xtbl;			/* Directory index (a name filter of xwid bytes per sector of the directory) */
+	DWORD	xdir;			/* Directory the index belongs to (0xFFFFFFFF:none) */
+	DWORD	xfre;			/* Offset of the first entry that can be free in the directory */
+	WORD	xsct;			/* Number of sectors of the directory that can hold an object */
+	BYTE	xwid;			/* Bytes of the filter per sector */
+#endif
+#if _USE_DENTCACHE
+	DWORD*	dcache;			/* Path cache ({directory, name hash, entry} triplets, most recently used first, directory 0xFFFFFFFF:unused) */
+#endif
+#if _USE_FILEBUF
+	BYTE*	fbpool;			/* File buffer pool (_FILEBUF_NUM buffers of _FILEBUF_SECT sectors) */
+	BYTE	fbuse;			/* File buffers in use (b0:first buffer, b1:second buffer, ...) */
+#if _FILEBUF_SHARE
+	DWORD	fbtag[_FILEBUF_NUM];	/* Tag of the file object holding each buffer (FIL.fbtag) */
+	DWORD	fbage[_FILEBUF_NUM];	/* Time of the last use of each buffer */
+	DWORD	fbsect[_FILEBUF_NUM];	/* First sector in each buffer */
+	BYTE	fbdlo[_FILEBUF_NUM];	/* Unwritten sectors in each buffer (fbdlo to fbdhi - 1, none if equal) */
+	BYTE	fbdhi[_FILEBUF_NUM];
+	DWORD	fbclk;			/* Buffer use counter */
+#endif
 #endif
 #if _FS_RPATH != 0
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
@@ -123,6 +168,19 @@ typedef struct {
 	DWORD	database;		/* Data base sector */
 	DWORD	winsect;		/* Current sector appearing in the win[] */
 	BYTE	win[_MAX_SS];	/* Disk access window for Directory, FAT (and file data at tiny cfg) */
+#if _USE_WINCACHE
+	BYTE	wdirty[_WINCACHE_FAT + _WINCACHE_DIR];	/* Window cache slot flags (b0:dirty) */
+	DWORD	wsect[_WINCACHE_FAT + _WINCACHE_DIR];	/* Window cache slot sectors (0xFFFFFFFF:empty) */
+	DWORD	wused[_WINCACHE_FAT + _WINCACHE_DIR];	/* Window cache slot last use (LRU) */
+	DWORD	wtick;			/* Window cache use counter */
+	DWORD	whit[2];		/* Window cache hits (0:FAT, 1:others) */
+	DWORD	wmiss[2];		/* Window cache misses (0:FAT, 1:others) */
+	BYTE	wbuf[_WINCACHE_FAT + _WINCACHE_DIR][_MAX_SS];	/* Window cache slots */
+#endif
+#if _USE_LINKMAP
+	WORD	lmfree;			/* Top of the free link map fragments (index + 1, 0:none) */
+	LMFRAG	lmfrag[_LINKMAP_FRAGS];	/* Link map fragments shared by the open files */
+#endif
 } FATFS;
 
 
@@ -166,9 +224,37 @@ typedef struct {
 #if _USE_FASTSEEK
 	DWORD*	cltbl;			/* Pointer to the cluster link map table (nulled on open, set by application) */
 #endif
+#if _USE_LINKMAP
+	WORD	lmtop;			/* First fragment of the automatic link map (index + 1, 0:empty) */
+	WORD	lmlast;			/* Last fragment of the automatic link map (index + 1) */
+	DWORD	lmncl;			/* Number of clusters mapped from the top of the file */
+#endif
+#if _USE_EXPAND
+	DWORD	xncl;			/* Number of clusters reserved for the stream by f_expand (0:not a stream) */
+#endif
+#if _FS_LAZYSYNC
+	BYTE	lzmark;			/* Lazy sync mark in the directory entry (0:not marked) */
+	FSIZE_t	lzsize;			/* File size recorded in the directory entry */
+	DWORD	lztick;			/* Tick of the last directory entry update */
+#endif
 #if !_FS_TINY
+#if _USE_FILEBUF
+	BYTE*	buf;			/* Pointer to the sector appearing in the file buffer */
+	BYTE*	fbuf;			/* File buffer (buffer from the pool or sbuf[], 0:none with _FILEBUF_SHARE) */
+	DWORD	fbsect;			/* First sector in the file buffer */
+	BYTE	fbid;			/* Buffer taken from the pool (index + 1, 0:none) */
+	BYTE	fbcnt;			/* Number of sectors in the file buffer */
+	BYTE	fbdlo;			/* Dirty sectors in the file buffer (fbdlo to fbdhi - 1, valid with FA_DIRTY) */
+	BYTE	fbdhi;
+#if _FILEBUF_SHARE
+	DWORD	fbtag;			/* Tag of the buffer, the buffer is no longer ours when the pool has another one for it */
+#else
+	BYTE	sbuf[_MAX_SS];	/* File private single sector buffer */
+#endif
+#else
 	BYTE	buf[_MAX_SS];	/* File private data read/write window */
 #endif
+#endif
 } FIL;
 
 
@@ -209,6 +295,37 @@ typedef struct {
 
 
 
+/* Compact file information structure (FILEENT) */
+
+typedef struct {
+	FSIZE_t	fsize;			/* File size */
+	DWORD	sclust;			/* Start cluster (0:no data) */
+	DWORD	nhash;			/* Hash of the primary file name (FNV-1a of the up-cased characters, in Unicode at _USE_LFN != 0) */
+	WORD	fdate;			/* Modified date */
+	WORD	ftime;			/* Modified time */
+	BYTE	fattrib;		/* File attribute */
+	TCHAR*	fname;			/* Primary file name in the name buffer (null:names are not read) */
+} FILEENT;
+
+
+
+/* Line reader object structure (FLINE) */
+
+typedef struct {
+	FIL*	fp;				/* Pointer to the file object to read lines from */
+	BYTE*	buf;			/* Read buffer */
+	UINT	sz;				/* Size of the read area in buf[] */
+	UINT	rp;				/* Top of the data not returned yet */
+	UINT	sp;				/* Scan position (no line end in rp to sp - 1) */
+	UINT	wp;				/* End of the data in buf[] */
+	BYTE	part;			/* The line returned last goes on in the next one (it is longer than the buffer) */
+#if _LFN_UNICODE
+	TCHAR*	lbuf;			/* Decoded line (in buf[] following the read area) */
+#endif
+} FLINE;
+
+
+
 /* File function return code (FRESULT) */
 
 typedef enum {
@@ -249,6 +366,7 @@ FRESULT f_sync (FIL* fp);											/* Flush cached data of the writing file */
 FRESULT f_opendir (DIR* dp, const TCHAR* path);						/* Open a directory */
 FRESULT f_closedir (DIR* dp);										/* Close an open directory */
 FRESULT f_readdir (DIR* dp, FILINFO* fno);							/* Read a directory item */
+FRESULT f_readdirn (DIR* dp, FILEENT* ent, UINT cnt, TCHAR* nbuf, UINT nsz, UINT* rcnt);	/* Read directory items in a batch */
 FRESULT f_findfirst (DIR* dp, FILINFO* fno, const TCHAR* path, const TCHAR* pattern);	/* Find first file */
 FRESULT f_findnext (DIR* dp, FILINFO* fno);							/* Find next file */
 FRESULT f_mkdir (const TCHAR* path);								/* Create a sub directory */
@@ -264,7 +382,7 @@ FRESULT f_getfree (const TCHAR* path, DWORD* nclst, FATFS** fatfs);	/* Get numbe
 FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume label */
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
-FRESULT f_expand (FIL* fp, FSIZE_t szf, BYTE opt);					/* Allocate a contiguous block to the file */
+FRESULT f_expand (FIL* fp, FSIZE_t szf, BYTE opt);					/* Allocate a contiguous block to the file (opt 2: as a stream) */
 FRESULT f_mount (FATFS* fs, const TCHAR* path, BYTE opt);			/* Mount/Unmount a logical drive */
 FRESULT f_mkfs (const TCHAR* path, BYTE opt, DWORD au, void* work, UINT len);	/* Create a FAT volume */
 FRESULT f_fdisk (BYTE pdrv, const DWORD* szt, void* work);			/* Divide a physical drive into some partitions */
@@ -272,6 +390,8 @@ int f_putc (TCHAR c, FIL* fp);										/* Put a character to the file */
 int f_puts (const TCHAR* str, FIL* cp);								/* Put a string to the file */
 int f_printf (FIL* fp, const TCHAR* str, ...);						/* Put a formatted string to the file */
 TCHAR* f_gets (TCHAR* buff, int len, FIL* fp);						/* Get a string from the file */
+FRESULT f_lineopen (FLINE* lr, FIL* fp, void* buf, UINT sz);		/* Start reading lines of the file */
+FRESULT f_getline (FLINE* lr, TCHAR** line, UINT* len);				/* Get a line from the line reader */
 
 #define f_eof(fp) ((int)((fp)->fptr == (fp)->obj.objsize))
 #define f_error(fp) ((fp)->err)
@@ -279,6 +399,7 @@ TCHAR* f_gets (TCHAR* buff, int len, FIL* fp);						/* Get a string from the fil
 #define f_size(fp) ((fp)->obj.objsize)
 #define f_rewind(fp) f_lseek((fp), 0)
 #define f_rewinddir(dp) f_readdir((dp), 0)
+#define f_linepart(lr) ((lr)->part)
 #define f_rmdir(path) f_unlink(path)
 
 #ifndef EOF
@@ -1,9 +1,11 @@
 #include "main.h"
+#include "dma.h"
 #include "fatfs.h"
 #include "gpio.h"
 #include "sd_card.h"
 #include "spi.h"
 #include "usart.h"
+#include "user_diskio_spi.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,6 +28,7 @@ int main(void)
     SystemClock_Config();
 
     MX_GPIO_Init();
+    MX_DMA_Init();
     MX_USART2_UART_Init();
     MX_SPI3_Init();
     MX_FATFS_Init();
@@ -75,7 +78,7 @@ int main(void)
     printf("Read from %s: %s\n\r", fullpath, read_buffer.buffer);
 
     while (1) {
-        ;
+        USER_SPI_poll();
         ;
     }
 }
\ No newline at end of file
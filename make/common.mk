@@ -10,6 +10,7 @@ SCRIPTS_DIR := $(PROJECT_DIR)/scripts
 COMPONENTS_DIR := $(PROJECT_DIR)/components
 SUBMODULES_DIR := $(PROJECT_DIR)/submodules
 REQUIREMENTS_DIR := $(PROJECT_DIR)/requirements
+TEST_DIR := $(PROJECT_DIR)/test
 
 PROJECT_BINARY := $(BUILD_DIR)/main/main.elf
 
@@ -0,0 +1,10 @@
+include make/common.mk
+
+TEST_BUILD_DIR := $(BUILD_DIR)/test
+
+# Host tests of the SD card stack against the card emulator, no board needed
+.PHONY: test
+test:
+	cmake -S "$(TEST_DIR)" -B "$(TEST_BUILD_DIR)"
+	cmake --build "$(TEST_BUILD_DIR)"
+	ctest --test-dir "$(TEST_BUILD_DIR)" --output-on-failure
@@ -0,0 +1,114 @@
+/**
+ ******************************************************************************
+ * @file    bench_alloc.c
+ * @brief   FAT sectors read and time it takes FatFs to find free clusters on
+ *          a nearly full, fragmented FAT32 volume
+ ******************************************************************************
+ */
+
+#include "board.h"
+#include "fatfs.h"
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "bench_alloc.img"
+#define FULL_PCT 80   /* Leading part of the clusters all in use */
+#define HOLE_EVERY 16 /* Beyond it, one cluster in this many is free */
+#define APPEND 1000   /* Clusters appended one by one */
+
+static BYTE Work[_MAX_SS];
+static BYTE Buf[512];
+
+// Rewrites the FAT so that the first FULL_PCT percent of the clusters are in
+// use and every HOLE_EVERY-th cluster beyond them is free. The clusters in
+// use are lost chains of one cluster, which are the same to the allocator
+static void fragment(FATFS* fs)
+{
+    DWORD full = 2 + (fs->n_fatent - 2) / 100 * FULL_PCT;
+
+    for (DWORD s = 0; s < fs->fsize; s++) {
+        CHECK(disk_read(0, Work, fs->fatbase + s, 1) == RES_OK);
+        for (UINT i = 0; i < 128; i++) {
+            DWORD clst = s * 128 + i, val;
+
+            if (clst < 3 || clst >= fs->n_fatent) /* Reserved, root directory */
+                continue;
+            val = (clst < full || clst % HOLE_EVERY) ? 0x0FFFFFFF : 0;
+            Work[i * 4] = (BYTE)val;
+            Work[i * 4 + 1] = (BYTE)(val >> 8);
+            Work[i * 4 + 2] = (BYTE)(val >> 16);
+            Work[i * 4 + 3] = (BYTE)(val >> 24);
+        }
+        CHECK(disk_write(0, Work, fs->fatbase + s, 1) == RES_OK);
+    }
+    CHECK(disk_ioctl(0, CTRL_SYNC, 0) == RES_OK);
+}
+
+static void report(const char* what, double ms)
+{
+    sd_emu_stats_t st;
+
+    sd_emu_get_stats(&st);
+    printf("%-34s %9.1f ms, %5u blocks read, %5u written\n", what, ms,
+           st.blocks_read, st.blocks_written);
+    CHECK(st.errors == 0);
+}
+
+int main(void)
+{
+    FIL* fp = &USERFile;
+    FATFS* fs = &USERFatFS;
+    sd_emu_stats_t st;
+    DWORD fsize;
+    UINT bw;
+    double t0;
+
+    board_card(IMAGE, 131072, SD_EMU_SDHC, &sd_emu_profile_typical, 0);
+    MX_FATFS_Init();
+    CHECK(retUSER == 0);
+    CHECK(f_mkfs(USERPath, FM_FAT32, 512, Work, sizeof Work) == FR_OK);
+    CHECK(f_mount(fs, USERPath, 1) == FR_OK);
+    CHECK(fs->fs_type == FS_FAT32 && fs->csize == 1);
+    fsize = fs->fsize;
+    fragment(fs);
+    CHECK(f_mount(0, USERPath, 0) == FR_OK);
+    CHECK(f_mount(fs, USERPath, 1) == FR_OK);
+    printf("%lu clusters, %lu FAT sectors, %u%% in use, then 1 in %u free\n",
+           fs->n_fatent - 2, fsize, FULL_PCT, HOLE_EVERY);
+
+    /* The first allocation walks the part in use */
+    sd_emu_reset_stats();
+    t0 = board_ms();
+    CHECK(f_open(fp, "log.bin", FA_WRITE | FA_CREATE_NEW) == FR_OK);
+    memset(Buf, 0x5A, sizeof Buf);
+    CHECK(f_write(fp, Buf, sizeof Buf, &bw) == FR_OK && bw == sizeof Buf);
+    CHECK(f_sync(fp) == FR_OK);
+    report("first cluster", board_ms() - t0);
+    sd_emu_get_stats(&st);
+    CHECK(st.blocks_read <= fsize * FULL_PCT / 100 + 16); /* FAT sectors once */
+
+    /* Then the next free one is always close to the last one */
+    sd_emu_reset_stats();
+    t0 = board_ms();
+    for (UINT i = 0; i < APPEND; i++)
+        CHECK(f_write(fp, Buf, sizeof Buf, &bw) == FR_OK && bw == sizeof Buf);
+    CHECK(f_close(fp) == FR_OK);
+    report("1000 clusters appended one by one", board_ms() - t0);
+    sd_emu_get_stats(&st);
+    CHECK(st.blocks_read <= APPEND * HOLE_EVERY / 128 + 16);
+
+    /* No contiguous block left: the whole FAT is scanned once */
+    sd_emu_reset_stats();
+    t0 = board_ms();
+    CHECK(f_open(fp, "block.bin", FA_WRITE | FA_CREATE_NEW) == FR_OK);
+    CHECK(f_expand(fp, 64 * 512, 1) == FR_DENIED);
+    CHECK(f_close(fp) == FR_OK);
+    report("64 contiguous clusters (denied)", board_ms() - t0);
+    sd_emu_get_stats(&st);
+    CHECK(st.blocks_read <= fsize + 16);
+
+    CHECK(f_mount(0, USERPath, 0) == FR_OK);
+    sd_emu_close();
+    unlink(IMAGE);
+    return 0;
+}
@@ -0,0 +1,92 @@
+/**
+ ******************************************************************************
+ * @file    bench_create_files.c
+ * @brief   Time and card traffic it takes FatFs to create 5000 files with
+ *          long names in one directory, where every short name is a
+ *          numbered one, and to open them again
+ ******************************************************************************
+ */
+
+#include "board.h"
+#include "fatfs.h"
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "bench_create_files.img"
+#define FILES 5000
+#define BATCH 1000 /* Files per line of the report */
+#define LOOKUP_BLOCKS 48 /* Blocks a search in the directory may read, of the
+                            938 sectors it has in the end */
+
+static BYTE Work[_MAX_SS];
+
+static void name_of(char* name, size_t size, int i)
+{
+    snprintf(name, size, "log/measurement_%05d.csv", i);
+}
+
+static void report(const char* what, int first, const sd_emu_stats_t* st,
+                   double ms)
+{
+    printf("%-6s %4d-%4d: %8.1f ms, %6.2f ms/file, %7.1f blocks read/file, "
+           "%5.1f written/file\n",
+           what, first, first + BATCH - 1, ms, ms / BATCH,
+           (double)st->blocks_read / BATCH,
+           (double)st->blocks_written / BATCH);
+}
+
+int main(void)
+{
+    FIL* fp = &USERFile;
+    FILINFO fno;
+    sd_emu_stats_t st;
+    char name[32];
+    double t0, total;
+
+    board_card(IMAGE, 131072, SD_EMU_SDHC, &sd_emu_profile_typical, 0);
+    MX_FATFS_Init();
+    CHECK(retUSER == 0);
+    CHECK(f_mkfs(USERPath, FM_FAT32, 0, Work, sizeof Work) == FR_OK);
+    CHECK(f_mount(&USERFatFS, USERPath, 1) == FR_OK);
+    CHECK(f_mkdir("log") == FR_OK);
+
+    total = 0;
+    for (int first = 0; first < FILES; first += BATCH) {
+        sd_emu_reset_stats();
+        t0 = board_ms();
+        for (int i = first; i < first + BATCH; i++) {
+            name_of(name, sizeof name, i);
+            CHECK(f_open(fp, name, FA_WRITE | FA_CREATE_NEW) == FR_OK);
+            CHECK(f_close(fp) == FR_OK);
+        }
+        sd_emu_get_stats(&st);
+        report("create", first, &st, board_ms() - t0);
+        total += board_ms() - t0;
+        CHECK(st.errors == 0);
+
+        /* No search of the directory for each numbered name tried, for the
+           name itself or for free entries: the directory index leaves a few
+           sectors (and what the read-ahead takes with them) to read */
+        CHECK(st.blocks_read <= LOOKUP_BLOCKS * BATCH);
+    }
+    printf("create %d files: %.1f ms\n", FILES, total);
+
+    /* Every file is there under its own name and a short name of its own */
+    sd_emu_reset_stats();
+    t0 = board_ms();
+    for (int i = 0; i < FILES; i += 50) {
+        name_of(name, sizeof name, i);
+        CHECK(f_stat(name, &fno) == FR_OK);
+        CHECK(strcmp(fno.fname, name + 4) == 0);
+        CHECK(strchr(fno.altname, '~'));
+    }
+    sd_emu_get_stats(&st);
+    printf("stat every 50th file: %.1f ms, %u blocks read\n",
+           board_ms() - t0, st.blocks_read);
+    CHECK(st.blocks_read <= LOOKUP_BLOCKS * (FILES / 50));
+
+    CHECK(f_mount(0, USERPath, 0) == FR_OK);
+    sd_emu_close();
+    unlink(IMAGE);
+    return 0;
+}
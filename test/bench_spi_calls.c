@@ -0,0 +1,75 @@
+/**
+ ******************************************************************************
+ * @file    bench_spi_calls.c
+ * @brief   HAL calls and bytes per call it takes user_diskio_spi.c to move
+ *          data blocks, and the resulting throughput on the emulated bus
+ ******************************************************************************
+ */
+
+#include "board.h"
+#include "user_diskio_spi.h"
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "bench_spi_calls.img"
+#define TOTAL 2048 /* Sectors moved per run, 1 MiB */
+
+static BYTE Buf[128 * 512];
+
+static void report(const char* what, UINT count, const sd_emu_stats_t* st,
+                   double ms)
+{
+    printf("%-6s %3u sect/call: %7u HAL calls (%5.2f per sector), "
+           "%6.1f bytes/call, sizes 1:%u 2-15:%u 16-511:%u 512+:%u, "
+           "%6.1f ms, %5.0f KiB/s\n",
+           what, count, st->spi_calls, (double)st->spi_calls / TOTAL,
+           (double)st->spi_bytes / st->spi_calls, st->spi_sizes[0],
+           st->spi_sizes[1], st->spi_sizes[2], st->spi_sizes[3], ms,
+           TOTAL / 2 / (ms / 1000));
+}
+
+static void run(const char* profile_name, const sd_emu_profile_t* profile)
+{
+    static const UINT counts[] = {1, 8, 64};
+    sd_emu_stats_t st;
+    double t0;
+
+    printf("%s card:\n", profile_name);
+    board_card(IMAGE, 65536, SD_EMU_SDHC, profile, 0);
+    CHECK(USER_SPI_initialize(0) == 0);
+
+    for (UINT i = 0; i < sizeof counts / sizeof counts[0]; i++) {
+        UINT count = counts[i];
+
+        memset(Buf, 0x5A, sizeof Buf);
+        sd_emu_reset_stats();
+        t0 = board_ms();
+        for (DWORD sect = 0; sect < TOTAL; sect += count)
+            CHECK(USER_SPI_write(0, Buf, sect, count) == RES_OK);
+        CHECK(USER_SPI_ioctl(0, CTRL_SYNC, 0) == RES_OK);
+        sd_emu_get_stats(&st);
+        report("write", count, &st, board_ms() - t0);
+        CHECK(st.blocks_written == TOTAL && st.errors == 0);
+        CHECK(st.spi_sizes[3] == TOTAL); /* Every block in one call */
+
+        sd_emu_reset_stats();
+        t0 = board_ms();
+        for (DWORD sect = 0; sect < TOTAL; sect += count)
+            CHECK(USER_SPI_read(0, Buf, sect, count) == RES_OK);
+        sd_emu_get_stats(&st);
+        report("read", count, &st, board_ms() - t0);
+        CHECK(st.blocks_read == TOTAL && st.errors == 0);
+        CHECK(st.spi_sizes[3] == TOTAL);
+        if (profile == &sd_emu_profile_ideal)
+            CHECK(st.spi_calls < 8 * TOTAL); /* Byte by byte: over 514 */
+    }
+    sd_emu_close();
+}
+
+int main(void)
+{
+    run("ideal", &sd_emu_profile_ideal);
+    run("typical", &sd_emu_profile_typical);
+    unlink(IMAGE);
+    return 0;
+}
@@ -0,0 +1,50 @@
+/**
+ ******************************************************************************
+ * @file    board.c
+ * @brief   Host counterpart of the board setup the SD card stack expects
+ ******************************************************************************
+ */
+
+#include "board.h"
+#include "user_diskio_spi.h"
+
+SPI_HandleTypeDef hspi3; /* SD_SPI_HANDLE */
+
+/* Same forwarding as in Core/Src/spi.c */
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef* spiHandle)
+{
+    USER_SPI_DmaCplt(spiHandle);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef* spiHandle)
+{
+    USER_SPI_DmaCplt(spiHandle);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef* spiHandle)
+{
+    USER_SPI_DmaCplt(spiHandle);
+}
+
+void board_card(const char* image,
+                uint32_t sectors,
+                sd_emu_card_t card,
+                const sd_emu_profile_t* profile,
+                int dma)
+{
+    sd_emu_config_t config = {
+        .image = image,
+        .card = card,
+        .profile = profile,
+        .dma = dma,
+    };
+
+    if (sectors)
+        CHECK(sd_emu_create(image, sectors) == 0);
+    CHECK(sd_emu_open(&hspi3, &config) == 0);
+}
+
+double board_ms(void)
+{
+    return (double)sd_emu_time_ns() / 1e6;
+}
@@ -0,0 +1,39 @@
+/**
+ ******************************************************************************
+ * @file    board.h
+ * @brief   Host counterpart of the board setup the SD card stack expects,
+ *          shared by the host tests
+ ******************************************************************************
+ */
+
+#ifndef BOARD_H
+#define BOARD_H
+
+#include "sd_emu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+extern SPI_HandleTypeDef hspi3;
+
+#define CHECK(cond)                                                    \
+    do {                                                               \
+        if (!(cond)) {                                                 \
+            fprintf(                                                   \
+                stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                #cond);                                                \
+            exit(1);                                                   \
+        }                                                              \
+    } while (0)
+
+// Creates an image of the given size (0:keep the existing one) and puts a
+// card of that kind behind SD_SPI_HANDLE, with DMA streams linked or not
+extern void board_card(const char* image,
+                       uint32_t sectors,
+                       sd_emu_card_t card,
+                       const sd_emu_profile_t* profile,
+                       int dma);
+
+// Virtual milliseconds since board_card
+extern double board_ms(void);
+
+#endif
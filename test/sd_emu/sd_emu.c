@@ -0,0 +1,932 @@
+/**
+ ******************************************************************************
+ * @file    sd_emu.c
+ * @brief   SD card SPI mode state machine behind host versions of the SPI,
+ *          GPIO and tick HAL functions used by user_diskio_spi.c
+ ******************************************************************************
+ */
+
+#include "sd_emu.h"
+#include "main.h" /* SD_CS_GPIO_Port, SD_CS_Pin */
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const sd_emu_profile_t sd_emu_profile_ideal = {
+    .hal_ns = 1500,
+    .tick_ns = 200,
+    .pclk_hz = 42000000,
+};
+
+const sd_emu_profile_t sd_emu_profile_typical = {
+    .init_us = 100000,
+    .read_us = 300,
+    .read_next_us = 60,
+    .write_us = 250,
+    .stall_every = 64,
+    .stall_us = 5000,
+    .stop_us = 500,
+    .erase_us = 2000,
+    .hal_ns = 1500,
+    .tick_ns = 200,
+    .pclk_hz = 42000000,
+};
+
+const sd_emu_profile_t sd_emu_profile_slow = {
+    .init_us = 400000,
+    .read_us = 1500,
+    .read_next_us = 200,
+    .write_us = 1200,
+    .stall_every = 16,
+    .stall_us = 150000,
+    .stop_us = 2000,
+    .erase_us = 50000,
+    .hal_ns = 1500,
+    .tick_ns = 200,
+    .pclk_hz = 42000000,
+};
+
+/* Card states (ST_xxx) */
+#define ST_CMD 0    /* Waiting for a command */
+#define ST_READ 1   /* Sending data blocks (CMD17/CMD18) */
+#define ST_WTOKEN 2 /* Waiting for a data token (CMD24/CMD25) */
+#define ST_WDATA 3  /* Receiving a data block */
+
+static struct {
+    int fd;               /* Image file */
+    uint32_t sectors;     /* Size of the image */
+    sd_emu_card_t type;   /* Kind of card */
+    uint8_t erased;       /* Content of erased blocks */
+    int inserted;         /* Card is in the socket */
+    int spi;              /* Switched to SPI mode by CMD0 */
+    uint32_t clocks;      /* Clocks seen deselected since power up */
+    int selected;         /* CS# is low */
+    int idle;             /* In idle state (R1 bit 0) */
+    int app;              /* Previous command was CMD55 */
+    uint64_t init_end;    /* ACMD41/CMD1 complete from this time */
+    int state;            /* ST_xxx */
+    int multi;            /* CMD18/CMD25 transfer */
+    uint32_t sect;        /* Next block of the data transfer */
+    uint64_t busy;        /* Card holds MISO low until this time */
+    uint64_t data;        /* Next read block is ready at this time */
+    int loaded;           /* A CMD18 block is in the output queue */
+    uint32_t written;     /* Blocks written, to place the stalls */
+    uint32_t erase_st;    /* CMD32 argument */
+    uint32_t erase_ed;    /* CMD33 argument */
+    uint8_t erase_set;    /* bit0:CMD32 seen, bit1:CMD33 seen */
+    uint8_t frame[6];     /* Command frame being received */
+    int flen;             /* Bytes of it received */
+    uint8_t blk[514];     /* Data block being received */
+    int blen;             /* Bytes of it received */
+    uint8_t out[600];     /* Bytes queued on MISO */
+    int opos;
+    int olen;
+} Card = {.fd = -1};
+
+static SPI_HandleTypeDef* Hspi; /* Handle the card is wired to */
+static SPI_TypeDef Regs;        /* Its register block */
+static const sd_emu_profile_t* Prof = &sd_emu_profile_ideal;
+static sd_emu_stats_t Stats;
+static uint64_t Now; /* Virtual time [ns] */
+
+static struct {
+    int busy;          /* Transfer in flight */
+    int fault;         /* SD_EMU_DMA_xxx for the transfer */
+    const uint8_t* tx; /* Memory side of the TX stream */
+    uint8_t* rx;       /* Memory side of the RX stream, 0:Transmit only */
+    uint16_t size;
+    uint64_t start;    /* Time the first byte starts */
+    uint64_t end;      /* Time the last byte is through */
+} Dma;
+static DMA_HandleTypeDef DmaRx, DmaTx;
+static DMA_Stream_TypeDef RxStream, TxStream;
+
+static void dma_poll(void);
+
+/*-----------------------------------------------------------------------*/
+/* Card helpers                                                          */
+/*-----------------------------------------------------------------------*/
+
+static uint8_t crc7(const uint8_t* p, int n)
+{
+    uint8_t crc = 0;
+
+    while (n--) {
+        uint8_t d = *p++;
+        for (int b = 0; b < 8; b++) {
+            crc <<= 1;
+            if ((d ^ crc) & 0x80)
+                crc ^= 0x09;
+            d <<= 1;
+        }
+    }
+    return crc & 0x7F;
+}
+
+static uint16_t crc16(const uint8_t* p, int n)
+{
+    uint16_t crc = 0;
+
+    while (n--) {
+        crc ^= (uint16_t)(*p++ << 8);
+        for (int b = 0; b < 8; b++)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021)
+                                 : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+static int sector_io(uint8_t* buf, uint32_t sect, int wr) /* 1:OK */
+{
+    off_t ofs = (off_t)sect * 512;
+
+    if (wr)
+        return pwrite(Card.fd, buf, 512, ofs) == 512;
+    return pread(Card.fd, buf, 512, ofs) == 512;
+}
+
+/* Queue a response after one NCR byte */
+static void respond(const uint8_t* r, int n)
+{
+    Card.out[0] = 0xFF;
+    memcpy(Card.out + 1, r, (size_t)n);
+    Card.opos = 0;
+    Card.olen = n + 1;
+}
+
+/* Queue R1 (plus extra response bytes) followed by a data block */
+static void respond_data(const uint8_t* r, int n, const uint8_t* d, int dn)
+{
+    uint16_t crc = crc16(d, dn);
+
+    respond(r, n);
+    Card.out[Card.olen++] = 0xFF; /* NAC */
+    Card.out[Card.olen++] = 0xFE;
+    memcpy(Card.out + Card.olen, d, (size_t)dn);
+    Card.olen += dn;
+    Card.out[Card.olen++] = (uint8_t)(crc >> 8);
+    Card.out[Card.olen++] = (uint8_t)crc;
+}
+
+static void respond1(uint8_t r1)
+{
+    respond(&r1, 1);
+}
+
+/* Convert a command argument into a block number */
+static uint8_t card_addr(uint32_t arg, uint32_t* sect) /* R1 error bits */
+{
+    if (Card.type == SD_EMU_SDHC) {
+        *sect = arg;
+    } else {
+        if (arg % 512)
+            return 0x20; /* Address error */
+        *sect = arg / 512;
+    }
+    return *sect < Card.sectors ? 0 : 0x40; /* Parameter error */
+}
+
+static void card_csd(uint8_t* csd)
+{
+    memset(csd, 0, 16);
+    csd[1] = 0x0E; /* TAAC */
+    csd[3] = 0x32; /* TRAN_SPEED 25MHz */
+    csd[4] = 0x5B; /* CCC */
+    csd[12] = 0x02; /* WRITE_BL_LEN 9 */
+    csd[13] = 0x40;
+    csd[15] = 0x01;
+
+    if (Card.type == SD_EMU_SDHC) { /* CSD ver 2: (C_SIZE + 1) * 512KiB */
+        uint32_t c_size = Card.sectors / 1024 - 1;
+
+        csd[0] = 0x40;
+        csd[5] = 0x59;
+        csd[7] = (uint8_t)((c_size >> 16) & 0x3F);
+        csd[8] = (uint8_t)(c_size >> 8);
+        csd[9] = (uint8_t)c_size;
+        csd[10] = 0x7F; /* ERASE_BLK_EN, SECTOR_SIZE 127 */
+        csd[11] = 0x80;
+    } else { /* CSD ver 1: (C_SIZE + 1) << (C_SIZE_MULT + 2 + READ_BL_LEN) */
+        uint32_t sh = 2, mult, bl, c_size;
+
+        while ((Card.sectors >> sh) > 4096)
+            sh++;
+        mult = sh - 2 > 7 ? 7 : sh - 2;
+        bl = 9 + sh - 2 - mult;
+        c_size = (Card.sectors >> sh) - 1;
+
+        csd[0] = Card.type == SD_EMU_MMC ? 0x90 : 0x00;
+        csd[5] = (uint8_t)(0x50 | bl);
+        csd[6] = (uint8_t)(c_size >> 10);
+        csd[7] = (uint8_t)(c_size >> 2);
+        csd[8] = (uint8_t)(c_size << 6);
+        csd[9] = (uint8_t)(mult >> 1);
+        csd[10] = (uint8_t)(mult << 7);
+        if (Card.type == SD_EMU_MMC) {
+            csd[10] |= 0x7C; /* ERASE_GRP_SIZE 31 */
+            csd[11] = 0xE3;  /* ERASE_GRP_MULT 31 */
+        } else {
+            csd[10] |= 0x7F; /* ERASE_BLK_EN, SECTOR_SIZE 127 */
+            csd[11] = 0x80;
+        }
+    }
+}
+
+/* Put the next block of a read transfer on MISO */
+static void card_load(void)
+{
+    uint8_t* p = Card.out;
+
+    Card.opos = 0;
+    if (Card.sect >= Card.sectors || !sector_io(p + 1, Card.sect, 0)) {
+        p[0] = 0x08; /* Error token: out of range */
+        Card.olen = 1;
+        Card.state = ST_CMD;
+        return;
+    }
+    uint16_t crc = crc16(p + 1, 512);
+    p[0] = 0xFE;
+    p[513] = (uint8_t)(crc >> 8);
+    p[514] = (uint8_t)crc;
+    Card.olen = 515;
+    Stats.blocks_read++;
+    Card.sect++;
+    if (Card.multi)
+        Card.loaded = 1;
+    else
+        Card.state = ST_CMD;
+}
+
+/* Accept a complete data block */
+static void card_store(void)
+{
+    uint8_t resp = 0x05; /* Data accepted */
+    uint32_t us = Prof->write_us;
+
+    if (Card.sect >= Card.sectors || !sector_io(Card.blk, Card.sect, 1)) {
+        resp = 0x0D; /* Write error */
+        Card.multi = 0;
+    } else {
+        Stats.blocks_written++;
+        Card.sect++;
+        if (Prof->stall_every && ++Card.written % Prof->stall_every == 0)
+            us = Prof->stall_us;
+    }
+    Card.out[0] = resp;
+    Card.opos = 0;
+    Card.olen = 1;
+    Card.busy = Now + (uint64_t)us * 1000;
+    Card.state = Card.multi ? ST_WTOKEN : ST_CMD;
+}
+
+static void card_erase(void)
+{
+    uint8_t buf[512];
+    uint32_t st, ed, sect;
+
+    memset(buf, Card.erased, sizeof buf);
+    if (card_addr(Card.erase_st, &st) || card_addr(Card.erase_ed, &ed) ||
+        ed < st) {
+        respond1(0x40);
+        return;
+    }
+    for (sect = st; sect <= ed; sect++)
+        sector_io(buf, sect, 1);
+    respond1(0x00);
+    Card.busy = Now + (uint64_t)Prof->erase_us * 1000;
+}
+
+/* Execute the received command frame */
+static void card_cmd(void)
+{
+    uint8_t cmd = Card.frame[0] & 0x3F, r1, r[5], reg[64];
+    uint32_t arg = (uint32_t)Card.frame[1] << 24 | (uint32_t)Card.frame[2] << 16 |
+                   (uint32_t)Card.frame[3] << 8 | Card.frame[4];
+    int app = Card.app, sd = Card.type != SD_EMU_MMC;
+    int v2 = Card.type == SD_EMU_SDHC || Card.type == SD_EMU_SDSC;
+
+    Card.app = 0;
+    if (Card.state == ST_READ && cmd != 12) {
+        Stats.errors++; /* Only CMD12 is recognized while sending data */
+        return;
+    }
+
+    if (cmd == 0) {
+        if (!Card.spi && Card.clocks < 74) {
+            Stats.errors++; /* Not powered up with 74 clocks */
+            return;
+        }
+        if (crc7(Card.frame, 5) != Card.frame[5] >> 1) {
+            Stats.errors++; /* CMD0 is always CRC checked */
+            if (Card.spi)
+                respond1(0x09);
+            return;
+        }
+        Card.spi = 1;
+        Card.idle = 1;
+        Card.init_end = Now + (uint64_t)Prof->init_us * 1000;
+        Card.state = ST_CMD;
+        Card.multi = 0;
+        Card.erase_set = 0;
+        Stats.cmds++;
+        respond1(0x01);
+        return;
+    }
+    if (!Card.spi)
+        return; /* Still in SD mode, nothing on MISO */
+
+    Stats.cmds++;
+    r1 = Card.idle ? 0x01 : 0x00;
+    if (Card.idle && !(cmd == 1 || cmd == 8 || cmd == 55 || cmd == 58 ||
+                       (app && cmd == 41))) {
+        respond1(r1 | 0x04); /* Illegal in idle state */
+        return;
+    }
+
+    switch (app ? 0x80 | cmd : cmd) {
+        case 1: /* SEND_OP_COND (MMC) */
+        case 0x80 | 41: /* SEND_OP_COND (SDC) */
+            if ((cmd == 1) == sd) {
+                respond1(r1 | 0x04);
+                break;
+            }
+            if (Now >= Card.init_end &&
+                (Card.type != SD_EMU_SDHC || (arg & (1UL << 30))))
+                Card.idle = 0; /* SDHC stays idle without HCS */
+            respond1(Card.idle ? 0x01 : 0x00);
+            break;
+
+        case 8: /* SEND_IF_COND */
+            if (!v2) {
+                respond1(r1 | 0x04);
+            } else if (crc7(Card.frame, 5) != Card.frame[5] >> 1) {
+                Stats.errors++;
+                respond1(r1 | 0x08);
+            } else {
+                r[0] = r1;
+                r[1] = 0;
+                r[2] = 0;
+                r[3] = (uint8_t)((arg >> 8) & 0x0F); /* Voltage accepted */
+                r[4] = (uint8_t)arg;                 /* Check pattern */
+                respond(r, 5);
+            }
+            break;
+
+        case 9:  /* SEND_CSD */
+        case 10: /* SEND_CID */
+            card_csd(reg);
+            if (cmd == 10)
+                memcpy(reg, "\x03SDEMU\x10\x01\x02\x03\x04\x00\x11\x0A\x01", 16);
+            respond_data(&r1, 1, reg, 16);
+            break;
+
+        case 12: /* STOP_TRANSMISSION */
+            if (Card.state == ST_READ) {
+                Card.state = ST_CMD;
+                Card.multi = 0;
+                Card.loaded = 0;
+                Card.out[0] = 0xFF; /* Stuff byte */
+                Card.out[1] = 0xFF;
+                Card.out[2] = r1;
+                Card.opos = 0;
+                Card.olen = 3;
+                Card.busy = Now + (uint64_t)Prof->stop_us * 1000;
+            } else {
+                respond1(r1);
+            }
+            break;
+
+        case 0x80 | 13: /* SD_STATUS */
+            memset(reg, 0, 64);
+            reg[10] = 0x90; /* AU_SIZE 4MiB */
+            r[0] = r1;
+            r[1] = 0x00;
+            respond_data(r, 2, reg, 64);
+            break;
+
+        case 16: /* SET_BLOCKLEN */
+            respond1(arg == 512 || Card.type == SD_EMU_SDHC ? r1 : r1 | 0x40);
+            break;
+
+        case 17: /* READ_SINGLE_BLOCK */
+        case 18: /* READ_MULTIPLE_BLOCK */
+            if ((r[0] = card_addr(arg, &Card.sect)) != 0) {
+                respond1(r1 | r[0]);
+                break;
+            }
+            respond1(r1);
+            Card.state = ST_READ;
+            Card.multi = cmd == 18;
+            Card.loaded = 0;
+            Card.data = Now + (uint64_t)Prof->read_us * 1000;
+            break;
+
+        case 0x80 | 23: /* SET_WR_BLK_ERASE_COUNT */
+            respond1(r1);
+            break;
+
+        case 24: /* WRITE_BLOCK */
+        case 25: /* WRITE_MULTIPLE_BLOCK */
+            if ((r[0] = card_addr(arg, &Card.sect)) != 0) {
+                respond1(r1 | r[0]);
+                break;
+            }
+            respond1(r1);
+            Card.state = ST_WTOKEN;
+            Card.multi = cmd == 25;
+            break;
+
+        case 32: /* ERASE_WR_BLK_START */
+        case 33: /* ERASE_WR_BLK_END */
+            if (!sd) {
+                respond1(r1 | 0x04);
+                break;
+            }
+            if (cmd == 32) {
+                Card.erase_st = arg;
+                Card.erase_set = 1;
+            } else {
+                Card.erase_ed = arg;
+                Card.erase_set |= 2;
+            }
+            respond1(r1);
+            break;
+
+        case 38: /* ERASE */
+            if (Card.erase_set != 3) {
+                respond1(r1 | 0x10); /* Erase sequence error */
+            } else {
+                card_erase();
+            }
+            Card.erase_set = 0;
+            break;
+
+        case 0x80 | 51: /* SEND_SCR */
+            memset(reg, 0, 8);
+            reg[0] = v2 ? 0x02 : 0x01;
+            reg[1] = (uint8_t)(0x05 | (Card.erased ? 0x80 : 0x00));
+            respond_data(&r1, 1, reg, 8);
+            break;
+
+        case 55: /* APP_CMD */
+            if (!sd) {
+                respond1(r1 | 0x04);
+                break;
+            }
+            Card.app = 1;
+            respond1(r1);
+            break;
+
+        case 58: /* READ_OCR */
+            r[0] = r1;
+            r[1] = Card.idle ? 0x00 : 0x80; /* Power up status */
+            if (!Card.idle && Card.type == SD_EMU_SDHC)
+                r[1] |= 0x40; /* CCS */
+            r[2] = 0xFF; /* 2.7-3.6V */
+            r[3] = 0x80;
+            r[4] = 0x00;
+            respond(r, 5);
+            break;
+
+        default:
+            respond1(r1 | 0x04); /* Illegal command */
+    }
+}
+
+/* Clock one byte through the card */
+static uint8_t card_xchg(uint8_t in)
+{
+    uint8_t out = 0xFF;
+
+    if (!Card.inserted)
+        return 0xFF;
+    if (!Card.selected) {
+        if (!Card.spi)
+            Card.clocks += 8;
+        return 0xFF;
+    }
+
+    /* MISO */
+    if (Card.opos < Card.olen) {
+        out = Card.out[Card.opos++];
+        if (Card.opos == Card.olen && Card.loaded) {
+            Card.loaded = 0; /* Next block of the CMD18 transfer */
+            Card.data = Now + (uint64_t)Prof->read_next_us * 1000;
+        }
+    } else if (Now < Card.busy) {
+        out = 0x00;
+        Stats.wait_bytes++;
+    } else if (Card.state == ST_READ) {
+        if (Now >= Card.data) {
+            card_load();
+            out = Card.out[Card.opos++];
+        } else {
+            Stats.wait_bytes++;
+        }
+    }
+
+    /* MOSI */
+    switch (Card.state) {
+        case ST_WDATA:
+            Card.blk[Card.blen++] = in;
+            if (Card.blen == 514)
+                card_store(); /* Data response goes out next */
+            break;
+
+        case ST_WTOKEN:
+            if (in == 0xFF)
+                break;
+            if (Now < Card.busy || Card.opos < Card.olen) {
+                Stats.errors++; /* Token while busy */
+            } else if (in == (Card.multi ? 0xFC : 0xFE)) {
+                Card.state = ST_WDATA;
+                Card.blen = 0;
+            } else if (in == 0xFD && Card.multi) { /* Stop tran */
+                Card.state = ST_CMD;
+                Card.multi = 0;
+                Card.busy = Now + (uint64_t)Prof->stop_us * 1000;
+            } else {
+                Stats.errors++;
+            }
+            break;
+
+        default:
+            if (Card.flen) {
+                Card.frame[Card.flen++] = in;
+                if (Card.flen == 6) {
+                    Card.flen = 0;
+                    card_cmd();
+                }
+            } else if ((in & 0xC0) == 0x40) {
+                if (Now < Card.busy && Card.opos >= Card.olen)
+                    Stats.errors++; /* Command while busy */
+                else
+                    Card.frame[Card.flen++] = in;
+            }
+    }
+
+    return out;
+}
+
+static void card_power(void)
+{
+    int fd = Card.fd;
+    uint32_t sectors = Card.sectors;
+    sd_emu_card_t type = Card.type;
+    uint8_t erased = Card.erased;
+
+    memset(&Card, 0, sizeof Card);
+    Card.fd = fd;
+    Card.sectors = sectors;
+    Card.type = type;
+    Card.erased = erased;
+    Card.inserted = 1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* HAL stand-ins                                                         */
+/*-----------------------------------------------------------------------*/
+
+/* Time one byte takes at the prescaler currently set in CR1 */
+static uint64_t byte_ns(void)
+{
+    uint32_t br = (Regs.CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos;
+
+    return 8ULL * 1000000000ULL * (2U << br) / Prof->pclk_hz;
+}
+
+static void spi_count(uint16_t size)
+{
+    Stats.spi_calls++;
+    Stats.spi_bytes += size;
+    Stats.spi_sizes[size >= 512 ? 3 : size >= 16 ? 2 : size >= 2 ? 1 : 0]++;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef* hspi,
+                                          const uint8_t* pTxData,
+                                          uint8_t* pRxData,
+                                          uint16_t Size,
+                                          uint32_t Timeout)
+{
+    uint64_t bt = byte_ns();
+
+    (void)Timeout;
+    dma_poll();
+    if (hspi != Hspi || !pTxData || !pRxData || !Size)
+        return HAL_ERROR;
+    if (hspi->State != HAL_SPI_STATE_READY)
+        return HAL_BUSY;
+
+    Now += Prof->hal_ns;
+    spi_count(Size);
+    for (uint16_t i = 0; i < Size; i++) {
+        uint8_t d = pTxData[i]; /* May be the receive buffer itself */
+        Now += bt;
+        pRxData[i] = card_xchg(d);
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* hspi,
+                                   const uint8_t* pData,
+                                   uint16_t Size,
+                                   uint32_t Timeout)
+{
+    uint64_t bt = byte_ns();
+
+    (void)Timeout;
+    dma_poll();
+    if (hspi != Hspi || !pData || !Size)
+        return HAL_ERROR;
+    if (hspi->State != HAL_SPI_STATE_READY)
+        return HAL_BUSY;
+
+    Now += Prof->hal_ns;
+    spi_count(Size);
+    for (uint16_t i = 0; i < Size; i++) {
+        Now += bt;
+        card_xchg(pData[i]);
+    }
+    return HAL_OK;
+}
+
+/* Complete the DMA transfer once its last byte is through */
+static void dma_poll(void)
+{
+    SPI_HandleTypeDef* hspi = Hspi;
+    uint64_t now = Now, bt;
+    int minc;
+
+    if (!Dma.busy || Dma.fault == SD_EMU_DMA_STALL || Now < Dma.end)
+        return;
+
+    /* Replay the bytes at the time they went over the bus */
+    bt = byte_ns();
+    minc = (hspi->hdmatx->Instance->CR & DMA_SxCR_MINC) != 0;
+    Now = Dma.start;
+    for (uint16_t i = 0; i < Dma.size; i++) {
+        uint8_t d = Dma.tx[minc ? i : 0];
+        Now += bt;
+        d = card_xchg(d);
+        if (Dma.rx)
+            Dma.rx[i] = d;
+    }
+    Now = now;
+    Dma.busy = 0;
+
+    hspi->State = HAL_SPI_STATE_READY;
+    hspi->TxXferCount = 0;
+    hspi->RxXferCount = 0;
+    if (Dma.fault == SD_EMU_DMA_ERROR) {
+        hspi->ErrorCode = HAL_SPI_ERROR_DMA;
+#if USE_HAL_SPI_REGISTER_CALLBACKS == 1
+        hspi->ErrorCallback(hspi);
+#else
+        HAL_SPI_ErrorCallback(hspi);
+#endif
+    } else if (Dma.rx) {
+#if USE_HAL_SPI_REGISTER_CALLBACKS == 1
+        hspi->TxRxCpltCallback(hspi);
+#else
+        HAL_SPI_TxRxCpltCallback(hspi);
+#endif
+    } else {
+#if USE_HAL_SPI_REGISTER_CALLBACKS == 1
+        hspi->TxCpltCallback(hspi);
+#else
+        HAL_SPI_TxCpltCallback(hspi);
+#endif
+    }
+    Dma.fault = SD_EMU_DMA_OK;
+}
+
+static HAL_StatusTypeDef dma_start(SPI_HandleTypeDef* hspi,
+                                   const uint8_t* tx,
+                                   uint8_t* rx,
+                                   uint16_t size)
+{
+    dma_poll();
+    if (hspi != Hspi || !tx || !size || !hspi->hdmatx || (rx && !hspi->hdmarx))
+        return HAL_ERROR;
+    if (hspi->State != HAL_SPI_STATE_READY)
+        return HAL_BUSY;
+
+    Now += Prof->hal_ns;
+    spi_count(size);
+    Stats.dma_calls++;
+    hspi->State = rx ? HAL_SPI_STATE_BUSY_TX_RX : HAL_SPI_STATE_BUSY_TX;
+    hspi->ErrorCode = HAL_SPI_ERROR_NONE;
+    hspi->pTxBuffPtr = tx;
+    hspi->pRxBuffPtr = rx;
+    hspi->TxXferSize = hspi->TxXferCount = size;
+    hspi->RxXferSize = hspi->RxXferCount = rx ? size : 0;
+    Dma.busy = 1;
+    Dma.tx = tx;
+    Dma.rx = rx;
+    Dma.size = size;
+    Dma.start = Now;
+    Dma.end = Now + byte_ns() * size;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef* hspi,
+                                       const uint8_t* pData,
+                                       uint16_t Size)
+{
+    return dma_start(hspi, pData, 0, Size);
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef* hspi,
+                                              const uint8_t* pTxData,
+                                              uint8_t* pRxData,
+                                              uint16_t Size)
+{
+    if (!pRxData)
+        return HAL_ERROR;
+    return dma_start(hspi, pTxData, pRxData, Size);
+}
+
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef* hspi)
+{
+    if (hspi != Hspi)
+        return HAL_ERROR;
+
+    Now += Prof->hal_ns;
+    Stats.aborts++;
+    Dma.busy = 0; /* The bytes never reach the card or the buffer */
+    Dma.fault = SD_EMU_DMA_OK;
+    hspi->State = HAL_SPI_STATE_READY;
+    hspi->ErrorCode = HAL_SPI_ERROR_NONE;
+    return HAL_OK;
+}
+
+#if USE_HAL_SPI_REGISTER_CALLBACKS == 1
+HAL_StatusTypeDef HAL_SPI_RegisterCallback(SPI_HandleTypeDef* hspi,
+                                           HAL_SPI_CallbackIDTypeDef CallbackID,
+                                           pSPI_CallbackTypeDef pCallback)
+{
+    switch (CallbackID) {
+        case HAL_SPI_TX_COMPLETE_CB_ID:
+            hspi->TxCpltCallback = pCallback;
+            break;
+        case HAL_SPI_TX_RX_COMPLETE_CB_ID:
+            hspi->TxRxCpltCallback = pCallback;
+            break;
+        case HAL_SPI_ERROR_CB_ID:
+            hspi->ErrorCallback = pCallback;
+            break;
+        default:
+            return HAL_ERROR;
+    }
+    return HAL_OK;
+}
+#else
+/* Defaults of the HAL, the application overrides them */
+__weak void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef* hspi)
+{
+    (void)hspi;
+}
+
+__weak void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef* hspi)
+{
+    (void)hspi;
+}
+
+__weak void HAL_SPI_ErrorCallback(SPI_HandleTypeDef* hspi)
+{
+    (void)hspi;
+}
+#endif
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* GPIOx,
+                       uint16_t GPIO_Pin,
+                       GPIO_PinState PinState)
+{
+    Now += Prof->hal_ns;
+    Stats.gpio_calls++;
+    dma_poll();
+    if (GPIOx == SD_CS_GPIO_Port && GPIO_Pin == SD_CS_Pin) {
+        Card.selected = PinState == GPIO_PIN_RESET;
+        if (!Card.selected)
+            Card.flen = 0; /* A partial frame is dropped */
+    }
+}
+
+uint32_t HAL_GetTick(void)
+{
+    Now += Prof->tick_ns;
+    Stats.tick_calls++;
+    dma_poll();
+    return (uint32_t)(Now / 1000000);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Emulator control                                                      */
+/*-----------------------------------------------------------------------*/
+
+int sd_emu_create(const char* image, uint32_t sectors)
+{
+    int fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int res;
+
+    if (fd < 0)
+        return -1;
+    res = ftruncate(fd, (off_t)sectors * 512);
+    close(fd);
+    return res;
+}
+
+int sd_emu_open(SPI_HandleTypeDef* hspi, const sd_emu_config_t* config)
+{
+    struct stat st;
+
+    sd_emu_close();
+    Card.fd = open(config->image, O_RDWR);
+    if (Card.fd < 0)
+        return -1;
+    if (fstat(Card.fd, &st) || st.st_size < 512 * 1024) {
+        sd_emu_close();
+        return -1;
+    }
+    Card.sectors = (uint32_t)(st.st_size / 512);
+    Card.type = config->card;
+    Card.erased = config->erased;
+    card_power();
+
+    Prof = config->profile ? config->profile : &sd_emu_profile_ideal;
+    Now = 0;
+    memset(&Stats, 0, sizeof Stats);
+
+    /* What MX_SPI3_Init leaves behind: master, 8 bit, mode 0, PCLK/128 */
+    memset(&Regs, 0, sizeof Regs);
+    Regs.CR1 = SPI_CR1_MSTR | SPI_CR1_SSM | SPI_CR1_SSI |
+               SPI_BAUDRATEPRESCALER_128 | SPI_CR1_SPE;
+    memset(hspi, 0, sizeof *hspi);
+    hspi->Instance = &Regs;
+    hspi->Init.Mode = SPI_MODE_MASTER;
+    hspi->Init.Direction = SPI_DIRECTION_2LINES;
+    hspi->Init.DataSize = SPI_DATASIZE_8BIT;
+    hspi->Init.NSS = SPI_NSS_SOFT;
+    hspi->Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_128;
+    hspi->State = HAL_SPI_STATE_READY;
+    Hspi = hspi;
+
+    /* What MX_DMA_Init and HAL_SPI_MspInit link: byte wide, memory
+       increment, peripheral to memory (RX) and memory to peripheral (TX) */
+    memset(&Dma, 0, sizeof Dma);
+    if (config->dma) {
+        memset(&DmaRx, 0, sizeof DmaRx);
+        memset(&DmaTx, 0, sizeof DmaTx);
+        RxStream.CR = DMA_SxCR_MINC;
+        TxStream.CR = DMA_SxCR_MINC | DMA_SxCR_DIR_0;
+        DmaRx.Instance = &RxStream;
+        DmaTx.Instance = &TxStream;
+        __HAL_LINKDMA(hspi, hdmarx, DmaRx);
+        __HAL_LINKDMA(hspi, hdmatx, DmaTx);
+    }
+
+    return 0;
+}
+
+void sd_emu_close(void)
+{
+    if (Card.fd >= 0)
+        close(Card.fd);
+    memset(&Card, 0, sizeof Card);
+    Card.fd = -1;
+    Hspi = 0;
+}
+
+void sd_emu_insert(int inserted)
+{
+    if (inserted)
+        card_power();
+    else
+        Card.inserted = 0;
+}
+
+void sd_emu_dma_fault(int fault)
+{
+    Dma.fault = fault;
+}
+
+void sd_emu_get_stats(sd_emu_stats_t* stats)
+{
+    *stats = Stats;
+}
+
+void sd_emu_reset_stats(void)
+{
+    memset(&Stats, 0, sizeof Stats);
+}
+
+uint64_t sd_emu_time_ns(void)
+{
+    return Now;
+}
+
+void sd_emu_advance(uint64_t ns)
+{
+    Now += ns;
+}
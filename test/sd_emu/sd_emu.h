@@ -0,0 +1,110 @@
+/**
+ ******************************************************************************
+ * @file    sd_emu.h
+ * @brief   Host stand-in for the SPI3/GPIO HAL with an SD card in SPI mode
+ *          behind it, so that user_diskio_spi.c and everything stacked on it
+ *          runs unmodified on Linux
+ ******************************************************************************
+ */
+
+#ifndef SD_EMU_H
+#define SD_EMU_H
+
+#include "stm32f4xx_hal.h"
+#include <stdint.h>
+
+// The emulator provides HAL_SPI_TransmitReceive, HAL_SPI_Transmit,
+// HAL_GPIO_WritePin and HAL_GetTick. Time is virtual: it advances by the SPI
+// clock for every byte on the bus and by the profile's CPU costs for every HAL
+// call, so results do not depend on the host and are repeatable.
+//
+// HAL_SPI_TransmitReceive_DMA, HAL_SPI_Transmit_DMA and HAL_SPI_Abort move
+// the bytes in the background instead: the CPU only pays for starting the
+// transfer, and the completion callbacks run from the first HAL_GetTick (or
+// other HAL call) after the last byte would have been clocked, the way the
+// DMA interrupt would preempt the code polling for it. The buffers are only
+// read and written at that point, and the TX stream honours DMA_SxCR_MINC.
+
+typedef enum {
+    SD_EMU_SDHC, /* SD ver 2, block addressing (CCS set in the OCR) */
+    SD_EMU_SDSC, /* SD ver 2, byte addressing */
+    SD_EMU_SDV1, /* SD ver 1, rejects CMD8 */
+    SD_EMU_MMC,  /* MMC ver 3, rejects CMD55 and is initialized by CMD1 */
+} sd_emu_card_t;
+
+typedef struct {
+    uint32_t init_us;      /* ACMD41/CMD1 report idle this long after CMD0 */
+    uint32_t read_us;      /* CMD17/CMD18 to the first data token */
+    uint32_t read_next_us; /* Between the blocks of a CMD18 transfer */
+    uint32_t write_us;     /* Busy after each accepted block */
+    uint32_t stall_every;  /* Every n-th block is busy for stall_us, 0:Never */
+    uint32_t stall_us;     /* Busy of a stalled block (e.g. a GC pass) */
+    uint32_t stop_us;      /* Busy after the stop token or CMD12 */
+    uint32_t erase_us;     /* Busy after CMD38 */
+    uint32_t hal_ns;       /* CPU time of one HAL_SPI_x/HAL_GPIO_x call */
+    uint32_t tick_ns;      /* CPU time of one HAL_GetTick call */
+    uint32_t pclk_hz;      /* SPI kernel clock, divided by the CR1 prescaler */
+} sd_emu_profile_t;
+
+// Card timing profiles: a card that never makes the host wait, a typical
+// class 10 card and a worn card with long garbage collection stalls
+extern const sd_emu_profile_t sd_emu_profile_ideal;
+extern const sd_emu_profile_t sd_emu_profile_typical;
+extern const sd_emu_profile_t sd_emu_profile_slow;
+
+typedef struct {
+    const char* image;                /* Image file holding the card data */
+    sd_emu_card_t card;               /* Kind of card to emulate */
+    const sd_emu_profile_t* profile;  /* Timing, 0:sd_emu_profile_ideal */
+    uint8_t erased;                   /* Read back from erased blocks */
+    int dma;                          /* Link DMA streams to the handle */
+} sd_emu_config_t;
+
+/* Faults injected into the next DMA transfer (SD_EMU_DMA_xxx) */
+#define SD_EMU_DMA_OK 0    /* Completes normally */
+#define SD_EMU_DMA_ERROR 1 /* Ends with HAL_SPI_ErrorCallback */
+#define SD_EMU_DMA_STALL 2 /* Never completes, only HAL_SPI_Abort ends it */
+
+// Number of transfer size classes counted in sd_emu_stats_t
+#define SD_EMU_SIZES 4 /* 1 byte, 2..15, 16..511, 512 or more */
+
+typedef struct {
+    uint32_t spi_calls;              /* HAL_SPI_x transfers */
+    uint32_t dma_calls;              /* Of them started by HAL_SPI_x_DMA */
+    uint32_t spi_bytes;              /* Bytes moved by them */
+    uint32_t spi_sizes[SD_EMU_SIZES]; /* Transfers by size class */
+    uint32_t gpio_calls;             /* HAL_GPIO_WritePin */
+    uint32_t tick_calls;             /* HAL_GetTick */
+    uint32_t cmds;                   /* Command frames accepted by the card */
+    uint32_t blocks_read;            /* Data blocks sent by the card */
+    uint32_t blocks_written;         /* Data blocks accepted by the card */
+    uint32_t wait_bytes;             /* Bytes clocked while the card was busy
+                                        or had no data ready yet */
+    uint32_t errors;                 /* Protocol violations seen by the card */
+    uint32_t aborts;                 /* HAL_SPI_Abort */
+} sd_emu_stats_t;
+
+// Creates a zero filled image file of the given size
+extern int sd_emu_create(const char* image, uint32_t sectors); /* 0:OK */
+
+// Powers up a card backed by config->image on the SPI handle, which gets
+// a host register block and the state HAL_SPI_Init would leave it in
+extern int sd_emu_open(SPI_HandleTypeDef* hspi,
+                       const sd_emu_config_t* config); /* 0:OK */
+extern void sd_emu_close(void);
+
+// Removes the card from the socket or puts it back (and powers it up)
+extern void sd_emu_insert(int inserted);
+
+extern void sd_emu_get_stats(sd_emu_stats_t* stats);
+extern void sd_emu_reset_stats(void);
+
+extern void sd_emu_dma_fault(int fault);
+
+// Virtual time since sd_emu_open
+extern uint64_t sd_emu_time_ns(void);
+
+// Lets virtual time pass, e.g. for work the application does in between
+extern void sd_emu_advance(uint64_t ns);
+
+#endif
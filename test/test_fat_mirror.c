@@ -0,0 +1,139 @@
+/**
+ ******************************************************************************
+ * @file    test_fat_mirror.c
+ * @brief   Deferred FAT mirroring on a FAT32 volume with two FATs: the FAT
+ *          sectors changed in more separate ranges than the table of
+ *          _LAZYMIRROR_RANGES holds reach the second FAT at f_sync, f_close
+ *          and unmount
+ ******************************************************************************
+ */
+
+#include "board.h"
+#include "fatfs.h"
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "test_fat_mirror.img"
+#define HOLE_EVERY 512 /* One free cluster in this many, 4 FAT sectors apart */
+#define APPEND 12      /* Clusters appended between the checks */
+
+static BYTE Work[_MAX_SS];
+static BYTE Buf[_MAX_SS];
+
+// f_mkfs makes a single FAT: declare a second one in the BPB, which takes the
+// place of the first data sectors, and drop the free cluster count that no
+// longer holds
+static void add_fat(DWORD vol)
+{
+    DWORD fsinfo;
+
+    CHECK(disk_read(0, Work, vol, 1) == RES_OK);
+    CHECK(Work[16] == 1); /* BPB_NumFATs */
+    Work[16] = 2;
+    fsinfo = vol + (Work[48] | Work[49] << 8); /* BPB_FSInfo32 */
+    CHECK(disk_write(0, Work, vol, 1) == RES_OK);
+    CHECK(disk_read(0, Work, fsinfo, 1) == RES_OK);
+    memset(Work + 488, 0xFF, 4); /* FSI_Free_Count */
+    CHECK(disk_write(0, Work, fsinfo, 1) == RES_OK);
+    CHECK(disk_ioctl(0, CTRL_SYNC, 0) == RES_OK);
+}
+
+// Leaves one cluster in HOLE_EVERY free in the first FAT, so that clusters
+// appended one by one change FAT sectors apart from each other, then copies
+// it to the second FAT and clears the root directory in its new place
+static void fragment(FATFS* fs)
+{
+    for (DWORD s = 0; s < fs->fsize; s++) {
+        CHECK(disk_read(0, Work, fs->fatbase + s, 1) == RES_OK);
+        for (UINT i = 0; i < 128; i++) {
+            DWORD clst = s * 128 + i, val;
+
+            if (clst < 3 || clst >= fs->n_fatent) /* Reserved, root directory */
+                continue;
+            val = clst % HOLE_EVERY ? 0x0FFFFFFF : 0;
+            Work[i * 4] = (BYTE)val;
+            Work[i * 4 + 1] = (BYTE)(val >> 8);
+            Work[i * 4 + 2] = (BYTE)(val >> 16);
+            Work[i * 4 + 3] = (BYTE)(val >> 24);
+        }
+        CHECK(disk_write(0, Work, fs->fatbase + s, 1) == RES_OK);
+        CHECK(disk_write(0, Work, fs->fatbase + fs->fsize + s, 1) == RES_OK);
+    }
+    memset(Work, 0, sizeof Work);
+    CHECK(disk_write(0, Work, fs->database, 1) == RES_OK);
+    CHECK(disk_ioctl(0, CTRL_SYNC, 0) == RES_OK);
+}
+
+static int fats_equal(FATFS* fs)
+{
+    for (DWORD s = 0; s < fs->fsize; s++) {
+        CHECK(disk_read(0, Work, fs->fatbase + s, 1) == RES_OK);
+        CHECK(disk_read(0, Buf, fs->fatbase + fs->fsize + s, 1) == RES_OK);
+        if (memcmp(Work, Buf, sizeof Work))
+            return 0;
+    }
+    return 1;
+}
+
+static void append(FIL* fp)
+{
+    UINT bw;
+
+    memset(Buf, 0x5A, sizeof Buf);
+    for (int i = 0; i < APPEND; i++)
+        CHECK(f_write(fp, Buf, sizeof Buf, &bw) == FR_OK && bw == sizeof Buf);
+}
+
+int main(void)
+{
+    FIL* fp = &USERFile;
+    FATFS* fs = &USERFatFS;
+    DWORD nfree;
+
+    board_card(IMAGE, 131072, SD_EMU_SDHC, &sd_emu_profile_typical, 0);
+    MX_FATFS_Init();
+    CHECK(retUSER == 0);
+    CHECK(f_mkfs(USERPath, FM_FAT32, 512, Work, sizeof Work) == FR_OK);
+    CHECK(f_mount(fs, USERPath, 1) == FR_OK);
+    add_fat(fs->volbase);
+    CHECK(f_mount(fs, USERPath, 1) == FR_OK);
+    CHECK(fs->fs_type == FS_FAT32 && fs->n_fats == 2 && fs->csize == 1);
+    fragment(fs);
+    CHECK(f_mount(fs, USERPath, 1) == FR_OK);
+    CHECK(f_getfree(USERPath, &nfree, &fs) == FR_OK);
+    CHECK(nfree > 3 * APPEND);
+    CHECK(fats_equal(fs));
+
+    /* The table overflows and its ranges are widened, nothing is lost */
+    CHECK(f_open(fp, "a.bin", FA_WRITE | FA_CREATE_NEW) == FR_OK);
+    append(fp);
+    CHECK(fs->mrcnt == _LAZYMIRROR_RANGES);
+    CHECK(!fats_equal(fs));
+    CHECK(f_sync(fp) == FR_OK);
+    CHECK(fs->mrcnt == 0);
+    CHECK(fats_equal(fs));
+
+    append(fp);
+    CHECK(!fats_equal(fs));
+    CHECK(f_close(fp) == FR_OK);
+    CHECK(fats_equal(fs));
+
+    /* Unmounted with the file still open */
+    CHECK(f_open(fp, "b.bin", FA_WRITE | FA_CREATE_NEW) == FR_OK);
+    append(fp);
+    CHECK(fs->mrcnt != 0);
+    CHECK(f_mount(0, USERPath, 0) == FR_OK);
+    CHECK(fats_equal(fs));
+
+    /* The second FAT is a valid copy of a volume that is consistent */
+    CHECK(f_mount(fs, USERPath, 1) == FR_OK);
+    CHECK(f_open(fp, "a.bin", FA_READ) == FR_OK);
+    CHECK(f_size(fp) == 2 * APPEND * sizeof Buf);
+    CHECK(f_close(fp) == FR_OK);
+    CHECK(f_mount(0, USERPath, 0) == FR_OK);
+
+    sd_emu_close();
+    unlink(IMAGE);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,388 @@
+/**
+ ******************************************************************************
+ * @file    test_fatfs.c
+ * @brief   FatFs through the disk layer stack of MX_FATFS_Init on an emulated
+ *          SDHC card, including a power cycle of the card
+ ******************************************************************************
+ */
+
+#include "board.h"
+#include "fatfs.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "test_fatfs.img"
+#define BIG_SIZE (1024UL * 1024)
+#define CHUNK 4096
+#define LIST_FILES 110 /* Files made in the directory read by f_readdirn */
+
+static BYTE Work[_MAX_SS];
+static BYTE Buf[CHUNK];
+
+static void fill(BYTE* p, UINT n, DWORD ofs)
+{
+    for (UINT i = 0; i < n; i++)
+        p[i] = (BYTE)((ofs + i) * 2654435761UL >> 24);
+}
+
+static void write_files(void)
+{
+    FIL* fp = &USERFile;
+    UINT bw;
+    char name[16];
+    double t0;
+
+    t0 = board_ms();
+    CHECK(f_open(fp, "big.bin", FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    for (DWORD ofs = 0; ofs < BIG_SIZE; ofs += CHUNK) {
+        fill(Buf, CHUNK, ofs);
+        CHECK(f_write(fp, Buf, CHUNK, &bw) == FR_OK && bw == CHUNK);
+    }
+    CHECK(f_close(fp) == FR_OK);
+    printf("write 1 MiB: %.1f ms\n", board_ms() - t0);
+
+    for (int i = 0; i < 20; i++) {
+        snprintf(name, sizeof name, "small%02d.txt", i);
+        CHECK(f_open(fp, name, FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+        CHECK(f_printf(fp, "file %d\n", i) > 0);
+        CHECK(f_close(fp) == FR_OK);
+    }
+}
+
+static void read_files(void)
+{
+    static BYTE ref[CHUNK];
+    FIL* fp = &USERFile;
+    UINT br;
+    char name[16], line[32], want[32];
+    double t0;
+
+    t0 = board_ms();
+    CHECK(f_open(fp, "big.bin", FA_READ) == FR_OK);
+    CHECK(f_size(fp) == BIG_SIZE);
+    for (DWORD ofs = 0; ofs < BIG_SIZE; ofs += CHUNK) {
+        CHECK(f_read(fp, Buf, CHUNK, &br) == FR_OK && br == CHUNK);
+        fill(ref, CHUNK, ofs);
+        CHECK(memcmp(Buf, ref, CHUNK) == 0);
+    }
+    CHECK(f_close(fp) == FR_OK);
+    printf("read 1 MiB: %.1f ms\n", board_ms() - t0);
+
+    for (int i = 0; i < 20; i++) {
+        snprintf(name, sizeof name, "small%02d.txt", i);
+        snprintf(want, sizeof want, "file %d\n", i);
+        CHECK(f_open(fp, name, FA_READ) == FR_OK);
+        CHECK(f_gets(line, sizeof line, fp));
+        CHECK(strcmp(line, want) == 0);
+        CHECK(f_close(fp) == FR_OK);
+    }
+}
+
+/* A file object dropped without f_close is never touched again, also when
+   another file takes the buffer it holds from the pool */
+static void check_dropped(void)
+{
+    FIL* dropped = malloc(sizeof(FIL));
+    FIL files[2];
+    UINT br;
+    char line[8];
+
+    CHECK(dropped);
+    CHECK(f_open(dropped, "small00.txt", FA_READ) == FR_OK);
+    CHECK(f_read(dropped, line, 7, &br) == FR_OK && br == 7);
+    free(dropped);
+
+    for (int i = 0; i < 2; i++)
+        CHECK(f_open(&files[i], "small00.txt", FA_READ) == FR_OK);
+    for (int n = 0; n < 2 * _FILEBUF_NUM; n++) {
+        FIL* fp = &files[n % 2];
+
+        CHECK(f_lseek(fp, 0) == FR_OK);
+        CHECK(f_read(fp, line, 7, &br) == FR_OK && br == 7);
+        CHECK(memcmp(line, "file 0", 6) == 0);
+    }
+    for (int i = 0; i < 2; i++)
+        CHECK(f_close(&files[i]) == FR_OK);
+}
+
+static void write_at(FIL* fp, DWORD ofs, UINT n)
+{
+    UINT bw;
+
+    fill(Buf, n, ofs);
+    CHECK(f_write(fp, Buf, n, &bw) == FR_OK && bw == n);
+}
+
+static void check_content(const char* name, DWORD size)
+{
+    static BYTE ref[CHUNK];
+    FIL* fp = &USERFile;
+    UINT br;
+
+    CHECK(f_open(fp, name, FA_READ) == FR_OK);
+    CHECK(f_size(fp) == size);
+    CHECK(f_read(fp, Buf, CHUNK, &br) == FR_OK && br == size);
+    fill(ref, size, 0);
+    CHECK(memcmp(Buf, ref, size) == 0);
+    CHECK(f_close(fp) == FR_OK);
+}
+
+/* f_getline returns the lines of the file without their line ends, a line
+   longer than the buffer in parts, with any size of the buffer */
+static void check_lines(void)
+{
+    static const UINT sizes[] = {16, 17, 40, 513, CHUNK};
+    static char text[1024], got[1024];
+    FIL* fp = &USERFile;
+    FLINE lr;
+    TCHAR* line;
+    const char *p, *end;
+    UINT n, len, glen, wlen;
+
+    n = snprintf(text, sizeof text, "first line\r\n\r\nlf only\n\n");
+    for (int i = 0; i < 700; i++) /* Longer than any buffer but the last */
+        text[n++] = 'a' + i % 26;
+    n += snprintf(text + n, sizeof text - n, "\r\nsome more text\r\nlast line");
+    CHECK(f_open(fp, "lines.txt", FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_write(fp, text, n, &len) == FR_OK && len == n);
+    CHECK(f_close(fp) == FR_OK);
+
+    CHECK(f_open(fp, "lines.txt", FA_READ) == FR_OK);
+    CHECK(f_lineopen(&lr, fp, Buf, 15) == FR_INVALID_PARAMETER);
+    CHECK(f_close(fp) == FR_OK);
+
+    for (UINT s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+        CHECK(f_open(fp, "lines.txt", FA_READ) == FR_OK);
+        CHECK(f_lineopen(&lr, fp, Buf, sizes[s]) == FR_OK);
+        p = text;
+        for (;;) {
+            glen = 0;
+            do { /* Join the parts of the line */
+                CHECK(f_getline(&lr, &line, &len) == FR_OK);
+                if (!line)
+                    break;
+                CHECK(len == strlen(line) && len < sizes[s]);
+                memcpy(got + glen, line, len);
+                glen += len;
+            } while (f_linepart(&lr));
+            if (!line && glen == 0)
+                break;
+
+            end = strchr(p, '\n');
+            wlen = end ? (UINT)(end - p) : (UINT)strlen(p);
+            if (wlen && p[wlen - 1] == '\r')
+                wlen--;
+            CHECK(glen == wlen && memcmp(got, p, wlen) == 0);
+            p = end ? end + 1 : p + wlen;
+        }
+        CHECK(*p == 0);
+        CHECK(f_close(fp) == FR_OK);
+    }
+}
+
+static void list_name(char* name, size_t size, int i)
+{
+    snprintf(name, size, (i % 10) ? "list/Entry %03d.dat" : "list/E%03d.TXT", i);
+}
+
+// FNV-1a of the up-cased name, as f_readdirn hashes it
+static DWORD upper_hash(const char* name)
+{
+    DWORD h = 0x811C9DC5;
+
+    for (; *name; name++)
+        h = ((h ^ (BYTE)toupper((BYTE)*name)) * 0x01000193) & 0xFFFFFFFF;
+    return h;
+}
+
+/* f_readdirn returns every item of a directory with deleted entries once,
+   also when the name buffer cuts a batch short, with the information that
+   f_stat and f_open give for it */
+static void check_readdirn(void)
+{
+    static char names[LIST_FILES][24], nbuf[40];
+    static FILEENT ents[LIST_FILES];
+    FIL* fp = &USERFile;
+    FILEENT ent[7];
+    FILINFO fno;
+    DIR dir;
+    UINT n, total, cut;
+    char name[24];
+
+    /* Enough files for the directory to be indexed, then a third of the
+       first 100 removed and the holes taken by new ones */
+    CHECK(f_mkdir("list") == FR_OK);
+    for (int i = 0; i < LIST_FILES; i++) {
+        if (i == 100) {
+            for (int d = 1; d < 100; d += 3) {
+                list_name(name, sizeof name, d);
+                CHECK(f_unlink(name) == FR_OK);
+            }
+        }
+        list_name(name, sizeof name, i);
+        CHECK(f_open(fp, name, FA_WRITE | FA_CREATE_NEW) == FR_OK);
+        if (i % 4)
+            write_at(fp, 0, i * 7);
+        CHECK(f_close(fp) == FR_OK);
+    }
+
+    /* Not even one name fits: nothing is read and the item is kept */
+    CHECK(f_opendir(&dir, "list") == FR_OK);
+    CHECK(f_readdirn(&dir, ent, 7, nbuf, 5, &n) == FR_INVALID_PARAMETER);
+    CHECK(n == 0);
+
+    total = cut = 0;
+    for (;;) {
+        CHECK(f_readdirn(&dir, ent, 7, nbuf, sizeof nbuf, &n) == FR_OK);
+        if (n == 0)
+            break;
+        if (n < 7)
+            cut++;
+        for (UINT k = 0; k < n; k++, total++) {
+            CHECK(total < LIST_FILES && ent[k].fname);
+            CHECK(ent[k].nhash == upper_hash(ent[k].fname));
+            snprintf(names[total], sizeof names[total], "list/%s", ent[k].fname);
+            ents[total] = ent[k];
+        }
+    }
+    CHECK(f_closedir(&dir) == FR_OK);
+    CHECK(cut > 1); /* The name buffer takes two or three names */
+
+    /* The directory is closed first: check_dropped() left a file lock taken */
+    for (UINT k = 0; k < total; k++) {
+        CHECK(f_stat(names[k], &fno) == FR_OK);
+        CHECK(strcmp(fno.fname, names[k] + 5) == 0);
+        CHECK(fno.fsize == ents[k].fsize && fno.fattrib == ents[k].fattrib);
+        CHECK(fno.fdate == ents[k].fdate && fno.ftime == ents[k].ftime);
+        CHECK(f_open(fp, names[k], FA_READ) == FR_OK);
+        CHECK(fp->obj.sclust == ents[k].sclust);
+        CHECK((ents[k].sclust != 0) == (ents[k].fsize != 0));
+        CHECK(f_close(fp) == FR_OK);
+    }
+
+    /* Every file there is read once, none of those removed */
+    CHECK(total == LIST_FILES - 33);
+    for (int i = 0; i < LIST_FILES; i++) {
+        UINT found = 0;
+
+        list_name(name, sizeof name, i);
+        for (UINT k = 0; k < total; k++)
+            found += (strcmp(names[k], name) == 0);
+        CHECK(found == ((i < 100 && i % 3 == 1) ? 0 : 1));
+    }
+
+    /* Without the name buffer, only the hashes of the names */
+    CHECK(f_opendir(&dir, "list") == FR_OK);
+    for (UINT k = 0;;) {
+        CHECK(f_readdirn(&dir, ent, 7, 0, 0, &n) == FR_OK);
+        if (n == 0) {
+            CHECK(k == total);
+            break;
+        }
+        CHECK(n == 7 || k + n == total);
+        for (UINT j = 0; j < n; j++, k++)
+            CHECK(!ent[j].fname && ent[j].nhash == ents[k].nhash);
+    }
+    CHECK(f_closedir(&dir) == FR_OK);
+}
+
+/* The part of a stream block not written is released at f_close, also when
+   the card failed while the stream was written */
+static void check_stream_error(void)
+{
+    FIL* fp = &USERFile;
+    FATFS* fs;
+    DWORD nfree, nfree_before, bcs, size;
+    UINT bw;
+
+    CHECK(f_getfree(USERPath, &nfree_before, &fs) == FR_OK);
+    bcs = fs->csize * 512UL;
+    CHECK(f_open(fp, "stream.bin", FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_expand(fp, 64 * bcs, 2) == FR_OK);
+    write_at(fp, 0, CHUNK);
+
+    sd_emu_insert(0);
+    fill(Buf, CHUNK, CHUNK);
+    CHECK(f_write(fp, Buf, CHUNK, &bw) != FR_OK || f_sync(fp) != FR_OK);
+    CHECK(fp->err != FR_OK);
+    sd_emu_insert(1);
+    CHECK(USER_SPI_initialize(0) == 0);
+
+    size = f_size(fp);
+    CHECK(f_close(fp) == FR_OK);
+    CHECK(f_getfree(USERPath, &nfree, &fs) == FR_OK);
+    CHECK(nfree_before - nfree == (size + bcs - 1) / bcs);
+}
+
+/* A file left open by a reset keeps the size of its last directory update,
+   the clusters appended by lazy syncs after it go back to the free space */
+static void check_lazy_reset(void)
+{
+    FIL* fp = &USERFile;
+    FATFS* fs;
+    DWORD nfree, nfree_marked;
+
+    CHECK(f_open(fp, "log.txt", FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    write_at(fp, 0, 300);
+    CHECK(f_sync(fp) == FR_OK);
+    write_at(fp, 300, 100);
+    CHECK(f_sync(fp) == FR_OK); /* Records 400 bytes and marks the entry */
+    CHECK(f_getfree(USERPath, &nfree_marked, &fs) == FR_OK);
+    for (DWORD ofs = 400; ofs < 400 + 8 * CHUNK; ofs += CHUNK) {
+        write_at(fp, ofs, CHUNK);
+        CHECK(f_sync(fp) == FR_OK); /* Data and FAT only */
+    }
+    CHECK(f_getfree(USERPath, &nfree, &fs) == FR_OK);
+    CHECK(nfree < nfree_marked);
+
+    /* Reset without f_close */
+    board_card(IMAGE, 0, SD_EMU_SDHC, &sd_emu_profile_typical, 0);
+    CHECK(USER_SPI_initialize(0) == 0);
+    CHECK(f_mount(&USERFatFS, USERPath, 1) == FR_OK);
+    check_content("log.txt", 400);
+
+    CHECK(f_open(fp, "log.txt", FA_WRITE | FA_OPEN_APPEND) == FR_OK);
+    CHECK(f_size(fp) == 400);
+    write_at(fp, 400, 10);
+    CHECK(f_close(fp) == FR_OK);
+    check_content("log.txt", 410);
+    CHECK(f_getfree(USERPath, &nfree, &fs) == FR_OK);
+    CHECK(nfree == nfree_marked);
+}
+
+int main(void)
+{
+    sd_emu_stats_t st;
+
+    board_card(IMAGE, 131072, SD_EMU_SDHC, &sd_emu_profile_typical, 0);
+    MX_FATFS_Init();
+    CHECK(retUSER == 0);
+
+    CHECK(f_mkfs(USERPath, FM_FAT32, 0, Work, sizeof Work) == FR_OK);
+    CHECK(f_mount(&USERFatFS, USERPath, 1) == FR_OK);
+    write_files();
+    read_files();
+    check_dropped();
+    check_lines();
+    check_readdirn();
+    check_stream_error();
+    CHECK(f_mount(0, USERPath, 0) == FR_OK);
+
+    /* Power cycle: everything has to be on the image. disk_initialize only
+       reaches the driver once, so bring the card up again directly */
+    board_card(IMAGE, 0, SD_EMU_SDHC, &sd_emu_profile_typical, 0);
+    CHECK(USER_SPI_initialize(0) == 0);
+    CHECK(f_mount(&USERFatFS, USERPath, 1) == FR_OK);
+    read_files();
+    check_lazy_reset();
+    CHECK(f_mount(0, USERPath, 0) == FR_OK);
+
+    sd_emu_get_stats(&st);
+    CHECK(st.errors == 0);
+    sd_emu_close();
+    unlink(IMAGE);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,176 @@
+/**
+ ******************************************************************************
+ * @file    test_sd_spi.c
+ * @brief   user_diskio_spi.c against emulated SDHC, SDSC, SD ver 1 and MMC
+ *          cards
+ ******************************************************************************
+ */
+
+#include "board.h"
+#include "user_diskio_spi.h"
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "test_sd_spi.img"
+
+static BYTE Buf[16 * 512];
+static BYTE Ref[16 * 512];
+
+static void fill(BYTE* p, UINT n, DWORD seed)
+{
+    for (UINT i = 0; i < n; i++)
+        p[i] = (BYTE)(seed * 131 + i * 7 + (i >> 9));
+}
+
+/* Compare with the image file directly */
+static int on_image(DWORD sector, const BYTE* p, UINT count)
+{
+    static BYTE img[sizeof Buf];
+    FILE* fp = fopen(IMAGE, "rb");
+    int same;
+
+    CHECK(fp);
+    fseek(fp, (long)sector * 512, SEEK_SET);
+    CHECK(fread(img, 512, count, fp) == count);
+    fclose(fp);
+    same = memcmp(img, p, count * 512) == 0;
+    return same;
+}
+
+static void check_card(sd_emu_card_t card, uint32_t sectors, DWORD count,
+                       DWORD block)
+{
+    sd_emu_stats_t st;
+    DWORD dw, range[2];
+
+    board_card(IMAGE, sectors, card, &sd_emu_profile_typical, 0);
+    CHECK(USER_SPI_initialize(0) == 0);
+    CHECK(USER_SPI_status(0) == 0);
+
+    CHECK(USER_SPI_ioctl(0, GET_SECTOR_COUNT, &dw) == RES_OK);
+    CHECK(dw == count);
+    CHECK(USER_SPI_ioctl(0, GET_BLOCK_SIZE, &dw) == RES_OK);
+    CHECK(dw == block);
+    CHECK(USER_SPI_ioctl(0, MMC_GET_CSD, Buf) == RES_OK);
+    CHECK(USER_SPI_ioctl(0, CTRL_SYNC, 0) == RES_OK);
+
+    /* Single and multiple block writes, continued in the next call */
+    fill(Ref, sizeof Ref, card);
+    CHECK(USER_SPI_write(0, Ref, 5, 1) == RES_OK);
+    CHECK(USER_SPI_write(0, Ref + 512, 100, 8) == RES_OK);
+    CHECK(USER_SPI_write(0, Ref + 9 * 512, 108, 7) == RES_OK);
+    CHECK(USER_SPI_ioctl(0, CTRL_SYNC, 0) == RES_OK);
+    CHECK(on_image(5, Ref, 1));
+    CHECK(on_image(100, Ref + 512, 15));
+
+    /* Single and multiple block reads, continued in the next call */
+    memset(Buf, 0, sizeof Buf);
+    CHECK(USER_SPI_read(0, Buf, 5, 1) == RES_OK);
+    CHECK(memcmp(Buf, Ref, 512) == 0);
+    CHECK(USER_SPI_read(0, Buf, 100, 4) == RES_OK);
+    CHECK(USER_SPI_read(0, Buf + 4 * 512, 104, 11) == RES_OK);
+    CHECK(memcmp(Buf, Ref + 512, 15 * 512) == 0);
+
+    /* An idle stream gets closed by the poll */
+    sd_emu_advance(200 * 1000000ULL);
+    USER_SPI_poll();
+    CHECK(USER_SPI_read(0, Buf, 104, 1) == RES_OK);
+    CHECK(memcmp(Buf, Ref + 5 * 512, 512) == 0);
+
+    /* Erase, SD cards only */
+    range[0] = 100;
+    range[1] = 107;
+    if (card == SD_EMU_MMC) {
+        CHECK(USER_SPI_ioctl(0, CTRL_TRIM, range) != RES_OK);
+    } else {
+        CHECK(USER_SPI_ioctl(0, CTRL_ZERO, range) == RES_OK);
+        CHECK(USER_SPI_read(0, Buf, 99, 10) == RES_OK);
+        memset(Ref, 0, 8 * 512);
+        CHECK(memcmp(Buf + 512, Ref, 8 * 512) == 0);
+        CHECK(on_image(100, Ref, 8));
+    }
+
+    /* Beyond the end of the card */
+    CHECK(USER_SPI_read(0, Buf, count, 1) == RES_ERROR);
+    CHECK(USER_SPI_read(0, Buf, 0, 1) == RES_OK);
+
+    sd_emu_get_stats(&st);
+    CHECK(st.errors == 0);
+    printf("card %d: %u commands, %u blocks read, %u written, %.1f ms\n",
+           card, st.cmds, st.blocks_read, st.blocks_written, board_ms());
+    sd_emu_close();
+}
+
+/* Erased blocks read back 0xFF: CTRL_ZERO is refused, CTRL_TRIM is not */
+static void check_erased_ones(void)
+{
+    sd_emu_config_t config = {
+        .image = IMAGE,
+        .card = SD_EMU_SDHC,
+        .erased = 0xFF,
+    };
+    DWORD range[2] = {8, 15};
+
+    CHECK(sd_emu_create(IMAGE, 65536) == 0);
+    CHECK(sd_emu_open(&hspi3, &config) == 0);
+    CHECK(USER_SPI_initialize(0) == 0);
+    CHECK(USER_SPI_ioctl(0, CTRL_ZERO, range) == RES_PARERR);
+    CHECK(USER_SPI_ioctl(0, CTRL_TRIM, range) == RES_OK);
+    CHECK(USER_SPI_read(0, Buf, 8, 8) == RES_OK);
+    memset(Ref, 0xFF, 8 * 512);
+    CHECK(memcmp(Buf, Ref, 8 * 512) == 0);
+    sd_emu_close();
+}
+
+/* Writes keep landing through long busy periods of a worn card */
+static void check_slow_card(void)
+{
+    sd_emu_stats_t st;
+
+    board_card(IMAGE, 65536, SD_EMU_SDHC, &sd_emu_profile_slow, 0);
+    CHECK(USER_SPI_initialize(0) == 0);
+    for (DWORD sect = 0; sect < 64; sect += 16) {
+        fill(Ref, sizeof Ref, sect);
+        CHECK(USER_SPI_write(0, Ref, 1000 + sect, 16) == RES_OK);
+    }
+    CHECK(USER_SPI_ioctl(0, CTRL_SYNC, 0) == RES_OK);
+    for (DWORD sect = 0; sect < 64; sect += 16) {
+        fill(Ref, sizeof Ref, sect);
+        CHECK(USER_SPI_read(0, Buf, 1000 + sect, 16) == RES_OK);
+        CHECK(memcmp(Buf, Ref, sizeof Buf) == 0);
+    }
+    sd_emu_get_stats(&st);
+    CHECK(st.errors == 0);
+    CHECK(board_ms() > 4 * sd_emu_profile_slow.stall_us / 1000);
+    printf("slow card: %.1f ms\n", board_ms());
+    sd_emu_close();
+}
+
+/* No card in the socket, and a card pulled after initialization */
+static void check_no_card(void)
+{
+    board_card(IMAGE, 65536, SD_EMU_SDHC, 0, 0);
+    sd_emu_insert(0);
+    CHECK(USER_SPI_initialize(0) == STA_NOINIT);
+    CHECK(USER_SPI_read(0, Buf, 0, 1) == RES_NOTRDY);
+    sd_emu_insert(1);
+    CHECK(USER_SPI_initialize(0) == 0);
+    sd_emu_insert(0);
+    CHECK(USER_SPI_read(0, Buf, 0, 1) == RES_ERROR);
+    CHECK(USER_SPI_write(0, Buf, 0, 1) == RES_ERROR);
+    sd_emu_close();
+}
+
+int main(void)
+{
+    check_card(SD_EMU_SDHC, 131072, 131072, 8192);
+    check_card(SD_EMU_SDSC, 65536, 65536, 8192);
+    check_card(SD_EMU_SDV1, 32768, 32768, 128);
+    check_card(SD_EMU_MMC, 32768, 32768, 1024);
+    check_erased_ones();
+    check_slow_card();
+    check_no_card();
+    unlink(IMAGE);
+    printf("OK\n");
+    return 0;
+}
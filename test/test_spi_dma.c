@@ -0,0 +1,142 @@
+/**
+ ******************************************************************************
+ * @file    test_spi_dma.c
+ * @brief   DMA transfer state machine of user_diskio_spi.c: completion,
+ *          errors, timeouts, foreign callbacks, and the CPU time left to the
+ *          application compared to polled transfers
+ ******************************************************************************
+ */
+
+#include "board.h"
+#include "user_diskio_spi.h"
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "test_spi_dma.img"
+#define TOTAL 2048    /* Sectors moved per timing run, 1 MiB */
+#define SAMPLE_NS 2000 /* One sensor sample of the application */
+
+static BYTE Buf[8 * 512];
+static BYTE Ref[8 * 512];
+
+static uint32_t Samples;          /* Sensor samples taken in USER_SPI_yield */
+static int Foreign;               /* Completions of another handle to raise */
+static SPI_HandleTypeDef Hother;  /* Another SPI user */
+
+/* The application keeps sampling while the driver waits */
+void USER_SPI_yield(void)
+{
+    Samples++;
+    sd_emu_advance(SAMPLE_NS);
+    if (Foreign) {
+        Foreign--;
+        HAL_SPI_TxRxCpltCallback(&Hother);
+        HAL_SPI_ErrorCallback(&Hother);
+    }
+}
+
+static void fill(BYTE* p, UINT n, DWORD seed)
+{
+    for (UINT i = 0; i < n; i++)
+        p[i] = (BYTE)(seed * 37 + i * 11 + (i >> 9));
+}
+
+/* 1 MiB each way, returns the CPU time the driver kept for itself [ms] */
+static double timed_run(int dma)
+{
+    sd_emu_stats_t st;
+    double t0, ms, cpu;
+
+    board_card(IMAGE, 65536, SD_EMU_SDHC, &sd_emu_profile_typical, dma);
+    CHECK(USER_SPI_initialize(0) == 0);
+
+    Samples = 0;
+    t0 = board_ms();
+    for (DWORD sect = 0; sect < TOTAL; sect += 8) {
+        fill(Buf, sizeof Buf, sect);
+        CHECK(USER_SPI_write(0, Buf, sect, 8) == RES_OK);
+    }
+    CHECK(USER_SPI_ioctl(0, CTRL_SYNC, 0) == RES_OK);
+    for (DWORD sect = 0; sect < TOTAL; sect += 8) {
+        CHECK(USER_SPI_read(0, Buf, sect, 8) == RES_OK);
+        fill(Ref, sizeof Ref, sect);
+        CHECK(memcmp(Buf, Ref, sizeof Buf) == 0);
+    }
+    ms = board_ms() - t0;
+    cpu = ms - Samples * (SAMPLE_NS / 1e6);
+
+    sd_emu_get_stats(&st);
+    CHECK(st.errors == 0);
+    CHECK(dma ? st.dma_calls == 2 * TOTAL : st.dma_calls == 0);
+    printf("%s: %.1f ms for 2 MiB, %u samples taken, driver kept the CPU "
+           "for %.1f ms (%.0f%%)\n",
+           dma ? "DMA" : "polled", ms, Samples, cpu, 100 * cpu / ms);
+    sd_emu_close();
+    return cpu;
+}
+
+static void check_faults(void)
+{
+    sd_emu_stats_t st;
+    double t0;
+
+    board_card(IMAGE, 65536, SD_EMU_SDHC, &sd_emu_profile_typical, 1);
+    CHECK(USER_SPI_initialize(0) == 0);
+    fill(Ref, sizeof Ref, 1);
+    CHECK(USER_SPI_write(0, Ref, 64, 8) == RES_OK);
+
+    /* The TX stream walks memory again after a read repeated 0xFF */
+    CHECK(USER_SPI_read(0, Buf, 64, 8) == RES_OK);
+    CHECK(memcmp(Buf, Ref, sizeof Buf) == 0);
+    CHECK(hspi3.hdmatx->Instance->CR & DMA_SxCR_MINC);
+
+    /* Transfer errors fail the request, the next one starts over */
+    sd_emu_dma_fault(SD_EMU_DMA_ERROR);
+    CHECK(USER_SPI_read(0, Buf, 64, 8) == RES_ERROR);
+    CHECK(USER_SPI_read(0, Buf, 64, 8) == RES_OK);
+    CHECK(memcmp(Buf, Ref, sizeof Buf) == 0);
+    sd_emu_dma_fault(SD_EMU_DMA_ERROR);
+    CHECK(USER_SPI_write(0, Ref, 128, 8) == RES_ERROR);
+    CHECK(USER_SPI_write(0, Ref, 128, 8) == RES_OK);
+    CHECK(USER_SPI_read(0, Buf, 128, 8) == RES_OK);
+    CHECK(memcmp(Buf, Ref, sizeof Buf) == 0);
+    sd_emu_dma_fault(SD_EMU_DMA_STALL);
+    CHECK(USER_SPI_write(0, Ref, 256, 8) == RES_ERROR);
+    CHECK(USER_SPI_write(0, Ref, 256, 8) == RES_OK);
+    CHECK(USER_SPI_read(0, Buf, 256, 8) == RES_OK);
+    CHECK(memcmp(Buf, Ref, sizeof Buf) == 0);
+
+    /* A transfer that never completes is aborted after 500 ms */
+    sd_emu_dma_fault(SD_EMU_DMA_STALL);
+    t0 = board_ms();
+    CHECK(USER_SPI_read(0, Buf, 64, 8) == RES_ERROR);
+    CHECK(board_ms() - t0 >= 500);
+    CHECK(hspi3.State == HAL_SPI_STATE_READY);
+    sd_emu_get_stats(&st);
+    CHECK(st.aborts == 2);
+    CHECK(USER_SPI_read(0, Buf, 64, 8) == RES_OK);
+    CHECK(memcmp(Buf, Ref, sizeof Buf) == 0);
+
+    /* Completions on other handles do not end the driver's transfer */
+    Foreign = 1000;
+    memset(Buf, 0, sizeof Buf);
+    CHECK(USER_SPI_read(0, Buf, 64, 8) == RES_OK);
+    CHECK(memcmp(Buf, Ref, sizeof Buf) == 0);
+    CHECK(Foreign == 0);
+    Foreign = 0;
+
+    sd_emu_close();
+}
+
+int main(void)
+{
+    double polled, dma;
+
+    polled = timed_run(0);
+    dma = timed_run(1);
+    CHECK(dma < polled / 2);
+    check_faults();
+    unlink(IMAGE);
+    printf("OK\n");
+    return 0;
+}